@@ -0,0 +1,106 @@
+#include "bench.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+Summary summarize(std::vector<double> samples) {
+    Summary res;
+    if (samples.empty()) {
+        return res;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t count = samples.size();
+    res.min = samples.front();
+    res.median = count % 2 == 1 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    // nearest-rank percentile
+    size_t rank = static_cast<size_t>(std::ceil(0.95 * count));
+    res.p95 = samples[std::max<size_t>(rank, 1) - 1];
+    return res;
+}
+
+bool measure(const BenchOptions& options, const std::function<double()>& run, Record& record) {
+    for (int i = 0; i < options.warmup; ++i) {
+        if (run() < 0) {
+            return false;
+        }
+    }
+    std::vector<double> wall;
+    std::vector<double> kernel;
+    for (int i = 0; i < options.reps; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        double time = run();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (time < 0) {
+            return false;
+        }
+        wall.push_back(elapsed);
+        kernel.push_back(time);
+    }
+    record.reps = options.reps;
+    record.wall = summarize(wall);
+    record.kernel = summarize(kernel);
+    return true;
+}
+
+void write_text(FILE* out, const std::vector<Record>& records, const std::string& commit) {
+    fprintf(out, "commit %s\n", commit.c_str());
+    fprintf(out, "%-12s %-16s %-8s %12s %12s %12s %12s %12s %12s %10s %10s\n", "op", "size", "check",
+            "kernel min", "kernel med", "kernel p95", "wall min", "wall med", "wall p95", "kernel", "wall");
+    for (const Record& r : records) {
+        fprintf(out, "%-12s %-16s %-8s %10.3fms %10.3fms %10.3fms %10.3fms %10.3fms %10.3fms %10.2f %10.2f %s",
+                r.op.c_str(), r.size.c_str(), r.ok ? "ok" : "FAILED", r.kernel.min * 1e3, r.kernel.median * 1e3,
+                r.kernel.p95 * 1e3, r.wall.min * 1e3, r.wall.median * 1e3, r.wall.p95 * 1e3, r.kernel_rate(),
+                r.wall_rate(), r.metric.c_str());
+        if (r.bytes > 0) {
+            fprintf(out, ", wall %.2f GB/s", r.wall_bandwidth());
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void write_csv(FILE* out, const std::vector<Record>& records, const std::string& commit) {
+    fprintf(out, "commit,op,size,device,ok,reps,kernel_min_s,kernel_median_s,kernel_p95_s,"
+                 "wall_min_s,wall_median_s,wall_p95_s,metric,kernel_rate,wall_rate,bytes,wall_gbps\n");
+    for (const Record& r : records) {
+        fprintf(out, "%s,%s,%s,\"%s\",%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%s,%.4f,%.4f,%.0f,%.4f\n", commit.c_str(),
+                r.op.c_str(), r.size.c_str(), r.device.c_str(), r.ok ? 1 : 0, r.reps, r.kernel.min, r.kernel.median,
+                r.kernel.p95, r.wall.min, r.wall.median, r.wall.p95, r.metric.c_str(), r.kernel_rate(),
+                r.wall_rate(), r.bytes, r.wall_bandwidth());
+    }
+}
+
+namespace {
+
+std::string json_string(const std::string& value) {
+    std::string res = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') res += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) res += c;
+    }
+    return res + "\"";
+}
+
+void json_summary(FILE* out, const char* name, const Summary& summary) {
+    fprintf(out, "\"%s\": {\"min\": %.9f, \"median\": %.9f, \"p95\": %.9f}", name, summary.min, summary.median,
+            summary.p95);
+}
+
+}
+
+void write_json(FILE* out, const std::vector<Record>& records, const std::string& commit) {
+    fprintf(out, "{\n  \"commit\": %s,\n  \"results\": [\n", json_string(commit).c_str());
+    for (size_t i = 0; i < records.size(); ++i) {
+        const Record& r = records[i];
+        fprintf(out, "    {\"op\": %s, \"size\": %s, \"device\": %s, \"ok\": %s, \"reps\": %d, ",
+                json_string(r.op).c_str(), json_string(r.size).c_str(), json_string(r.device).c_str(),
+                r.ok ? "true" : "false", r.reps);
+        json_summary(out, "kernel_s", r.kernel);
+        fprintf(out, ", ");
+        json_summary(out, "wall_s", r.wall);
+        fprintf(out, ", \"metric\": %s, \"kernel_rate\": %.4f, \"wall_rate\": %.4f", json_string(r.metric).c_str(),
+                r.kernel_rate(), r.wall_rate());
+        fprintf(out, ", \"bytes\": %.0f, \"wall_gbps\": %.4f}%s\n", r.bytes, r.wall_bandwidth(),
+                i + 1 < records.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Order statistics of a set of timings, in seconds.
+struct Summary {
+    double min    { 0.0 };
+    double median { 0.0 };
+    double p95    { 0.0 };
+};
+
+Summary summarize(std::vector<double> samples);
+
+struct BenchOptions {
+    int         warmup { 2 };
+    int         reps   { 10 };
+    bool        tune   { false };
+    std::string device;
+};
+
+// One benchmarked case.
+// work is the amount of useful work of one run in the metric's unit times 1e9
+// (flops for GFLOPS, bytes for GB/s), the metric is reported for the median kernel and wall times.
+struct Record {
+    std::string op;
+    std::string size;
+    std::string device;
+    std::string metric;
+    double      work { 0.0 };
+    // bytes of the operands and the result of one run, reported as GB/s at the median wall time if set
+    double      bytes { 0.0 };
+    int         reps { 0 };
+    Summary     wall;
+    Summary     kernel;
+    bool        ok   { false };
+
+    double kernel_rate() const { return kernel.median > 0 ? work / kernel.median / 1e9 : 0.0; }
+    double wall_rate() const   { return wall.median > 0 ? work / wall.median / 1e9 : 0.0; }
+    double wall_bandwidth() const { return wall.median > 0 ? bytes / wall.median / 1e9 : 0.0; }
+};
+
+// Calls run warmup + reps times and summarizes the last reps calls.
+// run returns the device (kernel) time of the call in seconds, or a negative value on failure;
+// the wall-clock time is measured around the whole call.
+bool measure(const BenchOptions& options, const std::function<double()>& run, Record& record);
+
+void write_text(FILE* out, const std::vector<Record>& records, const std::string& commit);
+void write_csv(FILE* out, const std::vector<Record>& records, const std::string& commit);
+void write_json(FILE* out, const std::vector<Record>& records, const std::string& commit);
@@ -0,0 +1,17 @@
+# Writes OUTPUT defining BENCH_COMMIT as the current commit of SOURCE_DIR, run on every build.
+# The file is only rewritten when the commit changes, so an unchanged tree doesn't rebuild Bench.
+execute_process(COMMAND git rev-parse --short HEAD
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_VARIABLE BENCH_COMMIT
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        ERROR_QUIET)
+if (NOT BENCH_COMMIT)
+    set(BENCH_COMMIT unknown)
+endif ()
+set(CONTENT "#define BENCH_COMMIT \"${BENCH_COMMIT}\"\n")
+if (EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} OLD_CONTENT)
+endif ()
+if (NOT "${CONTENT}" STREQUAL "${OLD_CONTENT}")
+    file(WRITE ${OUTPUT} "${CONTENT}")
+endif ()
@@ -0,0 +1,1495 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include <unistd.h>
+#include <parallel/algorithm>
+#include "../utils.h"
+#include "bench.h"
+#include "gemm.h"
+#include "matrix_expr.h"
+#include "matrix_mul.h"
+#include "mixed_precision.h"
+#include "multi_device.h"
+#include "numa.h"
+#include "pref_sum.h"
+#include "scan.h"
+#include "scan_dispatch.h"
+#include "sort.h"
+#include "sparse_mul.h"
+#include "trace.h"
+// generated on every build, defines BENCH_COMMIT
+#include "bench_commit.h"
+
+namespace {
+
+// densities of A around the crossover of the sparse and dense multiplications
+const char* const SPARSE_SWEEP = "2048:0.005,2048:0.01,2048:0.02,2048:0.05,2048:0.1,2048:0.2,2048:0.5";
+
+using BenchFunction = std::function<Record(const std::string&, const BenchOptions&)>;
+
+struct Op {
+    const char*   name;
+    const char*   sizes;
+    bool          opencl;
+    BenchFunction run;
+};
+
+// "M", or "MxKxN", optionally prefixed by "half:", "bf16:" or "int8:"
+MatrixShape parse_gemm_size(const std::string& size) {
+    MatrixShape shape;
+    const char* types[] = { "float:", "half:", "bf16:", "int8:" };
+    size_t start = 0;
+    for (int type = 0; type < 4; ++type) {
+        if (size.compare(0, strlen(types[type]), types[type]) == 0) {
+            shape.type = static_cast<MatrixType>(type);
+            start = strlen(types[type]);
+        }
+    }
+    unsigned long m = 0, k = 0, n = 0;
+    int parsed = sscanf(size.c_str() + start, "%lux%lux%lu", &m, &k, &n);
+    shape.M = m;
+    shape.K = parsed == 3 ? k : m;
+    shape.N = parsed == 3 ? n : m;
+    return shape;
+}
+
+// "BATCH:M", or "BATCH:MxKxN"
+MatrixShape parse_batched_size(const std::string& size, size_t& batch) {
+    size_t colon = size.find(':');
+    batch = strtoul(size.c_str(), nullptr, 10);
+    return parse_gemm_size(colon == std::string::npos ? std::string() : size.substr(colon + 1));
+}
+
+std::vector<std::string> split(const std::string& value, char separator) {
+    std::vector<std::string> res;
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t end = value.find(separator, start);
+        if (end == std::string::npos) end = value.size();
+        if (end > start) res.push_back(value.substr(start, end - start));
+        start = end + 1;
+    }
+    return res;
+}
+
+void init_random(float* array, size_t size, int mode) {
+    for (size_t i = 0; i < size; ++i) {
+        array[i] = static_cast<float>(rand() % mode);
+    }
+}
+
+// The values converted to the type of the shape, in a new array. The values are small integers,
+// so the conversion is exact and the float reference still applies.
+char* convert_values(const float* values, size_t count, MatrixType type) {
+    MatrixShape shape;
+    shape.type = type;
+    char* res = alloc_array<char>(count * shape.elementSize());
+    for (size_t i = 0; i < count; ++i) {
+        switch (type) {
+            case MatrixType::Half: reinterpret_cast<Half*>(res)[i] = floatToHalf(values[i]); break;
+            case MatrixType::Bf16: reinterpret_cast<Bf16*>(res)[i] = floatToBf16(values[i]); break;
+            case MatrixType::Int8: reinterpret_cast<int8_t*>(res)[i] = static_cast<int8_t>(values[i]); break;
+            default:               reinterpret_cast<float*>(res)[i] = values[i];
+        }
+    }
+    return res;
+}
+
+// Operands and result of one multiplication.
+double gemm_bytes(const MatrixShape& shape) {
+    return static_cast<double>(shape.M * shape.K + shape.K * shape.N) * shape.elementSize() +
+           static_cast<double>(shape.M * shape.N) * sizeof(float);
+}
+
+// Compares a sample of result entries with a double-precision dot product.
+bool check_gemm_sample(const float* first, const float* second, const float* result, const MatrixShape& shape) {
+    for (int sample = 0; sample < 64; ++sample) {
+        size_t i = rand() % shape.M;
+        size_t j = rand() % shape.N;
+        double expected = 0.0;
+        for (size_t k = 0; k < shape.K; ++k) {
+            expected += static_cast<double>(first[i * shape.strideA() + k]) * second[k * shape.strideB() + j];
+        }
+        double actual = result[i * shape.strideC() + j];
+        if (std::fabs(actual - expected) > 1e-4 * std::fabs(expected) + 1e-3) {
+            fprintf(stderr, "gemm check failed at (%zu, %zu): expected %f, actual %f\n", i, j, expected, actual);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool check_scan(const float* elements, const float* result, size_t size) {
+    double sum = 0.0;
+    for (size_t i = 0; i < size; ++i) {
+        sum += elements[i];
+        if (std::fabs(result[i] - sum) > 1e-5 * sum + 1e-3) {
+            fprintf(stderr, "scan check failed at %zu: expected %f, actual %f\n", i, sum, result[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+Record bench_gemm_cl(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    MatrixShape shape = parse_gemm_size(size);
+    Record record;
+    record.op = "gemm-cl";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GFLOPS";
+    record.work = shape.flops();
+    record.bytes = gemm_bytes(shape);
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_random(first, shape.M * shape.K, 10);
+    init_random(second, shape.K * shape.N, 10);
+    char* firstData  = convert_values(first, shape.M * shape.K, shape.type);
+    char* secondData = convert_values(second, shape.K * shape.N, shape.type);
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer firstBuffer(runtime, firstData, shape.M * shape.K * shape.elementSize(), CL_MEM_READ_ONLY);
+        HostBuffer secondBuffer(runtime, secondData, shape.K * shape.N * shape.elementSize(), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, result, shape.M * shape.N * sizeof(float), CL_MEM_READ_WRITE);
+        MatrixConfig config = options.tune
+                ? autotune(runtime, shape, firstBuffer.get(), secondBuffer.get(), resultBuffer.get(), false)
+                : tuned_config(runtime, shape);
+
+        // end to end: upload, multiply, download
+        auto run = [&]() -> double {
+            Event event;
+            if (firstBuffer.upload(queue) != CL_SUCCESS || secondBuffer.upload(queue) != CL_SUCCESS ||
+                resultBuffer.upload(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (matrix_mul(runtime, queue, config, shape, firstBuffer.get(), secondBuffer.get(), resultBuffer.get(),
+                           0, nullptr, event.out()) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (resultBuffer.download(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            return event_time(event.get()) / 1e9;
+        };
+        record.ok = measure(options, run, record) && check_gemm_sample(first, second, result, shape);
+    }
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    clear_array(firstData);
+    clear_array(secondData);
+    return record;
+}
+
+Record bench_gemm_omp(const std::string& size, const BenchOptions& options) {
+    MatrixShape shape = parse_gemm_size(size);
+    Record record;
+    record.op = "gemm-omp";
+    record.size = size;
+    record.device = "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads, " + gemmKernelName();
+    record.metric = "GFLOPS";
+    record.work = shape.flops();
+    record.bytes = gemm_bytes(shape);
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_random(first, shape.M * shape.K, 10);
+    init_random(second, shape.K * shape.N, 10);
+    char* firstData  = convert_values(first, shape.M * shape.K, shape.type);
+    char* secondData = convert_values(second, shape.K * shape.N, shape.type);
+
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        switch (shape.type) {
+            case MatrixType::Half:
+                gemm(shape.M, shape.N, shape.K, reinterpret_cast<const Half*>(firstData), shape.K,
+                     reinterpret_cast<const Half*>(secondData), shape.N, result, shape.N);
+                break;
+            case MatrixType::Bf16:
+                gemm(shape.M, shape.N, shape.K, reinterpret_cast<const Bf16*>(firstData), shape.K,
+                     reinterpret_cast<const Bf16*>(secondData), shape.N, result, shape.N);
+                break;
+            case MatrixType::Int8:
+                gemm(shape.M, shape.N, shape.K, reinterpret_cast<const int8_t*>(firstData), shape.K,
+                     reinterpret_cast<const int8_t*>(secondData), shape.N, result, shape.N, 1.0f);
+                break;
+            default:
+                gemm(shape.M, shape.N, shape.K, first, shape.K, second, shape.N, result, shape.N);
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_gemm_sample(first, second, result, shape);
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    clear_array(firstData);
+    clear_array(secondData);
+    return record;
+}
+
+// Epilogue of the gemm-epilogue benchmarks: every part of it is enabled, C starts out negative,
+// so that relu cuts off part of the results.
+struct EpilogueData {
+    float* initial { nullptr };
+    float* rowBias { nullptr };
+    float* colBias { nullptr };
+    float  alpha   { 0.5f };
+    float  beta    { 2.0f };
+
+    explicit EpilogueData(const MatrixShape& shape) {
+        initial = alloc_array<float>(shape.M * shape.N);
+        rowBias = alloc_array<float>(shape.M);
+        colBias = alloc_array<float>(shape.N);
+        for (size_t i = 0; i < shape.M * shape.N; ++i) {
+            initial[i] = -static_cast<float>(rand() % (10 * shape.K + 1));
+        }
+        for (size_t i = 0; i < shape.M; ++i) {
+            rowBias[i] = static_cast<float>(rand() % 2001 - 1000);
+        }
+        for (size_t j = 0; j < shape.N; ++j) {
+            colBias[j] = static_cast<float>(rand() % 2001 - 1000);
+        }
+    }
+    ~EpilogueData() {
+        clear_array(initial);
+        clear_array(rowBias);
+        clear_array(colBias);
+    }
+};
+
+bool check_epilogue_sample(const float* first, const float* second, const float* result, const MatrixShape& shape,
+                           const EpilogueData& epilogue) {
+    for (int sample = 0; sample < 64; ++sample) {
+        size_t i = rand() % shape.M;
+        size_t j = rand() % shape.N;
+        double product = 0.0;
+        for (size_t k = 0; k < shape.K; ++k) {
+            product += static_cast<double>(first[i * shape.K + k]) * second[k * shape.N + j];
+        }
+        double value = epilogue.alpha * product + epilogue.beta * epilogue.initial[i * shape.N + j] +
+                       epilogue.rowBias[i] + epilogue.colBias[j];
+        double expected = std::max(value, 0.0);
+        double actual = result[i * shape.N + j];
+        if (std::fabs(actual - expected) > 1e-4 * std::fabs(value) + 1e-3) {
+            fprintf(stderr, "gemm epilogue check failed at (%zu, %zu): expected %f, actual %f\n", i, j, expected,
+                    actual);
+            return false;
+        }
+    }
+    return true;
+}
+
+// C = relu(alpha * A * B + beta * C + row bias + column bias) in one kernel. The bytes include
+// the read of C and the biases, so GB/s compare with gemm-cl.
+Record bench_gemm_epilogue_cl(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    MatrixShape shape = parse_gemm_size(size);
+    Record record;
+    record.op = "gemm-epilogue-cl";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GFLOPS";
+    record.work = shape.flops();
+    record.bytes = gemm_bytes(shape) + static_cast<double>(shape.M * shape.N + shape.M + shape.N) * sizeof(float);
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_random(first, shape.M * shape.K, 10);
+    init_random(second, shape.K * shape.N, 10);
+    EpilogueData data(shape);
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer firstBuffer(runtime, first, shape.M * shape.K * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer secondBuffer(runtime, second, shape.K * shape.N * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, result, shape.M * shape.N * sizeof(float), CL_MEM_READ_WRITE);
+        HostBuffer rowBuffer(runtime, data.rowBias, shape.M * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer colBuffer(runtime, data.colBias, shape.N * sizeof(float), CL_MEM_READ_ONLY);
+        MatrixConfig config = tuned_config(runtime, shape);
+        MatrixEpilogue epilogue;
+        epilogue.alpha = data.alpha;
+        epilogue.beta = data.beta;
+        epilogue.rowBias = rowBuffer.get();
+        epilogue.colBias = colBuffer.get();
+        epilogue.activation = Activation::Relu;
+
+        auto run = [&]() -> double {
+            Event event;
+            memcpy(result, data.initial, shape.M * shape.N * sizeof(float));
+            if (firstBuffer.upload(queue) != CL_SUCCESS || secondBuffer.upload(queue) != CL_SUCCESS ||
+                resultBuffer.upload(queue) != CL_SUCCESS || rowBuffer.upload(queue) != CL_SUCCESS ||
+                colBuffer.upload(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (matrix_mul(runtime, queue, config, shape, epilogue, firstBuffer.get(), secondBuffer.get(),
+                           resultBuffer.get(), 0, nullptr, event.out()) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (resultBuffer.download(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            return event_time(event.get()) / 1e9;
+        };
+        record.ok = measure(options, run, record) && check_epilogue_sample(first, second, result, shape, data);
+    }
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+Record bench_gemm_epilogue_omp(const std::string& size, const BenchOptions& options) {
+    MatrixShape shape = parse_gemm_size(size);
+    Record record;
+    record.op = "gemm-epilogue-omp";
+    record.size = size;
+    record.device = "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads, " + gemmKernelName();
+    record.metric = "GFLOPS";
+    record.work = shape.flops();
+    record.bytes = gemm_bytes(shape) + static_cast<double>(shape.M * shape.N + shape.M + shape.N) * sizeof(float);
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_random(first, shape.M * shape.K, 10);
+    init_random(second, shape.K * shape.N, 10);
+    EpilogueData data(shape);
+    GemmEpilogue epilogue;
+    epilogue.alpha = data.alpha;
+    epilogue.beta = data.beta;
+    epilogue.rowBias = data.rowBias;
+    epilogue.colBias = data.colBias;
+    epilogue.activation = GemmActivation::Relu;
+
+    auto run = [&]() -> double {
+        memcpy(result, data.initial, shape.M * shape.N * sizeof(float));
+        auto start = std::chrono::steady_clock::now();
+        gemm(shape.M, shape.N, shape.K, first, shape.K, second, shape.N, result, shape.N, epilogue);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_epilogue_sample(first, second, result, shape, data);
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+// Batched results are checked on a sample of the first and the last multiplication.
+bool check_batched(const float* first, const float* second, const float* result, const MatrixShape& shape,
+                   size_t batch) {
+    size_t last = batch - 1;
+    return check_gemm_sample(first, second, result, shape) &&
+           check_gemm_sample(first + last * shape.M * shape.K, second + last * shape.K * shape.N,
+                             result + last * shape.M * shape.N, shape);
+}
+
+// Matrices per second are reported in millions, so the work of a run is batch * 1e3.
+Record batched_record(const char* op, const std::string& size, size_t batch) {
+    Record record;
+    record.op = op;
+    record.size = size;
+    record.metric = "M matrices/s";
+    record.work = batch * 1e3;
+    return record;
+}
+
+Record bench_gemm_batched_cl(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    size_t batch = 0;
+    MatrixShape shape = parse_batched_size(size, batch);
+    Record record = batched_record("gemm-batched-cl", size, batch);
+    record.device = options.device;
+    if (batch == 0 || shape.M == 0) {
+        return record;
+    }
+
+    float* first  = alloc_array<float>(batch * shape.M * shape.K);
+    float* second = alloc_array<float>(batch * shape.K * shape.N);
+    float* result = alloc_array<float>(batch * shape.M * shape.N);
+    init_random(first, batch * shape.M * shape.K, 10);
+    init_random(second, batch * shape.K * shape.N, 10);
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer firstBuffer(runtime, first, batch * shape.M * shape.K * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer secondBuffer(runtime, second, batch * shape.K * shape.N * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, result, batch * shape.M * shape.N * sizeof(float), CL_MEM_READ_WRITE);
+        MatrixConfig config = batched_config(runtime, shape);
+
+        auto run = [&]() -> double {
+            Event event;
+            if (firstBuffer.upload(queue) != CL_SUCCESS || secondBuffer.upload(queue) != CL_SUCCESS ||
+                resultBuffer.upload(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (matrix_mul_batched(runtime, queue, config, shape, batch, firstBuffer.get(), shape.M * shape.K,
+                                   secondBuffer.get(), shape.K * shape.N, resultBuffer.get(), shape.M * shape.N,
+                                   0, nullptr, event.out()) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (resultBuffer.download(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            return event_time(event.get()) / 1e9;
+        };
+        record.ok = measure(options, run, record) && check_batched(first, second, result, shape, batch);
+    }
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+Record bench_gemm_batched_omp(const std::string& size, const BenchOptions& options) {
+    size_t batch = 0;
+    MatrixShape shape = parse_batched_size(size, batch);
+    Record record = batched_record("gemm-batched-omp", size, batch);
+    record.device = "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads, " + gemmKernelName();
+    if (batch == 0 || shape.M == 0) {
+        return record;
+    }
+
+    float* first  = alloc_array<float>(batch * shape.M * shape.K);
+    float* second = alloc_array<float>(batch * shape.K * shape.N);
+    float* result = alloc_array<float>(batch * shape.M * shape.N);
+    init_random(first, batch * shape.M * shape.K, 10);
+    init_random(second, batch * shape.K * shape.N, 10);
+
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        gemmStridedBatched(batch, shape.M, shape.N, shape.K, first, shape.K, shape.M * shape.K,
+                           second, shape.N, shape.K * shape.N, result, shape.N, shape.M * shape.N);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_batched(first, second, result, shape, batch);
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+// Sequential scan of the variant in double for floating-point sums, in T otherwise.
+template<typename T>
+bool check_scan_variant(const ScanVariant& variant, const T* elements, const cl_uchar* flags, const T* result,
+                        size_t size) {
+    bool approximate = variant.op == ScanOp::Sum &&
+                       (variant.type == ScanType::Float || variant.type == ScanType::Double);
+    double identity = variant.op == ScanOp::Sum ? 0.0
+                    : variant.op == ScanOp::Min ? static_cast<double>(std::numeric_limits<T>::max())
+                                                : static_cast<double>(std::numeric_limits<T>::lowest());
+    // exact in T, or the sum in double
+    T exact = static_cast<T>(identity);
+    double sum = 0.0;
+    for (size_t i = 0; i < size; ++i) {
+        if (variant.segmented && flags[i] != 0) {
+            exact = static_cast<T>(identity);
+            sum = 0.0;
+        }
+        T before = exact;
+        double sumBefore = sum;
+        exact = variant.op == ScanOp::Sum ? static_cast<T>(exact + elements[i])
+              : variant.op == ScanOp::Min ? std::min(exact, elements[i]) : std::max(exact, elements[i]);
+        sum += elements[i];
+        double expected = approximate ? (variant.exclusive ? sumBefore : sum)
+                                      : static_cast<double>(variant.exclusive ? before : exact);
+        double actual = static_cast<double>(result[i]);
+        bool ok = approximate ? std::fabs(actual - expected) <= 1e-5 * std::fabs(expected) + 1e-3
+                              : result[i] == (variant.exclusive ? before : exact);
+        if (!ok) {
+            fprintf(stderr, "%s scan check failed at %zu: expected %f, actual %f\n", variant.name().c_str(), i,
+                    expected, actual);
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+Record bench_scan_typed(const std::string& size, const BenchOptions& options, const ScanVariant& variant,
+                        size_t count) {
+    Runtime& runtime = Runtime::instance();
+    Record record;
+    record.op = "scan-cl";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GB/s";
+    // every element is read once and written once, head flags are read once
+    record.work = 2.0 * count * sizeof(T) + (variant.segmented ? count : 0);
+
+    ScanKernels kernels;
+    kernels.variant = variant;
+    if (!load_scan_kernels(runtime, kernels)) {
+        return record;
+    }
+    T* elements = alloc_array<T>(count);
+    T* result = alloc_array<T>(count);
+    cl_uchar* flags = alloc_array<cl_uchar>(count);
+    for (size_t i = 0; i < count; ++i) {
+        // small sums don't overflow and stay exact in float up to 2^24
+        elements[i] = static_cast<T>(variant.op == ScanOp::Sum ? rand() % 4 : rand() % 2001 - 1000);
+        flags[i] = rand() % 64 == 0;
+    }
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer elementsBuffer(runtime, elements, count * sizeof(T), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, result, count * sizeof(T), CL_MEM_READ_WRITE);
+        HostBuffer flagsBuffer;
+        if (variant.segmented) {
+            flagsBuffer = HostBuffer(runtime, flags, count, CL_MEM_READ_ONLY);
+        }
+
+        auto run = [&]() -> double {
+            std::vector<Event> events;
+            std::vector<PooledBuffer> buffers;
+            if (elementsBuffer.upload(queue) != CL_SUCCESS || resultBuffer.upload(queue) != CL_SUCCESS ||
+                (variant.segmented && flagsBuffer.upload(queue) != CL_SUCCESS)) {
+                return -1.0;
+            }
+            if (scan(runtime, queue, kernels, elementsBuffer.get(), resultBuffer.get(), static_cast<cl_uint>(count),
+                     events, buffers, flagsBuffer.get()) != CL_SUCCESS) {
+                clFinish(queue);
+                return -1.0;
+            }
+            if (resultBuffer.download(queue) != CL_SUCCESS ||
+                (variant.segmented && flagsBuffer.download(queue) != CL_SUCCESS)) {
+                return -1.0;
+            }
+            double time = 0.0;
+            for (const Event& event : events) {
+                time += event_time(event.get());
+            }
+            return time / 1e9;
+        };
+        record.ok = measure(options, run, record) && check_scan_variant(variant, elements, flags, result, count);
+    }
+    clear_array(elements);
+    clear_array(result);
+    clear_array(flags);
+    return record;
+}
+
+// "COUNT" for the inclusive float sum, or "VARIANT:COUNT" with a ScanVariant name.
+Record bench_scan_cl(const std::string& size, const BenchOptions& options) {
+    ScanVariant variant;
+    size_t colon = size.find(':');
+    if (colon != std::string::npos && !parse_scan_variant(size.substr(0, colon), variant)) {
+        fprintf(stderr, "Unknown scan variant %s\n", size.substr(0, colon).c_str());
+        Record record;
+        record.op = "scan-cl";
+        record.size = size;
+        return record;
+    }
+    size_t count = strtoul(size.c_str() + (colon == std::string::npos ? 0 : colon + 1), nullptr, 10);
+    switch (variant.type) {
+        case ScanType::Int:    return bench_scan_typed<cl_int>(size, options, variant, count);
+        case ScanType::Long:   return bench_scan_typed<cl_long>(size, options, variant, count);
+        case ScanType::Double: return bench_scan_typed<cl_double>(size, options, variant, count);
+        default:               return bench_scan_typed<cl_float>(size, options, variant, count);
+    }
+}
+
+std::string devices_name(Runtime& runtime) {
+    std::string res;
+    for (size_t d = 0; d < runtime.devices().size(); ++d) {
+        res += (d == 0 ? "" : " + ") + runtime.info(d).name;
+    }
+    return res;
+}
+
+// Host to host through all devices, so wall and kernel time are the same.
+Record bench_gemm_multi(const std::string& size, const BenchOptions& options, SplitMode mode) {
+    Runtime& runtime = Runtime::instance();
+    MatrixShape shape = parse_gemm_size(size);
+    Record record;
+    record.op = mode == SplitMode::Weighted ? "gemm-multi" : "gemm-dynamic";
+    record.size = size;
+    record.device = devices_name(runtime);
+    record.metric = "GFLOPS";
+    record.work = shape.flops();
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    // warmup runs calibrate the split
+    WorkSplitter splitter(runtime);
+    // with NUMA sub-devices every node initializes the rows its device computes
+    std::vector<WorkRange> ranges = splitter.split(shape.M, 64);
+    numa_place(runtime, first, shape.K * sizeof(float), ranges);
+    numa_place(runtime, result, shape.N * sizeof(float), ranges);
+    numa_interleave(second, shape.K * shape.N * sizeof(float));
+    init_random(first, shape.M * shape.K, 10);
+    init_random(second, shape.K * shape.N, 10);
+
+    auto run = [&]() -> double {
+        MultiDeviceStats stats = matrix_mul_multi(runtime, splitter, shape, first, second, result, mode);
+        return stats.ok ? stats.seconds : -1.0;
+    };
+    record.ok = measure(options, run, record) && check_gemm_sample(first, second, result, shape);
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+Record bench_scan_multi(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    size_t count = strtoul(size.c_str(), nullptr, 10);
+    Record record;
+    record.op = "scan-multi";
+    record.size = size;
+    record.device = devices_name(runtime);
+    record.metric = "GB/s";
+    record.work = 2.0 * count * sizeof(float);
+
+    ScanKernels kernels;
+    if (!load_scan_kernels(runtime, kernels)) {
+        return record;
+    }
+    float* elements = alloc_array<float>(count);
+    float* result = alloc_array<float>(count);
+    WorkSplitter splitter(runtime);
+    std::vector<WorkRange> ranges = splitter.split(count, kernels.localWorkSize * kernels.elementsOneThread);
+    numa_place(runtime, elements, sizeof(float), ranges);
+    numa_place(runtime, result, sizeof(float), ranges);
+    init_random(elements, count, 4);
+
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        if (!scan_multi(runtime, splitter, kernels, elements, result, count)) {
+            return -1.0;
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_scan(elements, result, count);
+    clear_array(elements);
+    clear_array(result);
+    return record;
+}
+
+Record bench_scan_omp(const std::string& size, const BenchOptions& options) {
+    size_t count = strtoul(size.c_str(), nullptr, 10);
+    Record record;
+    record.op = "scan-omp";
+    record.size = size;
+    record.device = "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads, " + scanKernelName();
+    record.metric = "GB/s";
+    record.work = 2.0 * count * sizeof(float);
+
+    float* elements = alloc_array<float>(count);
+    float* result = alloc_array<float>(count);
+    init_random(elements, count, 4);
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        inclusiveScan(elements, result, count);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_scan(elements, result, count);
+    clear_array(elements);
+    clear_array(result);
+    return record;
+}
+
+// Host to host through ScanDispatcher, which is calibrated on the first use.
+Record bench_scan_auto(const std::string& size, const BenchOptions& options) {
+    static ScanDispatcher dispatcher(&Runtime::instance());
+    size_t count = strtoul(size.c_str(), nullptr, 10);
+    Record record;
+    record.op = "scan-auto";
+    record.size = size;
+    record.device = dispatcher.uses_opencl(count) ? options.device : std::string("OpenMP");
+    record.metric = "GB/s";
+    record.work = 2.0 * count * sizeof(float);
+
+    float* elements = alloc_array<float>(count);
+    float* result = alloc_array<float>(count);
+    init_random(elements, count, 4);
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        if (!dispatcher.scan(elements, result, count)) {
+            return -1.0;
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_scan(elements, result, count);
+    clear_array(elements);
+    clear_array(result);
+    return record;
+}
+
+// Independent scan -> gemm -> scan chains run by chain-sync and chain-async.
+constexpr size_t CHAINS = 4;
+
+// One chain on M x M device matrices: first is scanned into scanned, scanned times second goes to product,
+// product is scanned into result. With wait every operation is waited for before the next one is enqueued,
+// otherwise the operations only depend on each other through their futures.
+DeviceFuture enqueue_chain(Runtime& runtime, cl_command_queue queue, bool wait, const ScanKernels& kernels,
+                           const MatrixConfig& config, const MatrixShape& shape, cl_mem first, cl_mem second,
+                           cl_mem scanned, cl_mem product, cl_mem result) {
+    cl_uint count = static_cast<cl_uint>(shape.M * shape.K);
+    DeviceFuture scannedDone = scan_async(runtime, queue, kernels, first, scanned, count);
+    if (wait) scannedDone.wait();
+    DeviceFuture productDone = gemm_async(runtime, queue, config, shape, scanned, second, product, { scannedDone });
+    if (wait) productDone.wait();
+    DeviceFuture resultDone = scan_async(runtime, queue, kernels, product, result, count, { productDone });
+    if (wait) resultDone.wait();
+    return resultDone;
+}
+
+// CHAINS chains on the same inputs. chain-sync waits for every operation on the in-order queue,
+// chain-async enqueues all chains on the async queue and waits once at the end, so independent
+// chains overlap and no chain returns to the host in between. Both times are host to host.
+// The results must match a chain run with waits bit for bit.
+Record bench_chain(const std::string& size, const BenchOptions& options, bool async) {
+    Runtime& runtime = Runtime::instance();
+    MatrixShape shape;
+    shape.M = shape.K = shape.N = strtoul(size.c_str(), nullptr, 10);
+    size_t count = shape.M * shape.K;
+    Record record;
+    record.op = async ? "chain-async" : "chain-sync";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GFLOPS";
+    record.work = CHAINS * shape.flops();
+
+    ScanKernels kernels;
+    if (!load_scan_kernels(runtime, kernels)) {
+        return record;
+    }
+    MatrixConfig config = tuned_config(runtime, shape);
+    cl_command_queue queue = async ? runtime.async_queue() : runtime.queue();
+    float* first  = alloc_array<float>(count);
+    float* second = alloc_array<float>(count);
+    float* result = alloc_array<float>(count);
+    float* expected = alloc_array<float>(count);
+    // ones and zeros keep the first scan exact
+    init_random(first, count, 2);
+    init_random(second, count, 2);
+    {
+        HostBuffer firstBuffer(runtime, first, count * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer secondBuffer(runtime, second, count * sizeof(float), CL_MEM_READ_ONLY);
+        // scanned, product and result of every chain, then of the reference chain
+        std::vector<PooledBuffer> buffers;
+        bool ready = true;
+        for (size_t i = 0; i < 3 * (CHAINS + 1) && ready; ++i) {
+            buffers.push_back(runtime.buffers().acquire(count * sizeof(float)));
+            ready = static_cast<bool>(buffers.back());
+        }
+        cl_command_queue inOrder = runtime.queue();
+        ready = ready && firstBuffer.upload(inOrder) == CL_SUCCESS && secondBuffer.upload(inOrder) == CL_SUCCESS;
+        clFinish(inOrder);
+
+        if (ready) {
+            auto run = [&]() -> double {
+                auto start = std::chrono::steady_clock::now();
+                std::vector<DeviceFuture> done;
+                for (size_t c = 0; c < CHAINS; ++c) {
+                    done.push_back(enqueue_chain(runtime, queue, !async, kernels, config, shape,
+                                                 firstBuffer.get(), secondBuffer.get(), buffers[3 * c].get(),
+                                                 buffers[3 * c + 1].get(), buffers[3 * c + 2].get()));
+                    clFlush(queue);
+                }
+                for (const DeviceFuture& future : done) {
+                    if (future.wait() != CL_SUCCESS) {
+                        return -1.0;
+                    }
+                }
+                return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            };
+            record.ok = measure(options, run, record);
+
+            size_t reference = 3 * CHAINS;
+            record.ok = record.ok &&
+                        enqueue_chain(runtime, inOrder, true, kernels, config, shape, firstBuffer.get(),
+                                      secondBuffer.get(), buffers[reference].get(), buffers[reference + 1].get(),
+                                      buffers[reference + 2].get()).ok() &&
+                        clEnqueueReadBuffer(inOrder, buffers[reference + 2].get(), CL_TRUE, 0,
+                                            count * sizeof(float), expected, 0, nullptr, nullptr) == CL_SUCCESS;
+            for (size_t c = 0; c < CHAINS && record.ok; ++c) {
+                record.ok = clEnqueueReadBuffer(inOrder, buffers[3 * c + 2].get(), CL_TRUE, 0,
+                                                count * sizeof(float), result, 0, nullptr, nullptr) == CL_SUCCESS &&
+                            memcmp(result, expected, count * sizeof(float)) == 0;
+                if (!record.ok) {
+                    fprintf(stderr, "Chain %zu differs from the chain run with waits.\n", c);
+                }
+            }
+        }
+    }
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    clear_array(expected);
+    return record;
+}
+
+// Device-to-device copy of the same volume as scan-cl, the bandwidth ceiling for it.
+Record bench_copy_cl(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    size_t bytes = strtoul(size.c_str(), nullptr, 10) * sizeof(float);
+    Record record;
+    record.op = "copy-cl";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GB/s";
+    record.work = 2.0 * bytes;
+
+    cl_command_queue queue = runtime.queue();
+    PooledBuffer source = runtime.buffers().acquire(bytes);
+    PooledBuffer destination = runtime.buffers().acquire(bytes);
+    if (!source || !destination) {
+        return record;
+    }
+    auto run = [&]() -> double {
+        Event event;
+        TracedEvent traced(event.out(), TraceKind::Copy, "copy", 2.0 * bytes);
+        if (traced.done(clEnqueueCopyBuffer(queue, source.get(), destination.get(), 0, 0, bytes, 0, nullptr,
+                                            traced.out())) != CL_SUCCESS) {
+            return -1.0;
+        }
+        clWaitForEvents(1, event.address());
+        return event_time(event.get()) / 1e9;
+    };
+    record.ok = measure(options, run, record);
+    return record;
+}
+
+// Compaction of count floats in [0, 1000) to the ones above 499, about half of them.
+Record bench_compact_cl(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    size_t count = strtoul(size.c_str(), nullptr, 10);
+    Record record;
+    record.op = "compact-cl";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GB/s";
+
+    CompactKernels kernels;
+    kernels.compare = CompareOp::Greater;
+    const double value = 499.0;
+    if (count == 0 || !load_compact_kernels(runtime, kernels)) {
+        return record;
+    }
+    float* elements = alloc_array<float>(count);
+    float* result = alloc_array<float>(count);
+    cl_uint* kept = alloc_array<cl_uint>(1);
+    init_random(elements, count, 1000);
+    std::vector<float> expected;
+    for (size_t i = 0; i < count; ++i) {
+        if (elements[i] > value) {
+            expected.push_back(elements[i]);
+        }
+    }
+    // every element is read, the kept ones are written
+    record.work = static_cast<double>(count + expected.size()) * sizeof(float);
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer elementsBuffer(runtime, elements, count * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, result, count * sizeof(float), CL_MEM_READ_WRITE);
+        HostBuffer keptBuffer(runtime, kept, sizeof(cl_uint), CL_MEM_READ_WRITE);
+
+        auto run = [&]() -> double {
+            std::vector<Event> events;
+            std::vector<PooledBuffer> buffers;
+            if (elementsBuffer.upload(queue) != CL_SUCCESS || resultBuffer.upload(queue) != CL_SUCCESS ||
+                keptBuffer.upload(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (compact(runtime, queue, kernels, elementsBuffer.get(), resultBuffer.get(), keptBuffer.get(),
+                        static_cast<cl_uint>(count), value, events, buffers) != CL_SUCCESS) {
+                clFinish(queue);
+                return -1.0;
+            }
+            if (resultBuffer.download(queue) != CL_SUCCESS || keptBuffer.download(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            double time = 0.0;
+            for (const Event& event : events) {
+                time += event_time(event.get());
+            }
+            return time / 1e9;
+        };
+        record.ok = measure(options, run, record) && kept[0] == expected.size() &&
+                    std::equal(expected.begin(), expected.end(), result);
+        if (!record.ok && kept[0] != expected.size()) {
+            fprintf(stderr, "compact check failed: expected %zu elements, actual %u\n", expected.size(), kept[0]);
+        }
+    }
+    clear_array(elements);
+    clear_array(result);
+    clear_array(kept);
+    return record;
+}
+
+// "COUNT", or "KEYS:COUNT" with KEYS u32, u64, u32-kv or u64-kv; kv sorts a 32-bit value with every key.
+struct SortSize {
+    size_t keyBits { 32 };
+    bool   values  { false };
+    size_t count   { 0 };
+};
+
+SortSize parse_sort_size(const std::string& size) {
+    SortSize res;
+    size_t colon = size.find(':');
+    std::string keys = colon == std::string::npos ? "u32" : size.substr(0, colon);
+    res.keyBits = keys.compare(0, 3, "u64") == 0 ? 64 : 32;
+    res.values = keys.size() > 3 && keys.compare(3, std::string::npos, "-kv") == 0;
+    res.count = strtoul(colon == std::string::npos ? size.c_str() : size.c_str() + colon + 1, nullptr, 10);
+    return res;
+}
+
+// Uniform keys over the whole range of K.
+template<typename K>
+void init_keys(K* keys, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t key = (static_cast<uint64_t>(rand()) << 42) ^ (static_cast<uint64_t>(rand()) << 21) ^ rand();
+        keys[i] = static_cast<K>(sizeof(K) == 8 ? key : key ^ (key >> 32));
+    }
+}
+
+// Sort throughput is reported in millions of keys per second.
+Record sort_record(const char* op, const std::string& size, const SortSize& sort) {
+    Record record;
+    record.op = op;
+    record.size = size;
+    record.metric = "M keys/s";
+    record.work = sort.count * 1e3;
+    record.bytes = static_cast<double>(sort.count) * (sort.keyBits / 8 + (sort.values ? sizeof(cl_uint) : 0));
+    return record;
+}
+
+// keys has to be the sorted original; values, if any, the original positions of the keys.
+template<typename K>
+bool check_sorted(const K* original, const K* keys, const cl_uint* values, size_t count) {
+    std::vector<K> expected(original, original + count);
+    std::sort(expected.begin(), expected.end());
+    for (size_t i = 0; i < count; ++i) {
+        if (keys[i] != expected[i] || (values != nullptr && original[values[i]] != keys[i])) {
+            fprintf(stderr, "sort check failed at %zu\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename K>
+Record bench_sort_typed(const std::string& size, const BenchOptions& options, const SortSize& sort) {
+    Runtime& runtime = Runtime::instance();
+    Record record = sort_record("sort-cl", size, sort);
+    record.device = options.device;
+
+    SortKernels kernels;
+    kernels.keyBits = sort.keyBits;
+    kernels.valueBits = sort.values ? 32 : 0;
+    if (sort.count == 0 || !load_sort_kernels(runtime, kernels)) {
+        return record;
+    }
+    K* original = alloc_array<K>(sort.count);
+    K* keys = alloc_array<K>(sort.count);
+    cl_uint* values = alloc_array<cl_uint>(sort.count);
+    init_keys(original, sort.count);
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer keysBuffer(runtime, keys, sort.count * sizeof(K), CL_MEM_READ_WRITE);
+        HostBuffer valuesBuffer;
+        if (sort.values) {
+            valuesBuffer = HostBuffer(runtime, values, sort.count * sizeof(cl_uint), CL_MEM_READ_WRITE);
+        }
+
+        // the sort is in place, every run starts from the original keys
+        auto run = [&]() -> double {
+            std::vector<Event> events;
+            std::vector<PooledBuffer> buffers;
+            memcpy(keys, original, sort.count * sizeof(K));
+            for (size_t i = 0; i < sort.count && sort.values; ++i) {
+                values[i] = static_cast<cl_uint>(i);
+            }
+            if (keysBuffer.upload(queue) != CL_SUCCESS || (sort.values && valuesBuffer.upload(queue) != CL_SUCCESS)) {
+                return -1.0;
+            }
+            if (radix_sort(runtime, queue, kernels, keysBuffer.get(), valuesBuffer.get(),
+                           static_cast<cl_uint>(sort.count), events, buffers) != CL_SUCCESS) {
+                clFinish(queue);
+                return -1.0;
+            }
+            if (keysBuffer.download(queue) != CL_SUCCESS ||
+                (sort.values && valuesBuffer.download(queue) != CL_SUCCESS)) {
+                return -1.0;
+            }
+            double time = 0.0;
+            for (const Event& event : events) {
+                time += event_time(event.get());
+            }
+            return time / 1e9;
+        };
+        record.ok = measure(options, run, record) &&
+                    check_sorted(original, keys, sort.values ? values : nullptr, sort.count);
+    }
+    clear_array(original);
+    clear_array(keys);
+    clear_array(values);
+    return record;
+}
+
+Record bench_sort_cl(const std::string& size, const BenchOptions& options) {
+    SortSize sort = parse_sort_size(size);
+    return sort.keyBits == 64 ? bench_sort_typed<cl_ulong>(size, options, sort)
+                              : bench_sort_typed<cl_uint>(size, options, sort);
+}
+
+// The same keys sorted on the host by std::sort, or by the OpenMP sort of libstdc++ parallel mode
+// (multiway mergesort) when parallel is set. Keys with values are sorted as pairs ordered by the key.
+template<typename K>
+Record bench_sort_host_typed(const std::string& size, const BenchOptions& options, const SortSize& sort,
+                             bool parallel) {
+    Record record = sort_record(parallel ? "sort-omp" : "sort-std", size, sort);
+    record.device = parallel ? "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads, __gnu_parallel::sort"
+                             : std::string("std::sort");
+    if (sort.count == 0) {
+        return record;
+    }
+    K* original = alloc_array<K>(sort.count);
+    K* keys = alloc_array<K>(sort.count);
+    init_keys(original, sort.count);
+    std::vector<std::pair<K, cl_uint>> pairs(sort.values ? sort.count : 0);
+    auto byKey = [](const std::pair<K, cl_uint>& a, const std::pair<K, cl_uint>& b) { return a.first < b.first; };
+
+    auto run = [&]() -> double {
+        memcpy(keys, original, sort.count * sizeof(K));
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            pairs[i] = std::make_pair(original[i], static_cast<cl_uint>(i));
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (sort.values && parallel) {
+            __gnu_parallel::sort(pairs.begin(), pairs.end(), byKey);
+        } else if (sort.values) {
+            std::sort(pairs.begin(), pairs.end(), byKey);
+        } else if (parallel) {
+            __gnu_parallel::sort(keys, keys + sort.count);
+        } else {
+            std::sort(keys, keys + sort.count);
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record);
+    if (record.ok) {
+        std::vector<cl_uint> values(pairs.size());
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            keys[i] = pairs[i].first;
+            values[i] = pairs[i].second;
+        }
+        record.ok = check_sorted(original, keys, sort.values ? values.data() : nullptr, sort.count);
+    }
+    clear_array(original);
+    clear_array(keys);
+    return record;
+}
+
+Record bench_sort_host(const std::string& size, const BenchOptions& options, bool parallel) {
+    SortSize sort = parse_sort_size(size);
+    return sort.keyBits == 64 ? bench_sort_host_typed<cl_ulong>(size, options, sort, parallel)
+                              : bench_sort_host_typed<cl_uint>(size, options, sort, parallel);
+}
+
+// y = A * B * C * x for M x M matrices and an M-vector, as callers did it before MatrixExpr (matrix-eager-cl:
+// every product by matrix_mul_host from left to right, through the host) and as a MatrixExpr (matrix-lazy-cl:
+// planned as A * (B * (C * x)) on the device). Both report the GFLOPS of the left-to-right order,
+// so the saving of the reordering shows as a higher rate; the copied bytes are printed once per size.
+Record bench_matrix_chain(const std::string& size, const BenchOptions& options, bool lazy) {
+    Runtime& runtime = Runtime::instance();
+    size_t M = strtoul(size.c_str(), nullptr, 10);
+    Record record;
+    record.op = lazy ? "matrix-lazy-cl" : "matrix-eager-cl";
+    record.size = size;
+    record.device = options.device;
+    record.metric = "GFLOPS";
+    record.work = 2.0 * (2.0 * M * M * M + static_cast<double>(M) * M);
+
+    std::vector<float*> matrices;
+    for (int i = 0; i < 3; ++i) {
+        matrices.push_back(alloc_array<float>(M * M));
+        init_random(matrices.back(), M * M, 10);
+    }
+    float* x = alloc_array<float>(M);
+    float* y = alloc_array<float>(M);
+    float* product = alloc_array<float>(M * M);
+    float* next = alloc_array<float>(M * M);
+    init_random(x, M, 10);
+
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        if (lazy) {
+            MatrixExpr chain = matrix_input(runtime, matrices[0], M, M, "A") *
+                               matrix_input(runtime, matrices[1], M, M, "B") *
+                               matrix_input(runtime, matrices[2], M, M, "C") * matrix_input(runtime, x, M, 1, "x");
+            if (chain.read(y) != CL_SUCCESS) {
+                return -1.0;
+            }
+        } else {
+            MatrixShape shape;
+            shape.M = shape.N = shape.K = M;
+            bool onCpu = false;
+            if (matrix_mul_host(runtime, shape, matrices[0], matrices[1], product, onCpu) < 0 ||
+                matrix_mul_host(runtime, shape, product, matrices[2], next, onCpu) < 0) {
+                return -1.0;
+            }
+            shape.N = 1;
+            if (matrix_mul_host(runtime, shape, next, x, y, onCpu) < 0) {
+                return -1.0;
+            }
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    runtime.reset_copied_bytes();
+    record.ok = run() >= 0;
+    fprintf(stderr, "%s: %zu bytes copied between the host and the device.\n", record.op.c_str(),
+            runtime.copied_bytes());
+    record.ok = record.ok && measure(options, run, record);
+
+    // the reference is multiplied from the right in double
+    std::vector<double> expected(x, x + M);
+    for (int i = 2; i >= 0; --i) {
+        std::vector<double> res(M, 0.0);
+        for (size_t row = 0; row < M; ++row) {
+            for (size_t k = 0; k < M; ++k) {
+                res[row] += static_cast<double>(matrices[i][row * M + k]) * expected[k];
+            }
+        }
+        expected.swap(res);
+    }
+    for (size_t row = 0; row < M && record.ok; ++row) {
+        if (std::fabs(y[row] - expected[row]) > 1e-4 * std::fabs(expected[row]) + 1e-3) {
+            fprintf(stderr, "chain check failed at %zu: expected %f, actual %f\n", row, expected[row], y[row]);
+            record.ok = false;
+        }
+    }
+    for (float* matrix : matrices) {
+        clear_array(matrix);
+    }
+    clear_array(x);
+    clear_array(y);
+    clear_array(product);
+    clear_array(next);
+    return record;
+}
+
+// "[csr:|ell:]M:DENSITY" or "[csr:|ell:]MxKxN:DENSITY", the format only for spmm-cl.
+struct SparseSize {
+    MatrixShape  shape;
+    double       density { 0.0 };
+    // the device chooses without a prefix
+    bool         forced  { false };
+    SparseFormat format  { SparseFormat::Csr };
+};
+
+SparseSize parse_sparse_size(const std::string& size) {
+    SparseSize res;
+    size_t start = 0;
+    if (size.compare(0, 4, "csr:") == 0 || size.compare(0, 4, "ell:") == 0) {
+        res.forced = true;
+        res.format = size[0] == 'c' ? SparseFormat::Csr : SparseFormat::SlicedEll;
+        start = 4;
+    }
+    size_t colon = size.find(':', start);
+    res.shape = parse_gemm_size(size.substr(start, colon - start));
+    res.density = colon == std::string::npos ? 1.0 : strtod(size.c_str() + colon + 1, nullptr);
+    return res;
+}
+
+// Nonzeros at random positions with the density, small integers as in init_random.
+void init_sparse(float* array, size_t size, double density) {
+    for (size_t i = 0; i < size; ++i) {
+        array[i] = rand() < density * RAND_MAX ? static_cast<float>(rand() % 9 + 1) : 0.0f;
+    }
+}
+
+// Sparse multiplications report the GFLOPS of the dense multiplication of the same shape,
+// so the rates compare directly with gemm-omp and gemm-cl and the crossover is where they meet.
+Record sparse_record(const char* op, const std::string& size, const MatrixShape& shape) {
+    Record record;
+    record.op = op;
+    record.size = size;
+    record.metric = "GFLOPS";
+    record.work = shape.flops();
+    record.bytes = gemm_bytes(shape);
+    return record;
+}
+
+Record bench_spmm_omp(const std::string& size, const BenchOptions& options) {
+    SparseSize sparse = parse_sparse_size(size);
+    const MatrixShape& shape = sparse.shape;
+    Record record = sparse_record("spmm-omp", size, shape);
+    record.device = "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads";
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_sparse(first, shape.M * shape.K, sparse.density);
+    init_random(second, shape.K * shape.N, 10);
+    CsrMatrix A = denseToCsr(shape.M, shape.K, first, shape.K);
+
+    auto run = [&]() -> double {
+        auto start = std::chrono::steady_clock::now();
+        spmm(A, shape.N, second, shape.N, result, shape.N);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_gemm_sample(first, second, result, shape);
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+Record bench_spmm_cl(const std::string& size, const BenchOptions& options) {
+    Runtime& runtime = Runtime::instance();
+    SparseSize sparse = parse_sparse_size(size);
+    const MatrixShape& shape = sparse.shape;
+    Record record = sparse_record("spmm-cl", size, shape);
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_sparse(first, shape.M * shape.K, sparse.density);
+    init_random(second, shape.K * shape.N, 10);
+    CsrMatrix A = denseToCsr(shape.M, shape.K, first, shape.K);
+    SparseFormat format = sparse.forced ? sparse.format : choose_sparse_format(runtime, A);
+    record.device = options.device + (format == SparseFormat::Csr ? ", csr" : ", sliced ell");
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer secondBuffer(runtime, second, shape.K * shape.N * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, result, shape.M * shape.N * sizeof(float), CL_MEM_READ_WRITE);
+
+        // end to end as gemm-cl: upload, multiply, download
+        auto run = [&]() -> double {
+            SparseBuffers buffers;
+            Event event;
+            if (upload_sparse(runtime, queue, A, format, buffers) != CL_SUCCESS ||
+                secondBuffer.upload(queue) != CL_SUCCESS || resultBuffer.upload(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (sparse_mul(runtime, queue, buffers, shape.N, secondBuffer.get(), shape.N, resultBuffer.get(),
+                           shape.N, 0, nullptr, event.out()) != CL_SUCCESS) {
+                return -1.0;
+            }
+            if (resultBuffer.download(queue) != CL_SUCCESS) {
+                return -1.0;
+            }
+            return event_time(event.get()) / 1e9;
+        };
+        record.ok = measure(options, run, record) && check_gemm_sample(first, second, result, shape);
+    }
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+// gemmAuto or matrix_mul_auto on a dense array with the density, counting and conversion included.
+Record bench_gemm_auto(const std::string& size, const BenchOptions& options, bool opencl) {
+    SparseSize sparse = parse_sparse_size(size);
+    const MatrixShape& shape = sparse.shape;
+    Record record = sparse_record(opencl ? "gemm-auto-cl" : "gemm-auto-omp", size, shape);
+
+    float* first  = alloc_array<float>(shape.M * shape.K);
+    float* second = alloc_array<float>(shape.K * shape.N);
+    float* result = alloc_array<float>(shape.M * shape.N);
+    init_sparse(first, shape.M * shape.K, sparse.density);
+    init_random(second, shape.K * shape.N, 10);
+
+    // the crossover is measured on the first call, not in the timed runs
+    double maxDensity = opencl ? sparse_max_density(Runtime::instance()) : spmmMaxDensity();
+    bool sparsePath = false;
+    auto run = [&]() -> double {
+        if (opencl) {
+            return matrix_mul_auto(Runtime::instance(), shape, first, second, result, sparsePath, maxDensity);
+        }
+        auto start = std::chrono::steady_clock::now();
+        sparsePath = gemmAuto(shape.M, shape.N, shape.K, first, shape.K, second, shape.N, result, shape.N,
+                              maxDensity);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    record.ok = measure(options, run, record) && check_gemm_sample(first, second, result, shape);
+    record.device = (opencl ? options.device : "OpenMP, " + std::to_string(omp_get_max_threads()) + " threads") +
+                    (sparsePath ? ", sparse" : ", dense");
+    clear_array(first);
+    clear_array(second);
+    clear_array(result);
+    return record;
+}
+
+void usage() {
+    printf("Bench [--op NAME[=SIZES]]... [--warmup N] [--reps N] [--tune] [--format text|csv|json]\n"
+           "      [--output FILE] [--commit ID] [--trace FILE]\n"
+           "NAME: gemm-cl, gemm-omp, gemm-multi, gemm-dynamic (SIZES: M or MxKxN),\n"
+           "      gemm-cl and gemm-omp also take TYPE:M or TYPE:MxKxN, TYPE: float, half, bf16, int8;\n"
+           "      gemm-types and gemm-types-omp run every type,\n"
+           "      gemm-epilogue-cl, gemm-epilogue-omp (SIZES: M or MxKxN, with alpha, beta, biases and relu),\n"
+           "      gemm-batched-cl, gemm-batched-omp (SIZES: BATCH:M or BATCH:MxKxN),\n"
+           "      scan-cl, scan-multi, scan-omp, scan-auto, copy-cl (SIZES: elements),\n"
+           "      scan-cl also takes VARIANT:elements, VARIANT is TYPE-OP[-exclusive][-segmented],\n"
+           "      TYPE: float, int, long, double, OP: sum, min, max; scan-variants runs a set of them,\n"
+           "      chain-sync, chain-async (SIZES: M, four scan -> gemm -> scan chains of M x M matrices),\n"
+           "      compact-cl (SIZES: elements), sort-cl, sort-std, sort-omp (SIZES: COUNT or KEYS:COUNT,\n"
+           "      KEYS: u32, u64, u32-kv, u64-kv; kv sorts a 32-bit value with every key),\n"
+           "      matrix-eager-cl, matrix-lazy-cl (SIZES: M, A * B * C * x for M x M matrices and an M-vector),\n"
+           "      spmm-omp, spmm-cl, gemm-auto-omp, gemm-auto-cl (SIZES: M:DENSITY or MxKxN:DENSITY, A has that\n"
+           "      fraction of nonzeros; spmm-cl also takes csr: and ell: prefixes; reported as dense GFLOPS),\n"
+           "SIZES is a comma-separated list. Without --op every benchmark runs with default sizes.\n"
+           "--trace writes the OpenCL commands and program builds of the run as Chrome trace JSON.\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+    srand(12345);
+    std::vector<Op> ops = {
+        { "gemm-cl",  "512,1024,2048", true,  bench_gemm_cl },
+        { "gemm-omp", "512,1024,2048", false, bench_gemm_omp },
+        { "gemm-types",     "float:2048,half:2048,bf16:2048,int8:2048", true,  bench_gemm_cl },
+        { "gemm-types-omp", "float:2048,half:2048,bf16:2048,int8:2048", false, bench_gemm_omp },
+        { "gemm-epilogue-cl",  "1024,2048", true,  bench_gemm_epilogue_cl },
+        { "gemm-epilogue-omp", "1024,2048", false, bench_gemm_epilogue_omp },
+        { "gemm-batched-cl",  "100000:16,20000:32", true,  bench_gemm_batched_cl },
+        { "gemm-batched-omp", "100000:16,20000:32", false, bench_gemm_batched_omp },
+        { "scan-cl",  "1000000,16777216", true,  bench_scan_cl },
+        { "copy-cl",  "1000000,16777216", true,  bench_copy_cl },
+        { "scan-variants", "float-sum:16777216,float-sum-exclusive:16777216,float-sum-segmented:16777216,"
+                           "float-max:16777216,int-sum:16777216,int-min-exclusive-segmented:16777216,"
+                           "long-sum:16777216,double-sum:16777216", true, bench_scan_cl },
+        { "gemm-multi",   "1024,2048", true, [](const std::string& size, const BenchOptions& options) {
+            return bench_gemm_multi(size, options, SplitMode::Weighted);
+        } },
+        { "gemm-dynamic", "1024,2048", true, [](const std::string& size, const BenchOptions& options) {
+            return bench_gemm_multi(size, options, SplitMode::Dynamic);
+        } },
+        { "chain-sync",  "512,1024", true, [](const std::string& size, const BenchOptions& options) {
+            return bench_chain(size, options, false);
+        } },
+        { "chain-async", "512,1024", true, [](const std::string& size, const BenchOptions& options) {
+            return bench_chain(size, options, true);
+        } },
+        { "scan-multi", "16777216", true, bench_scan_multi },
+        { "compact-cl", "1000000,16777216", true, bench_compact_cl },
+        { "sort-cl",  "u32:16777216,u64:16777216,u32-kv:16777216", true, bench_sort_cl },
+        { "sort-std", "u32:16777216,u64:16777216,u32-kv:16777216", false,
+          [](const std::string& size, const BenchOptions& options) { return bench_sort_host(size, options, false); } },
+        { "sort-omp", "u32:16777216,u64:16777216,u32-kv:16777216", false,
+          [](const std::string& size, const BenchOptions& options) { return bench_sort_host(size, options, true); } },
+        { "matrix-eager-cl", "1024,2048", true, [](const std::string& size, const BenchOptions& options) {
+            return bench_matrix_chain(size, options, false);
+        } },
+        { "matrix-lazy-cl",  "1024,2048", true, [](const std::string& size, const BenchOptions& options) {
+            return bench_matrix_chain(size, options, true);
+        } },
+        { "spmm-omp", SPARSE_SWEEP, false, bench_spmm_omp },
+        { "spmm-cl",  SPARSE_SWEEP, true,  bench_spmm_cl },
+        { "gemm-auto-omp", SPARSE_SWEEP, false, [](const std::string& size, const BenchOptions& options) {
+            return bench_gemm_auto(size, options, false);
+        } },
+        { "gemm-auto-cl",  SPARSE_SWEEP, true,  [](const std::string& size, const BenchOptions& options) {
+            return bench_gemm_auto(size, options, true);
+        } },
+        { "scan-omp",   "10000,1000000,16777216", false, bench_scan_omp },
+        { "scan-auto",  "10000,1000000,16777216", true,  bench_scan_auto },
+    };
+
+    BenchOptions options;
+    std::string format = "text";
+    std::string output;
+    std::string commit = BENCH_COMMIT;
+    std::vector<std::pair<const Op*, std::string>> selected;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--op" && hasValue) {
+            std::string value = argv[++i];
+            size_t eq = value.find('=');
+            std::string name = value.substr(0, eq);
+            const Op* op = nullptr;
+            for (const Op& candidate : ops) {
+                if (name == candidate.name) op = &candidate;
+            }
+            if (op == nullptr) {
+                fprintf(stderr, "Unknown benchmark %s\n", name.c_str());
+                usage();
+                return EXIT_FAILURE;
+            }
+            selected.emplace_back(op, eq == std::string::npos ? op->sizes : value.substr(eq + 1));
+        } else if (arg == "--warmup" && hasValue) {
+            options.warmup = atoi(argv[++i]);
+        } else if (arg == "--reps" && hasValue) {
+            options.reps = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--tune") {
+            options.tune = true;
+        } else if (arg == "--format" && hasValue) {
+            format = argv[++i];
+        } else if (arg == "--output" && hasValue) {
+            output = argv[++i];
+        } else if (arg == "--commit" && hasValue) {
+            commit = argv[++i];
+        } else if (arg == "--trace" && hasValue) {
+            Trace::instance().start(argv[++i]);
+        } else {
+            usage();
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (selected.empty()) {
+        for (const Op& op : ops) selected.emplace_back(&op, op.sizes);
+    }
+
+    // stdout carries only the report: everything printed while running, by the benchmarks and by the
+    // libraries they call, goes to stderr
+    fflush(stdout);
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    bool opencl = false;
+    for (const auto& entry : selected) opencl = opencl || entry.first->opencl;
+    if (opencl) {
+        Runtime& runtime = Runtime::instance();
+        if (!runtime.valid()) {
+            return EXIT_FAILURE;
+        }
+        options.device = runtime.info().name;
+    }
+
+    std::vector<Record> records;
+    for (const auto& entry : selected) {
+        for (const std::string& size : split(entry.second, ',')) {
+            fprintf(stderr, "Running %s %s...\n", entry.first->name, size.c_str());
+            records.push_back(entry.first->run(size, options));
+        }
+    }
+    Trace::instance().finish();
+
+    fflush(stdout);
+    FILE* out = output.empty() ? report : fopen(output.c_str(), "w");
+    if (out == nullptr) {
+        fprintf(stderr, "Can't open %s\n", output.c_str());
+        return EXIT_FAILURE;
+    }
+    if (format == "csv") {
+        write_csv(out, records, commit);
+    } else if (format == "json") {
+        write_json(out, records, commit);
+    } else {
+        write_text(out, records, commit);
+    }
+    if (out != report) fclose(out);
+    if (report != nullptr) fclose(report);
+
+    for (const Record& record : records) {
+        if (!record.ok) return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
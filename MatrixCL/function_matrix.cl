@@ -1,47 +1,369 @@
-// TILE_W == TILE_H == LOCAL_GROUP_SIZE
-// firstSizeP % LOCAL_GROUP_SIZE == 0
-// firstSizeP % LOCAL_SIZE_GROUP == 0
-// thirdSizeP % LOCAL_GROUP_SIZE == 0
-kernel void matrix_mul(global const float* first,
-                       global const float* second,
-                       global float* result,
-                       global const int* firstSizeP,
-                       global const int* secondSizeP,
-                       global const int* thirdSizeP) {
-    int firstSize  = *firstSizeP;
-    int secondSize = *secondSizeP;
-    int thirdSize  = *thirdSizeP;
-
-    size_t locI = get_local_id(0);
-    size_t locJ = get_local_id(1);
-    int i = get_group_id(0) * LOCAL_GROUP_SIZE + locI;
-    int j = get_group_id(1) * LOCAL_GROUP_SIZE + locJ * ELEMENTS;
-
-    local float firstLoc[LOCAL_GROUP_SIZE][LOCAL_GROUP_SIZE];
-    local float secondLoc[LOCAL_GROUP_SIZE][LOCAL_GROUP_SIZE];
-
-    float acc[ELEMENTS];
-    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
-        acc[elem] = 0.0;
+// result = op(first) * op(second), op(X) = X or X^T.
+// The group computes a TILE_M x TILE_N tile of the result, stepping over K by TILE_K.
+// Every work-item keeps a WPT_M x WPT_N block of the tile in registers,
+// global memory is read with VW-wide vector loads. Edge tiles are handled in the kernel,
+// so the shapes and the row strides are arbitrary.
+#ifndef TILE_M
+#define TILE_M 64
+#endif
+#ifndef TILE_N
+#define TILE_N 64
+#endif
+#ifndef TILE_K
+#define TILE_K 16
+#endif
+#ifndef WPT_M
+#define WPT_M 4
+#endif
+#ifndef WPT_N
+#define WPT_N 4
+#endif
+#ifndef VW
+#define VW 4
+#endif
+// first is stored K x M instead of M x K
+#ifndef TRANS_A
+#define TRANS_A 0
+#endif
+// second is stored N x K instead of K x N
+#ifndef TRANS_B
+#define TRANS_B 0
+#endif
+
+// Element type of first and second, the result is float.
+// Half and bf16 are widened to float when loaded (vload_half is core OpenCL, no cl_khr_fp16 needed),
+// int8 products are accumulated in int and the result is scaled by the kernel argument scale.
+#define INPUT_FLOAT 0
+#define INPUT_HALF 1
+#define INPUT_BF16 2
+#define INPUT_INT8 3
+#ifndef INPUT
+#define INPUT INPUT_FLOAT
+#endif
+
+// Epilogue fused into the store: result = ACTIVATION(alpha * product + beta * result + rowBias[row] + colBias[col]).
+// Every part is compiled in only when enabled; alpha, beta and the bias buffers are kernel arguments after
+// the scale of int8 kernels, in this order. Without BETA the result isn't read.
+#ifndef ALPHA
+#define ALPHA 0
+#endif
+#ifndef BETA
+#define BETA 0
+#endif
+#ifndef ROW_BIAS
+#define ROW_BIAS 0
+#endif
+#ifndef COL_BIAS
+#define COL_BIAS 0
+#endif
+#define ACTIVATION_NONE 0
+#define ACTIVATION_RELU 1
+#define ACTIVATION_GELU 2
+#define ACTIVATION_SIGMOID 3
+#ifndef ACTIVATION
+#define ACTIVATION ACTIVATION_NONE
+#endif
+
+// work-items of the group along each dimension
+#define RTS_M (TILE_M / WPT_M)
+#define RTS_N (TILE_N / WPT_N)
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+#if VW == 8
+#define VLOAD vload8
+#define VSTORE vstore8
+#elif VW == 4
+#define VLOAD vload4
+#define VSTORE vstore4
+#elif VW == 2
+#define VLOAD vload2
+#define VSTORE vstore2
+#else
+#define VLOAD(offset, p) ((p)[offset])
+#define VSTORE(value, offset, p) ((p)[offset] = (value))
+#endif
+
+// IN is the stored type, CT the type of the tiles and the accumulators.
+// LOAD_ONE converts one element, LOAD_VW the VW elements starting at p.
+#if INPUT == INPUT_HALF
+#define IN half
+#define CT float
+#define LOAD_ONE(p) vload_half(0, p)
+#if VW == 1
+#define LOAD_VW(p) vload_half(0, p)
+#else
+#define LOAD_VW(p) CAT(vload_half, VW)(0, p)
+#endif
+#elif INPUT == INPUT_BF16
+// bfloat16 is the upper half of a float
+#define IN ushort
+#define CT float
+#define LOAD_ONE(p) as_float((uint)(*(p)) << 16)
+#if VW == 1
+#define LOAD_VW(p) LOAD_ONE(p)
+#else
+#define LOAD_VW(p) CAT(as_float, VW)(CAT(convert_uint, VW)(VLOAD(0, p)) << 16)
+#endif
+#elif INPUT == INPUT_INT8
+#define IN char
+#define CT int
+#define LOAD_ONE(p) ((int)(*(p)))
+#if VW == 1
+#define LOAD_VW(p) LOAD_ONE(p)
+#else
+#define LOAD_VW(p) CAT(convert_int, VW)(VLOAD(0, p))
+#endif
+#else
+#define IN float
+#define CT float
+#define LOAD_ONE(p) (*(p))
+#define LOAD_VW(p) VLOAD(0, p)
+#endif
+
+// int8 kernels take the scale of the result after the other arguments
+#if INPUT == INPUT_INT8
+#define SCALE_PARAM , const float scale
+#define SCALE scale
+#else
+#define SCALE_PARAM
+#define SCALE 1.0f
+#endif
+
+#if ALPHA
+#define ALPHA_PARAM , const float alpha
+#define ALPHA_ARG alpha
+#else
+#define ALPHA_PARAM
+#define ALPHA_ARG 1.0f
+#endif
+#if BETA
+#define BETA_PARAM , const float beta
+#define BETA_ARG beta
+#else
+#define BETA_PARAM
+#define BETA_ARG 0.0f
+#endif
+#if ROW_BIAS
+#define ROW_BIAS_PARAM , global const float* rowBias
+#define ROW_BIAS_ARG rowBias
+#else
+#define ROW_BIAS_PARAM
+#define ROW_BIAS_ARG 0
+#endif
+#if COL_BIAS
+#define COL_BIAS_PARAM , global const float* colBias
+#define COL_BIAS_ARG colBias
+#else
+#define COL_BIAS_PARAM
+#define COL_BIAS_ARG 0
+#endif
+#define EPILOGUE_PARAMS SCALE_PARAM ALPHA_PARAM BETA_PARAM ROW_BIAS_PARAM COL_BIAS_PARAM
+#define EPILOGUE_ARGS SCALE, ALPHA_ARG, BETA_ARG, ROW_BIAS_ARG, COL_BIAS_ARG
+
+float activate(float value) {
+#if ACTIVATION == ACTIVATION_RELU
+    return fmax(value, 0.0f);
+#elif ACTIVATION == ACTIVATION_GELU
+    // tanh approximation
+    return 0.5f * value * (1.0f + tanh(0.7978845608f * (value + 0.044715f * value * value * value)));
+#elif ACTIVATION == ACTIVATION_SIGMOID
+    return 1.0f / (1.0f + exp(-value));
+#else
+    return value;
+#endif
+}
+
+// VW consecutive values starting at p. Values from index count on are zeros and are not read.
+void load_values(global const IN* p, int count, CT* values) {
+    if (count >= VW) {
+        VSTORE(LOAD_VW(p), 0, values);
+    } else {
+        for (int v = 0; v < VW; ++v) {
+            values[v] = v < count ? LOAD_ONE(p + v) : 0;
+        }
+    }
+}
+
+// Computes the tile (get_group_id(1), get_group_id(0)) of one multiplication.
+// firstLoc and secondLoc are TILE_K x TILE_M and TILE_K x TILE_N local arrays of the kernel.
+// scale is only applied to int8 results, the other epilogue arguments only when enabled.
+// Offsets of rows are size_t, so a matrix may have more than 2^31 elements.
+void multiply_tile(global const IN* first,
+                   global const IN* second,
+                   global float* result,
+                   const int M,
+                   const int N,
+                   const int K,
+                   const int lda,
+                   const int ldb,
+                   const int ldc,
+                   const float scale,
+                   const float alpha,
+                   const float beta,
+                   global const float* rowBias,
+                   global const float* colBias,
+                   local CT (*firstLoc)[TILE_M],
+                   local CT (*secondLoc)[TILE_N]) {
+    int tx = get_local_id(0);
+    int ty = get_local_id(1);
+    int tid = ty * RTS_N + tx;
+    int m0 = get_group_id(1) * TILE_M;
+    int n0 = get_group_id(0) * TILE_N;
+
+    CT acc[WPT_M][WPT_N];
+    for (int wm = 0; wm < WPT_M; ++wm) {
+        for (int wn = 0; wn < WPT_N; ++wn) {
+            acc[wm][wn] = 0;
+        }
     }
 
-    for (size_t shift = 0; shift < secondSize; shift += LOCAL_GROUP_SIZE) {
-        for (size_t elem = 0; elem < ELEMENTS; ++elem) {
-        size_t indJ = locJ * ELEMENTS + elem;
-            firstLoc[locI][indJ]  = first[i * secondSize + shift + locJ * ELEMENTS + elem];
-            secondLoc[indJ][locI] = second[(j + elem) * secondSize + shift + locI];
+    for (int k0 = 0; k0 < K; k0 += TILE_K) {
+        CT values[VW];
+#if TRANS_A
+        for (int ind = tid; ind < TILE_K * TILE_M / VW; ind += RTS_M * RTS_N) {
+            int k = ind / (TILE_M / VW);
+            int m = (ind % (TILE_M / VW)) * VW;
+            load_values(first + (size_t)(k0 + k) * lda + m0 + m, k0 + k < K ? M - m0 - m : 0, values);
+            for (int v = 0; v < VW; ++v) {
+                firstLoc[k][m + v] = values[v];
+            }
+        }
+#else
+        for (int ind = tid; ind < TILE_M * TILE_K / VW; ind += RTS_M * RTS_N) {
+            int m = ind / (TILE_K / VW);
+            int k = (ind % (TILE_K / VW)) * VW;
+            load_values(first + (size_t)(m0 + m) * lda + k0 + k, m0 + m < M ? K - k0 - k : 0, values);
+            for (int v = 0; v < VW; ++v) {
+                firstLoc[k + v][m] = values[v];
+            }
+        }
+#endif
+#if TRANS_B
+        for (int ind = tid; ind < TILE_N * TILE_K / VW; ind += RTS_M * RTS_N) {
+            int n = ind / (TILE_K / VW);
+            int k = (ind % (TILE_K / VW)) * VW;
+            load_values(second + (size_t)(n0 + n) * ldb + k0 + k, n0 + n < N ? K - k0 - k : 0, values);
+            for (int v = 0; v < VW; ++v) {
+                secondLoc[k + v][n] = values[v];
+            }
+        }
+#else
+        for (int ind = tid; ind < TILE_K * TILE_N / VW; ind += RTS_M * RTS_N) {
+            int k = ind / (TILE_N / VW);
+            int n = (ind % (TILE_N / VW)) * VW;
+            load_values(second + (size_t)(k0 + k) * ldb + n0 + n, k0 + k < K ? N - n0 - n : 0, values);
+            for (int v = 0; v < VW; ++v) {
+                secondLoc[k][n + v] = values[v];
+            }
         }
+#endif
         barrier(CLK_LOCAL_MEM_FENCE);
 
-        for (size_t k = 0; k < LOCAL_GROUP_SIZE; ++k) {
-            for (size_t elem = 0; elem < ELEMENTS; ++elem) {
-                acc[elem] += firstLoc[locI][k] * secondLoc[locJ * ELEMENTS + elem][k];
+        for (int k = 0; k < TILE_K; ++k) {
+            CT secondReg[WPT_N];
+            for (int wn = 0; wn < WPT_N; ++wn) {
+                secondReg[wn] = secondLoc[k][tx + wn * RTS_N];
+            }
+            for (int wm = 0; wm < WPT_M; ++wm) {
+                CT firstReg = firstLoc[k][ty + wm * RTS_M];
+                for (int wn = 0; wn < WPT_N; ++wn) {
+                    acc[wm][wn] += firstReg * secondReg[wn];
+                }
             }
         }
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
-    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
-        result[i * thirdSize + j + elem] = acc[elem];
+    for (int wm = 0; wm < WPT_M; ++wm) {
+        int row = m0 + ty + wm * RTS_M;
+        for (int wn = 0; wn < WPT_N; ++wn) {
+            int col = n0 + tx + wn * RTS_N;
+            if (row < M && col < N) {
+#if INPUT == INPUT_INT8
+                float value = acc[wm][wn] * scale;
+#else
+                float value = acc[wm][wn];
+#endif
+#if ALPHA
+                value *= alpha;
+#endif
+#if BETA
+                value += beta * result[(size_t)row * ldc + col];
+#endif
+#if ROW_BIAS
+                value += rowBias[row];
+#endif
+#if COL_BIAS
+                value += colBias[col];
+#endif
+                result[(size_t)row * ldc + col] = activate(value);
+            }
+        }
     }
-}
\ No newline at end of file
+}
+
+// Row-major storage with strides lda, ldb, ldc; result is M x N.
+// Local size is (RTS_N, RTS_M), global size is (ceil(N / TILE_N) * RTS_N, ceil(M / TILE_M) * RTS_M).
+// TILE_M, TILE_N and TILE_K are multiples of VW.
+kernel void matrix_mul(global const IN* first,
+                       global const IN* second,
+                       global float* result,
+                       const int M,
+                       const int N,
+                       const int K,
+                       const int lda,
+                       const int ldb,
+                       const int ldc
+                       EPILOGUE_PARAMS) {
+    // both tiles are stored with k as the outer index
+    local CT firstLoc[TILE_K][TILE_M];
+    local CT secondLoc[TILE_K][TILE_N];
+    multiply_tile(first, second, result, M, N, K, lda, ldb, ldc, EPILOGUE_ARGS, firstLoc, secondLoc);
+}
+
+// A batch of multiplications of the same shape. The range is the one of matrix_mul
+// with the batch size as the third dimension, the local size is 1 along it.
+// Matrix b of the batch starts at b * strideFirst, b * strideSecond and b * strideResult elements;
+// a zero stride of first or second shares that matrix between the whole batch.
+kernel void matrix_mul_batched(global const IN* first,
+                               global const IN* second,
+                               global float* result,
+                               const int M,
+                               const int N,
+                               const int K,
+                               const int lda,
+                               const int ldb,
+                               const int ldc,
+                               const ulong strideFirst,
+                               const ulong strideSecond,
+                               const ulong strideResult
+                               EPILOGUE_PARAMS) {
+    local CT firstLoc[TILE_K][TILE_M];
+    local CT secondLoc[TILE_K][TILE_N];
+    ulong batch = get_global_id(2);
+    multiply_tile(first + batch * strideFirst, second + batch * strideSecond, result + batch * strideResult,
+                  M, N, K, lda, ldb, ldc, EPILOGUE_ARGS, firstLoc, secondLoc);
+}
+
+// Like matrix_mul_batched, with the matrices of the batch anywhere in the buffers:
+// offsets[3 * b], offsets[3 * b + 1] and offsets[3 * b + 2] are the element offsets of matrix b
+// in first, second and result.
+kernel void matrix_mul_batched_offsets(global const IN* first,
+                                       global const IN* second,
+                                       global float* result,
+                                       const int M,
+                                       const int N,
+                                       const int K,
+                                       const int lda,
+                                       const int ldb,
+                                       const int ldc,
+                                       global const ulong* offsets
+                                       EPILOGUE_PARAMS) {
+    local CT firstLoc[TILE_K][TILE_M];
+    local CT secondLoc[TILE_K][TILE_N];
+    global const ulong* batch = offsets + 3 * get_global_id(2);
+    multiply_tile(first + batch[0], second + batch[1], result + batch[2], M, N, K, lda, ldb, ldc,
+                  EPILOGUE_ARGS, firstLoc, secondLoc);
+}
@@ -0,0 +1,66 @@
+// result (rows x N) = A * B for a sparse A and row-major B and result. Work-items along dimension 0
+// are the columns of result, so every nonzero of A is read once per work-group and broadcast,
+// and the rows of B and result are read and written coalesced.
+
+// First row r with row_start[r] + r >= target: a row costs its nonzeros plus one for writing it,
+// and row_start[r] + r is the cost of the rows before r.
+uint balanced_row(global const uint* row_start, const uint rows, const ulong target) {
+    uint low = 0;
+    uint high = rows;
+    while (low < high) {
+        uint mid = (low + high) / 2;
+        if (row_start[mid] + mid < target) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// CSR: row_start is the exclusive prefix sum of the row lengths. Work-group row get_group_id(1) of parts
+// multiplies the rows whose cost falls in its share of the total, so every group gets the same number
+// of nonzeros however the rows vary.
+kernel void spmm_csr(global const uint* row_start, global const uint* columns, global const float* values,
+                     global const float* B, global float* C,
+                     const uint rows, const uint N, const uint ldb, const uint ldc, const uint parts) {
+    size_t n = get_global_id(0);
+    size_t part = get_global_id(1);
+    if (n >= N) {
+        return;
+    }
+    ulong total = (ulong)row_start[rows] + rows;
+    uint begin = balanced_row(row_start, rows, total * part / parts);
+    uint end = part + 1 == parts ? rows : balanced_row(row_start, rows, total * (part + 1) / parts);
+
+    for (uint i = begin; i < end; ++i) {
+        float acc = 0.0f;
+        for (uint p = row_start[i]; p < row_start[i + 1]; ++p) {
+            acc += values[p] * B[(size_t)columns[p] * ldb + n];
+        }
+        C[(size_t)i * ldc + n] = acc;
+    }
+}
+
+// Sliced ELL: the rows go in slices of SLICE rows padded to the longest row of the slice, stored column
+// by column, so entry j of row i of slice s is at slice_start[s] + j * SLICE + i. Padding is a zero value
+// at column 0. A work-group is one slice: all of its rows have the same length and no work-item waits
+// for a longer row, and work-items along dimension 1 read consecutive entries.
+kernel void spmm_ell(global const uint* slice_start, global const uint* columns, global const float* values,
+                     global const float* B, global float* C,
+                     const uint rows, const uint N, const uint ldb, const uint ldc) {
+    size_t n = get_global_id(0);
+    size_t row = get_global_id(1);
+    if (n >= N || row >= rows) {
+        return;
+    }
+    size_t slice = row / SLICE;
+    uint begin = slice_start[slice] + row % SLICE;
+    uint end = slice_start[slice + 1];
+
+    float acc = 0.0f;
+    for (uint p = begin; p < end; p += SLICE) {
+        acc += values[p] * B[(size_t)columns[p] * ldb + n];
+    }
+    C[row * ldc + n] = acc;
+}
@@ -1,8 +1,20 @@
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <chrono>
 #include <cstring>
+#include <string>
+#include <vector>
 #include "../utils.h"
+#include "gemm.h"
+#include "mapped_file.h"
+#include "matrix_mul.h"
+#include "mixed_precision.h"
+#include "multi_device.h"
+#include "../Runtime/numa.h"
+#include "streaming.h"
+#include "../Runtime/trace.h"
 
 void init_random_matrix(float* matrix, size_t firstShape, size_t secondShape, size_t cols) {
     if (cols < secondShape) return;
@@ -13,14 +25,6 @@ void init_random_matrix(float* matrix, size_t firstShape, size_t secondShape, si
     }
 }
 
-void transpose(const float* src, float* dst, size_t shapeX, size_t shapeY) {
-    for(size_t i = 0; i < shapeX; ++i) {
-        for(size_t j = 0; j < shapeY; ++j) {
-            dst[j * shapeX + i] = src[i * shapeY + j];
-        }
-    }
-}
-
 void printMatrix(const char* name, const float* matrix, size_t shapeX, size_t shapeY, size_t cols) {
     if (cols < shapeY) {
         printf("Bad dims. Allowed: %zu. Actual: %zu", cols, shapeY);
@@ -35,17 +39,22 @@ void printMatrix(const char* name, const float* matrix, size_t shapeX, size_t sh
     }
 }
 
-bool check(const float* first, const float* second, const float* result, size_t firstShape, size_t secondShape, size_t thirdShape) {
+bool check(const float* first, const float* second, const float* result, const MatrixShape& shape) {
     std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
     start = std::chrono::high_resolution_clock::now();
-    for (size_t i = 0; i < firstShape; ++i) {
-        for (size_t j = 0; j < thirdShape; ++j) {
+    size_t lda = shape.strideA();
+    size_t ldb = shape.strideB();
+    size_t ldc = shape.strideC();
+    for (size_t i = 0; i < shape.M; ++i) {
+        for (size_t j = 0; j < shape.N; ++j) {
             float acc = 0;
-            for (size_t k = 0; k < secondShape; ++k) {
-                acc += first[i * secondShape + k] * second[(k * thirdShape) + j];
+            for (size_t k = 0; k < shape.K; ++k) {
+                float a = shape.transA ? first[k * lda + i] : first[i * lda + k];
+                float b = shape.transB ? second[j * ldb + k] : second[k * ldb + j];
+                acc += a * b;
             }
-            if (static_cast<int>(result[i * thirdShape + j]) != static_cast<int>(acc)) {
-                printf("Expected: %f. Actual: %f. i = %zu, j = %zu\n", acc, result[i * thirdShape + j], i, j);
+            if (static_cast<int>(result[i * ldc + j]) != static_cast<int>(acc)) {
+                printf("Expected: %f. Actual: %f. i = %zu, j = %zu\n", acc, result[i * ldc + j], i, j);
                 return false;
             }
         }
@@ -56,93 +65,348 @@ bool check(const float* first, const float* second, const float* result, size_t
     return true;
 }
 
-int main() {
-    srand(time(nullptr));
-    size_t A = 2048;
-    size_t B = 512;
-    size_t C = 1024;
-    std::shared_ptr<Environment> params(new Environment());
-    params->elementsOneThread = 16;
-    params->localWorkSize = get_nearest_up(32, params->elementsOneThread);
-    size_t firstShape  = get_nearest_up(A, params->localWorkSize);
-    size_t secondShape = get_nearest_up(B, params->localWorkSize);
-    size_t thirdShape  = get_nearest_up(C, params->localWorkSize);
-
-    auto* firstMatrix   = alloc_array<float>(firstShape  * secondShape);
-    auto* secondMatrix  = alloc_array<float>(secondShape * thirdShape);
-    auto* secondMatrixT = alloc_array<float>(secondShape * thirdShape);
-    auto* resultMatrix  = alloc_array<float>(firstShape  * thirdShape);
-
-    init_random_matrix(firstMatrix, A, B, secondShape);
-    init_random_matrix(secondMatrix, B, C, thirdShape);
-    transpose(secondMatrix, secondMatrixT, secondShape, thirdShape);
-
-    init(params);
-    create_context(params);
-    read_and_build("function_matrix.cl", params,
-            "-D LOCAL_GROUP_SIZE=" + std::to_string(params->localWorkSize) +
-                   " -D ELEMENTS=" + std::to_string(params->elementsOneThread));
-
-    params->kernelsCount  = 1;
-    params->kernels = static_cast<cl_kernel*>(malloc(sizeof(cl_kernel) * params->kernelsCount));
-    params->kernels[0] = clCreateKernel(params->program, "matrix_mul", nullptr);
-
-    // set arguments
-    cl_int result;
-    size_t firstSize  = firstShape  * secondShape * sizeof(float);
-    size_t secondSize = secondShape * thirdShape  * sizeof(float);
-    size_t resultSize = firstShape  * thirdShape  * sizeof(float);
-    cl_mem firstBuffer = clCreateBuffer(params->context, CL_MEM_READ_ONLY, firstSize, nullptr, &result);
-    cl_mem secondBuffer = clCreateBuffer(params->context, CL_MEM_READ_ONLY, secondSize, nullptr, &result);
-    cl_mem resultBuffer = clCreateBuffer(params->context, CL_MEM_READ_WRITE, resultSize, nullptr, &result);
-
-    cl_mem firstSizeBuffer = clCreateBuffer(params->context, CL_MEM_READ_ONLY, sizeof(size_t), nullptr, &result);
-    cl_mem secondSizeBuffer = clCreateBuffer(params->context, CL_MEM_READ_ONLY, sizeof(size_t), nullptr, &result);
-    cl_mem thirdSizeBuffer = clCreateBuffer(params->context, CL_MEM_READ_ONLY, sizeof(size_t), nullptr, &result);
-
-    clEnqueueWriteBuffer(params->commandQueue, firstBuffer, CL_TRUE, 0, firstSize, firstMatrix, 0, nullptr, nullptr);
-    clEnqueueWriteBuffer(params->commandQueue, secondBuffer, CL_TRUE, 0, secondSize, secondMatrixT, 0, nullptr, nullptr);
-    clEnqueueWriteBuffer(params->commandQueue, firstSizeBuffer, CL_TRUE, 0, sizeof(size_t), &firstShape, 0, nullptr,
-                         nullptr);
-    clEnqueueWriteBuffer(params->commandQueue, secondSizeBuffer, CL_TRUE, 0, sizeof(size_t), &secondShape, 0, nullptr,
-                         nullptr);
-    clEnqueueWriteBuffer(params->commandQueue, thirdSizeBuffer, CL_TRUE, 0, sizeof(size_t), &thirdShape, 0, nullptr,
-                         nullptr);
-
-    clSetKernelArg(params->kernels[0], 0, sizeof(cl_mem), &firstBuffer);
-    clSetKernelArg(params->kernels[0], 1, sizeof(cl_mem), &secondBuffer);
-    clSetKernelArg(params->kernels[0], 2, sizeof(cl_mem), &resultBuffer);
-    clSetKernelArg(params->kernels[0], 3, sizeof(cl_mem), &firstSizeBuffer);
-    clSetKernelArg(params->kernels[0], 4, sizeof(cl_mem), &secondSizeBuffer);
-    clSetKernelArg(params->kernels[0], 5, sizeof(cl_mem), &thirdSizeBuffer);
+// Multiplies the host matrices with device buffers over them. On CPU devices the buffers share
+// the host arrays, otherwise the data is copied, and the copied volume is reported.
+int run(Runtime& runtime, const MatrixShape& shape, float* firstMatrix, float* secondMatrix, float* resultMatrix,
+        bool retune, std::chrono::steady_clock::time_point startup) {
+    cl_command_queue queue = runtime.queue();
+    runtime.reset_copied_bytes();
+
+    HostBuffer firstBuffer(runtime, firstMatrix, shape.firstRows() * shape.strideA() * sizeof(float),
+                           CL_MEM_READ_ONLY);
+    HostBuffer secondBuffer(runtime, secondMatrix, shape.secondRows() * shape.strideB() * sizeof(float),
+                            CL_MEM_READ_ONLY);
+    HostBuffer resultBuffer(runtime, resultMatrix, shape.M * shape.strideC() * sizeof(float), CL_MEM_READ_WRITE);
+    firstBuffer.upload(queue);
+    secondBuffer.upload(queue);
+    resultBuffer.upload(queue);
 
     // execution
-    constexpr size_t workDims = 2;
-    size_t globalWorkSize[workDims] = { firstShape, thirdShape / params->elementsOneThread };
-    size_t localWorkSize[workDims] =  { params->localWorkSize, params->localWorkSize / params->elementsOneThread };
+    MatrixConfig config = autotune(runtime, shape, firstBuffer.get(), secondBuffer.get(), resultBuffer.get(),
+                                   retune);
+    printf("Time to tuned kernel: %f ms.\n",
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup).count());
+    double time = time_matrix_mul(runtime, config, shape, firstBuffer.get(), secondBuffer.get(), resultBuffer.get(),
+                                  3);
+    if (time <= 0) {
+        printf("Can't run matrix_mul.\n");
+        return EXIT_FAILURE;
+    }
+
+    resultBuffer.download(queue);
+    printf("Zero-copy: %s. Bytes copied: %zu.\n", resultBuffer.zeroCopy() ? "yes" : "no", runtime.copied_bytes());
+    if (!check(firstMatrix, secondMatrix, resultMatrix, shape)) {
+        return EXIT_FAILURE;
+    }
+    printf("Time: %f seconds.\n", time / 1e9);
+    printf("GFLOPS: %f.\n", shape.flops() / time);
+    return EXIT_SUCCESS;
+}
+
+void print_streaming(const StreamingStats& stats, const MatrixShape& shape) {
+    printf("Streaming: %zu panels of %zu rows.\n", stats.panels, stats.panelRows);
+    printf("Time: %f seconds (kernels %f s, transfers %f s).\n", stats.seconds, stats.kernelSeconds,
+           stats.transferSeconds);
+    printf("GFLOPS: %f.\n", shape.flops() / stats.seconds / 1e9);
+}
+
+void print_multi(Runtime& runtime, const MultiDeviceStats& stats, const MatrixShape& shape) {
+    for (size_t d = 0; d < stats.rows.size(); ++d) {
+        printf("%s: %zu rows, busy %f s.\n", runtime.info(d).name.c_str(), stats.rows[d], stats.deviceSeconds[d]);
+    }
+    printf("Time: %f seconds.\n", stats.seconds);
+    printf("GFLOPS: %f.\n", shape.flops() / stats.seconds / 1e9);
+}
+
+// batch multiplications of the shape in one launch, reported in matrices per second.
+int run_batched(Runtime& runtime, const MatrixShape& shape, size_t batch) {
+    if (batch == 0) {
+        return EXIT_SUCCESS;
+    }
+    size_t firstCount  = shape.firstRows() * shape.strideA();
+    size_t secondCount = shape.secondRows() * shape.strideB();
+    size_t resultCount = shape.M * shape.strideC();
+    auto* firstMatrices  = alloc_array<float>(batch * firstCount);
+    auto* secondMatrices = alloc_array<float>(batch * secondCount);
+    auto* resultMatrices = alloc_array<float>(batch * resultCount);
+    init_random_matrix(firstMatrices, batch * shape.firstRows(), shape.strideA(), shape.strideA());
+    init_random_matrix(secondMatrices, batch * shape.secondRows(), shape.strideB(), shape.strideB());
+
+    int res = EXIT_FAILURE;
+    {
+        cl_command_queue queue = runtime.queue();
+        HostBuffer firstBuffer(runtime, firstMatrices, batch * firstCount * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer secondBuffer(runtime, secondMatrices, batch * secondCount * sizeof(float), CL_MEM_READ_ONLY);
+        HostBuffer resultBuffer(runtime, resultMatrices, batch * resultCount * sizeof(float), CL_MEM_READ_WRITE);
+        firstBuffer.upload(queue);
+        secondBuffer.upload(queue);
+        resultBuffer.upload(queue);
 
-    cl_event event;
-    result = clEnqueueNDRangeKernel(params->commandQueue, params->kernels[0], workDims, nullptr, globalWorkSize,
-                                    localWorkSize, 0, nullptr, &event);
+        MatrixConfig config = batched_config(runtime, shape);
+        Event event;
+        cl_int err = matrix_mul_batched(runtime, queue, config, shape, batch, firstBuffer.get(), firstCount,
+                                        secondBuffer.get(), secondCount, resultBuffer.get(), resultCount,
+                                        0, nullptr, event.out());
+        if (err != CL_SUCCESS) {
+            printf("Can't run matrix_mul_batched. Error: %d\n", err);
+        } else {
+            resultBuffer.download(queue);
+            double time = event_time(event.get());
+            // the first and the last multiplication of the batch
+            size_t last = batch - 1;
+            if (check(firstMatrices, secondMatrices, resultMatrices, shape) &&
+                check(firstMatrices + last * firstCount, secondMatrices + last * secondCount,
+                      resultMatrices + last * resultCount, shape)) {
+                printf("Batch: %zu, tile %d x %d x %d.\n", batch, config.tileM, config.tileN, config.tileK);
+                printf("Time: %f seconds.\n", time / 1e9);
+                printf("Matrices/s: %f.\n", batch / (time / 1e9));
+                printf("GFLOPS: %f.\n", batch * shape.flops() / time);
+                res = EXIT_SUCCESS;
+            }
+        }
+    }
+    clear_array(firstMatrices);
+    clear_array(secondMatrices);
+    clear_array(resultMatrices);
+    return res;
+}
 
-    clWaitForEvents(1, &event);
-    clFinish(params->commandQueue);
+// count random values of the type at data; values gets them back exactly, widened to double.
+// int8 values are quantized with the per-tensor scale 1/16.
+void init_random_typed(MatrixType type, void* data, double* values, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        float value = (rand() % 2001 - 1000) / 100.0f;
+        switch (type) {
+            case MatrixType::Half:
+                static_cast<Half*>(data)[i] = floatToHalf(value);
+                values[i] = halfToFloat(static_cast<Half*>(data)[i]);
+                break;
+            case MatrixType::Bf16:
+                static_cast<Bf16*>(data)[i] = floatToBf16(value);
+                values[i] = bf16ToFloat(static_cast<Bf16*>(data)[i]);
+                break;
+            case MatrixType::Int8:
+                static_cast<int8_t*>(data)[i] = static_cast<int8_t>(rand() % 255 - 127);
+                values[i] = static_cast<int8_t*>(data)[i] / 16.0;
+                break;
+            default:
+                static_cast<float*>(data)[i] = value;
+                values[i] = value;
+        }
+    }
+}
 
-    cl_ulong time_start;
-    cl_ulong time_end;
-    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, nullptr);
-    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, nullptr);
-    double time = time_end - time_start;
+// Largest error of the result against the fp64 product of the same inputs,
+// relative to the sum of |a * b| of the entry.
+double max_relative_error(const double* first, const double* second, const float* result, const MatrixShape& shape) {
+    size_t lda = shape.strideA();
+    size_t ldb = shape.strideB();
+    size_t ldc = shape.strideC();
+    double worst = 0.0;
+    for (size_t i = 0; i < shape.M; ++i) {
+        for (size_t j = 0; j < shape.N; ++j) {
+            double expected = 0.0;
+            double magnitude = 0.0;
+            for (size_t k = 0; k < shape.K; ++k) {
+                double a = shape.transA ? first[k * lda + i] : first[i * lda + k];
+                double b = shape.transB ? second[j * ldb + k] : second[k * ldb + j];
+                expected += a * b;
+                magnitude += std::fabs(a * b);
+            }
+            if (magnitude > 0) {
+                worst = std::max(worst, std::fabs(result[i * ldc + j] - expected) / magnitude);
+            }
+        }
+    }
+    return worst;
+}
 
-    result = clEnqueueReadBuffer(params->commandQueue, resultBuffer, CL_TRUE, 0, resultSize, resultMatrix, 0, nullptr,
-                                 nullptr);
-    if (check(firstMatrix, secondMatrix, resultMatrix, firstShape, secondShape, thirdShape)) {
-        printf("Time: %f seconds.\n", time / 1e9);
-        printf("GFLOPS: %f.\n", 2.0 * firstShape * thirdShape * secondShape / time);
+// Multiplies half, bf16 or int8 matrices and validates them against fp64.
+int run_typed(Runtime& runtime, MatrixShape shape, bool halfOnCpu) {
+    size_t firstCount  = shape.firstRows() * shape.strideA();
+    size_t secondCount = shape.secondRows() * shape.strideB();
+    std::vector<double> firstValues(firstCount);
+    std::vector<double> secondValues(secondCount);
+    auto* firstMatrix  = alloc_array<char>(firstCount * shape.elementSize());
+    auto* secondMatrix = alloc_array<char>(secondCount * shape.elementSize());
+    auto* resultMatrix = alloc_array<float>(shape.M * shape.strideC());
+    init_random_typed(shape.type, firstMatrix, firstValues.data(), firstCount);
+    init_random_typed(shape.type, secondMatrix, secondValues.data(), secondCount);
+    if (shape.type == MatrixType::Int8) {
+        shape.scale = 1.0f / 256;
+    }
+
+    bool onCpu = false;
+    double time = matrix_mul_host(runtime, shape, firstMatrix, secondMatrix, resultMatrix, onCpu, halfOnCpu);
+    int res = EXIT_FAILURE;
+    if (time > 0) {
+        double error = max_relative_error(firstValues.data(), secondValues.data(), resultMatrix, shape);
+        // fp32 accumulation is good to about K * 2^-24 of the magnitude, int32 accumulation is exact
+        bool ok = error <= (shape.type == MatrixType::Int8 ? 1e-6 : shape.K * 6e-8);
+        size_t bytes = (firstCount + secondCount) * shape.elementSize();
+        printf("Type: %s on %s. Max relative error vs fp64: %g%s.\n", shape.typeName().c_str(),
+               onCpu ? "the CPU (no cl_khr_fp16)" : runtime.info().name.c_str(), error, ok ? "" : " (too large)");
+        printf("Input bytes: %zu (float: %zu).\n", bytes, (firstCount + secondCount) * sizeof(float));
+        printf("Time: %f seconds.\n", time);
+        printf("GFLOPS: %f.\n", shape.flops() / time / 1e9);
+        res = ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
     clear_array(firstMatrix);
     clear_array(secondMatrix);
-    clear_array(secondMatrixT);
     clear_array(resultMatrix);
+    return res;
+}
+
+// Multiplies matrices stored in raw float files, result goes to a new file.
+int run_files(const MatrixShape& shape, const char* firstPath, const char* secondPath, const char* resultPath,
+              size_t panelRows) {
+    MappedFile firstFile = MappedFile::open(firstPath);
+    MappedFile secondFile = MappedFile::open(secondPath);
+    MappedFile resultFile = MappedFile::create(resultPath, shape.M * shape.strideC() * sizeof(float));
+    if (!firstFile.valid() || !secondFile.valid() || !resultFile.valid()) {
+        return EXIT_FAILURE;
+    }
+    if (firstFile.size() < shape.firstRows() * shape.strideA() * sizeof(float) ||
+        secondFile.size() < shape.secondRows() * shape.strideB() * sizeof(float)) {
+        printf("Input files are smaller than the shape.\n");
+        return EXIT_FAILURE;
+    }
+    Runtime& runtime = Runtime::instance();
+    if (!runtime.valid()) {
+        return EXIT_FAILURE;
+    }
+    StreamingStats stats = matrix_mul_streaming(runtime, tuned_config(runtime, shape), shape,
+                                                static_cast<const float*>(firstFile.data()),
+                                                static_cast<const float*>(secondFile.data()),
+                                                static_cast<float*>(resultFile.data()), panelRows);
+    if (!stats.ok) {
+        return EXIT_FAILURE;
+    }
+    print_streaming(stats, shape);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+// Writes the trace of the run when OPENCL_TRACE names a file.
+int finish(int res) {
+    Trace::instance().finish();
+    return res;
+}
+
+// MatrixCL [M K N] [NN|NT|TN|TT] [--retune] [--stream ROWS] [--multi weighted|dynamic] [--files A B C]
+//          [--batch COUNT] [--type half|bf16|int8] [--half-cpu]
+// --stream also runs the panel-streaming path (ROWS = 0 picks the panel size),
+// --multi also splits the multiplication between all devices (run twice with weighted to see the balanced split),
+// --files streams raw float matrices from A and B into C without loading them into memory,
+// --batch runs COUNT multiplications of the shape in one batched launch instead,
+// --type multiplies matrices of that type instead and checks them against fp64,
+// --half-cpu multiplies half on the CPU if the device has no cl_khr_fp16.
+// OPENCL_TRACE=FILE writes the OpenCL commands and program builds of the run as Chrome trace JSON.
+int main(int argc, char** argv) {
+    srand(time(nullptr));
+    MatrixShape shape;
+    shape.M = 2048;
+    shape.K = 512;
+    shape.N = 1024;
+    bool retune = false;
+    bool stream = false;
+    size_t panelRows = 0;
+    const char* multi = nullptr;
+    size_t batch = 0;
+    const char* type = nullptr;
+    bool halfOnCpu = false;
+    const char* files[3] = { nullptr, nullptr, nullptr };
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--retune") == 0) {
+            retune = true;
+        } else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            stream = true;
+            panelRows = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--multi") == 0 && i + 1 < argc) {
+            multi = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--type") == 0 && i + 1 < argc) {
+            type = argv[++i];
+        } else if (strcmp(argv[i], "--half-cpu") == 0) {
+            halfOnCpu = true;
+        } else if (strcmp(argv[i], "--files") == 0 && i + 3 < argc) {
+            for (int j = 0; j < 3; ++j) files[j] = argv[++i];
+        } else if (strlen(argv[i]) == 2 && (argv[i][0] == 'N' || argv[i][0] == 'T')) {
+            shape.transA = argv[i][0] == 'T';
+            shape.transB = argv[i][1] == 'T';
+        } else {
+            size_t value = strtoul(argv[i], nullptr, 10);
+            if (positional == 0) shape.M = value;
+            if (positional == 1) shape.K = value;
+            if (positional == 2) shape.N = value;
+            ++positional;
+        }
+    }
+    printf("Shape: %zu x %zu x %zu, layout %s\n", shape.M, shape.K, shape.N, shape.layout().c_str());
+    if (files[0] != nullptr) {
+        return finish(run_files(shape, files[0], files[1], files[2], panelRows));
+    }
+    if (batch != 0) {
+        Runtime& runtime = Runtime::instance();
+        return runtime.valid() ? finish(run_batched(runtime, shape, batch)) : EXIT_FAILURE;
+    }
+    if (type != nullptr) {
+        shape.type = strcmp(type, "half") == 0 ? MatrixType::Half
+                   : strcmp(type, "bf16") == 0 ? MatrixType::Bf16
+                   : strcmp(type, "int8") == 0 ? MatrixType::Int8 : MatrixType::Float;
+        Runtime& runtime = Runtime::instance();
+        return runtime.valid() ? finish(run_typed(runtime, shape, halfOnCpu)) : EXIT_FAILURE;
+    }
+    size_t firstCount  = shape.firstRows() * shape.strideA();
+    size_t secondCount = shape.secondRows() * shape.strideB();
+    size_t resultCount = shape.M * shape.strideC();
+    auto* firstMatrix  = alloc_array<float>(firstCount);
+    auto* secondMatrix = alloc_array<float>(secondCount);
+    auto* resultMatrix = alloc_array<float>(resultCount);
+
+    init_random_matrix(firstMatrix, shape.firstRows(), shape.strideA(), shape.strideA());
+    init_random_matrix(secondMatrix, shape.secondRows(), shape.strideB(), shape.strideB());
+
+    auto startup = std::chrono::steady_clock::now();
+    Runtime& runtime = Runtime::instance();
+    if (!runtime.valid()) {
+        return EXIT_FAILURE;
+    }
+    int res = run(runtime, shape, firstMatrix, secondMatrix, resultMatrix, retune, startup);
+    if (res == EXIT_SUCCESS && stream) {
+        std::memset(resultMatrix, 0, resultCount * sizeof(float));
+        StreamingStats stats = matrix_mul_streaming(runtime, tuned_config(runtime, shape), shape, firstMatrix,
+                                                    secondMatrix, resultMatrix, panelRows);
+        if (!stats.ok || !check(firstMatrix, secondMatrix, resultMatrix, shape)) {
+            res = EXIT_FAILURE;
+        } else {
+            print_streaming(stats, shape);
+        }
+    }
+    if (res == EXIT_SUCCESS && multi != nullptr) {
+        SplitMode mode = strcmp(multi, "dynamic") == 0 ? SplitMode::Dynamic : SplitMode::Weighted;
+        WorkSplitter splitter(runtime);
+        if (!shape.transA) {
+            // on NUMA sub-devices the rows of A and C move to the node of the device that computes them
+            std::vector<WorkRange> ranges = splitter.split(shape.M, 64);
+            numa_place(runtime, firstMatrix, shape.strideA() * sizeof(float), ranges);
+            numa_place(runtime, resultMatrix, shape.strideC() * sizeof(float), ranges);
+            numa_interleave(secondMatrix, secondCount * sizeof(float));
+        }
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            std::memset(resultMatrix, 0, resultCount * sizeof(float));
+            MultiDeviceStats stats = matrix_mul_multi(runtime, splitter, shape, firstMatrix, secondMatrix,
+                                                      resultMatrix, mode);
+            if (!stats.ok || !check(firstMatrix, secondMatrix, resultMatrix, shape)) {
+                res = EXIT_FAILURE;
+                break;
+            }
+            print_multi(runtime, stats, shape);
+        }
+    }
+    clear_array(firstMatrix);
+    clear_array(secondMatrix);
+    clear_array(resultMatrix);
+    return finish(res);
+}
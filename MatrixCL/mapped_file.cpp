@@ -0,0 +1,69 @@
+#include "mapped_file.h"
+#include <cstdio>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(MappedFile&& other) noexcept : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
+MappedFile MappedFile::open(const std::string& path) {
+    MappedFile res;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        printf("Can't open %s\n", path.c_str());
+        return res;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            // panels are read front to back
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            res.data_ = data;
+            res.size_ = info.st_size;
+        }
+    }
+    close(fd);
+    if (!res.valid()) {
+        printf("Can't map %s\n", path.c_str());
+    }
+    return res;
+}
+
+MappedFile MappedFile::create(const std::string& path, size_t size) {
+    MappedFile res;
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Can't create %s\n", path.c_str());
+        return res;
+    }
+    if (size > 0 && ftruncate(fd, size) == 0) {
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            res.data_ = data;
+            res.size_ = size;
+        }
+    }
+    close(fd);
+    if (!res.valid()) {
+        printf("Can't map %s\n", path.c_str());
+    }
+    return res;
+}
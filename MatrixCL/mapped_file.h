@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Whole file mapped into memory, so inputs larger than RAM or device memory can be streamed.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    // Read-only mapping of an existing file.
+    static MappedFile open(const std::string& path);
+    // Read-write mapping of a new file of the given size.
+    static MappedFile create(const std::string& path, size_t size);
+
+    bool valid() const { return data_ != nullptr; }
+    void* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    void*  data_ { nullptr };
+    size_t size_ { 0 };
+};
@@ -0,0 +1,484 @@
+#include "matrix_expr.h"
+#include <cstdio>
+#include <set>
+#include <utility>
+#include "trace.h"
+
+struct MatrixExpr::Node {
+    size_t rows { 0 };
+    size_t cols { 0 };
+    // why the expression can't be evaluated, CL_SUCCESS if it can
+    cl_int error { CL_SUCCESS };
+
+    // inputs: host data or a device buffer
+    std::string  name;
+    const float* host  { nullptr };
+    cl_mem       input { nullptr };
+
+    // products: the chain of factors, at least two, and the epilogue of its last multiplication
+    std::vector<std::shared_ptr<Node>> factors;
+    float                 alpha      { 1.0f };
+    float                 beta       { 0.0f };
+    std::shared_ptr<Node> addend;
+    std::shared_ptr<Node> rowBias;
+    std::shared_ptr<Node> colBias;
+    Activation            activation { Activation::None };
+
+    // the result once evaluated
+    bool         evaluated { false };
+    cl_mem       result    { nullptr };
+    DeviceFuture ready;
+
+    bool product() const { return !factors.empty(); }
+    bool epilogue() const {
+        return alpha != 1.0f || addend || rowBias || colBias || activation != Activation::None;
+    }
+};
+
+namespace {
+
+using Node = MatrixExpr::Node;
+using NodePtr = std::shared_ptr<Node>;
+
+const char* const ACTIVATION_NAMES[] = { "", "relu", "gelu", "sigmoid" };
+
+// A device buffer with a part of a chain and the future of the commands that write it.
+struct Partial {
+    cl_mem       buffer;
+    DeviceFuture ready;
+};
+
+NodePtr failed(cl_int error) {
+    NodePtr node = std::make_shared<Node>();
+    node->error = error;
+    return node;
+}
+
+// The product with the same chain and epilogue, not evaluated, to be extended by an element-wise operation.
+NodePtr extend(const NodePtr& node, bool allowed, const char* operation) {
+    if (node->error != CL_SUCCESS) {
+        return node;
+    }
+    if (!node->product() || !allowed) {
+        printf("Can't fuse %s into the epilogue of the expression.\n", operation);
+        return failed(CL_INVALID_OPERATION);
+    }
+    NodePtr res = std::make_shared<Node>(*node);
+    res->evaluated = false;
+    res->result = nullptr;
+    res->ready = DeviceFuture();
+    return res;
+}
+
+// A product without an epilogue is multiplied further as its chain, unless it has been evaluated already.
+void append_factors(const NodePtr& node, std::vector<NodePtr>& factors) {
+    if (node->product() && !node->epilogue() && !node->evaluated) {
+        factors.insert(factors.end(), node->factors.begin(), node->factors.end());
+    } else {
+        factors.push_back(node);
+    }
+}
+
+std::vector<size_t> chain_dims(const Node& node) {
+    std::vector<size_t> dims { node.factors[0]->rows };
+    for (const NodePtr& factor : node.factors) {
+        dims.push_back(factor->cols);
+    }
+    return dims;
+}
+
+// Enqueues target (M x N) = first (M x K) * second (K x N) with the epilogue after the futures in after.
+// The future owns buffers.
+DeviceFuture enqueue_product(Runtime& runtime, cl_command_queue queue, size_t M, size_t N, size_t K,
+                             cl_mem first, cl_mem second, cl_mem target, std::vector<PooledBuffer> buffers,
+                             const MatrixEpilogue& epilogue, const std::vector<DeviceFuture>& after) {
+    cl_int res = first_error(after);
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    MatrixShape shape;
+    shape.M = M;
+    shape.N = N;
+    shape.K = K;
+    std::vector<cl_event> waitList = wait_list(after);
+    Event event;
+    res = matrix_mul(runtime, queue, tuned_config(runtime, shape), shape, epilogue, first, second, target,
+                     static_cast<cl_uint>(waitList.size()), waitList.empty() ? nullptr : waitList.data(), event.out());
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    return DeviceFuture(std::move(event), std::move(buffers), after);
+}
+
+// Product of factors first..last of node in the order of split, in a pooled buffer.
+Partial multiply_range(Runtime& runtime, cl_command_queue queue, const Node& node,
+                       const std::vector<std::vector<size_t>>& split, size_t first, size_t last) {
+    if (first == last) {
+        return { node.factors[first]->result, node.factors[first]->ready };
+    }
+    size_t middle = split[first][last];
+    Partial left = multiply_range(runtime, queue, node, split, first, middle);
+    Partial right = multiply_range(runtime, queue, node, split, middle + 1, last);
+    size_t M = node.factors[first]->rows;
+    size_t N = node.factors[last]->cols;
+    std::vector<PooledBuffer> buffers;
+    buffers.push_back(runtime.buffers().acquire(M * N * sizeof(float)));
+    if (!buffers.back()) {
+        return { nullptr, DeviceFuture(CL_MEM_OBJECT_ALLOCATION_FAILURE) };
+    }
+    Partial res;
+    res.buffer = buffers.back().get();
+    res.ready = enqueue_product(runtime, queue, M, N, node.factors[middle]->cols, left.buffer, right.buffer,
+                                res.buffer, std::move(buffers), MatrixEpilogue(), { left.ready, right.ready });
+    return res;
+}
+
+void evaluate_node(Runtime& runtime, cl_command_queue queue, Node& node);
+
+DeviceFuture evaluate_input(Runtime& runtime, cl_command_queue queue, Node& node) {
+    if (node.host == nullptr) {
+        node.result = node.input;
+        return DeviceFuture();
+    }
+    size_t bytes = node.rows * node.cols * sizeof(float);
+    std::vector<PooledBuffer> buffers;
+    buffers.push_back(runtime.buffers().acquire(bytes, CL_MEM_READ_ONLY));
+    if (!buffers.back()) {
+        return DeviceFuture(CL_MEM_OBJECT_ALLOCATION_FAILURE);
+    }
+    node.result = buffers.back().get();
+    Event event;
+    TracedEvent traced(event.out(), TraceKind::Write, node.name.empty() ? "matrix input" : node.name,
+                       static_cast<double>(bytes));
+    cl_int res = traced.done(clEnqueueWriteBuffer(queue, node.result, CL_FALSE, 0, bytes, node.host, 0, nullptr,
+                                                  traced.out()));
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    runtime.count_copy(bytes);
+    return DeviceFuture(std::move(event), std::move(buffers));
+}
+
+// The chain is split where chain_order says, the last multiplication writes the node's buffer with the epilogue.
+// An added matrix is copied there first and enters through beta.
+DeviceFuture evaluate_product(Runtime& runtime, cl_command_queue queue, Node& node) {
+    std::vector<DeviceFuture> after;
+    for (const NodePtr& factor : node.factors) {
+        evaluate_node(runtime, queue, *factor);
+    }
+    for (const NodePtr& operand : { node.addend, node.rowBias, node.colBias }) {
+        if (operand) {
+            evaluate_node(runtime, queue, *operand);
+            after.push_back(operand->ready);
+        }
+    }
+    std::vector<std::vector<size_t>> split;
+    chain_order(chain_dims(node), split);
+    size_t last = node.factors.size() - 1;
+    size_t middle = split[0][last];
+    Partial left = multiply_range(runtime, queue, node, split, 0, middle);
+    Partial right = multiply_range(runtime, queue, node, split, middle + 1, last);
+    after.push_back(left.ready);
+    after.push_back(right.ready);
+
+    size_t bytes = node.rows * node.cols * sizeof(float);
+    std::vector<PooledBuffer> buffers;
+    buffers.push_back(runtime.buffers().acquire(bytes));
+    if (!buffers.back()) {
+        return DeviceFuture(CL_MEM_OBJECT_ALLOCATION_FAILURE);
+    }
+    node.result = buffers.back().get();
+    if (node.addend) {
+        cl_int res = first_error(after);
+        if (res != CL_SUCCESS) {
+            return DeviceFuture(res);
+        }
+        std::vector<cl_event> waitList = wait_list({ node.addend->ready });
+        Event event;
+        TracedEvent traced(event.out(), TraceKind::Copy, "matrix addend", static_cast<double>(bytes));
+        res = traced.done(clEnqueueCopyBuffer(queue, node.addend->result, node.result, 0, 0, bytes,
+                                              static_cast<cl_uint>(waitList.size()),
+                                              waitList.empty() ? nullptr : waitList.data(), traced.out()));
+        if (res != CL_SUCCESS) {
+            return DeviceFuture(res);
+        }
+        after.push_back(DeviceFuture(std::move(event), {}, { node.addend->ready }));
+    }
+
+    MatrixEpilogue epilogue;
+    epilogue.alpha = node.alpha;
+    epilogue.beta = node.beta;
+    epilogue.rowBias = node.rowBias ? node.rowBias->result : nullptr;
+    epilogue.colBias = node.colBias ? node.colBias->result : nullptr;
+    epilogue.activation = node.activation;
+    return enqueue_product(runtime, queue, node.rows, node.cols, node.factors[middle]->cols, left.buffer,
+                           right.buffer, node.result, std::move(buffers), epilogue, after);
+}
+
+void evaluate_node(Runtime& runtime, cl_command_queue queue, Node& node) {
+    if (node.evaluated) {
+        return;
+    }
+    node.evaluated = true;
+    if (node.error != CL_SUCCESS) {
+        node.ready = DeviceFuture(node.error);
+    } else {
+        node.ready = node.product() ? evaluate_product(runtime, queue, node) : evaluate_input(runtime, queue, node);
+    }
+    if (!node.ready.ok()) {
+        node.result = nullptr;
+    }
+}
+
+std::string format_float(float value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%g", value);
+    return text;
+}
+
+std::string split_plan(const Node& node, const std::vector<std::vector<size_t>>& split, size_t first, size_t last);
+
+std::string node_plan(const Node& node) {
+    if (node.error != CL_SUCCESS) {
+        return "<invalid>";
+    }
+    if (!node.product()) {
+        return !node.name.empty() ? node.name : "[" + std::to_string(node.rows) + "x" + std::to_string(node.cols) + "]";
+    }
+    std::vector<std::vector<size_t>> split;
+    chain_order(chain_dims(node), split);
+    std::string res = split_plan(node, split, 0, node.factors.size() - 1);
+    if (node.alpha != 1.0f) {
+        res = format_float(node.alpha) + " * " + res;
+    }
+    if (node.addend) {
+        res += " + " + (node.beta != 1.0f ? format_float(node.beta) + " * " : "") + node_plan(*node.addend);
+    }
+    if (node.rowBias) {
+        res += " + rows " + node_plan(*node.rowBias);
+    }
+    if (node.colBias) {
+        res += " + cols " + node_plan(*node.colBias);
+    }
+    if (node.activation == Activation::None) {
+        return res;
+    }
+    return std::string(ACTIVATION_NAMES[static_cast<int>(node.activation)]) + "(" + res + ")";
+}
+
+std::string split_plan(const Node& node, const std::vector<std::vector<size_t>>& split, size_t first, size_t last) {
+    if (first == last) {
+        return node_plan(*node.factors[first]);
+    }
+    size_t middle = split[first][last];
+    return "(" + split_plan(node, split, first, middle) + " * " + split_plan(node, split, middle + 1, last) + ")";
+}
+
+// Flops of every product of the expression, each counted once.
+double node_flops(const Node& node, bool planned, std::set<const Node*>& visited) {
+    if (!visited.insert(&node).second || node.error != CL_SUCCESS) {
+        return 0.0;
+    }
+    double res = 0.0;
+    for (const NodePtr& operand : { node.addend, node.rowBias, node.colBias }) {
+        if (operand) {
+            res += node_flops(*operand, planned, visited);
+        }
+    }
+    if (!node.product()) {
+        return res;
+    }
+    for (const NodePtr& factor : node.factors) {
+        res += node_flops(*factor, planned, visited);
+    }
+    std::vector<size_t> dims = chain_dims(node);
+    if (planned) {
+        std::vector<std::vector<size_t>> split;
+        return res + 2.0 * chain_order(dims, split);
+    }
+    for (size_t k = 1; k + 1 < dims.size(); ++k) {
+        res += 2.0 * dims[0] * dims[k] * dims[k + 1];
+    }
+    return res;
+}
+
+}
+
+double chain_order(const std::vector<size_t>& dims, std::vector<std::vector<size_t>>& split) {
+    size_t count = dims.size() - 1;
+    std::vector<std::vector<double>> cost(count, std::vector<double>(count, 0.0));
+    split.assign(count, std::vector<size_t>(count, 0));
+    for (size_t length = 2; length <= count; ++length) {
+        for (size_t first = 0; first + length <= count; ++first) {
+            size_t last = first + length - 1;
+            cost[first][last] = -1.0;
+            for (size_t middle = first; middle < last; ++middle) {
+                double candidate = cost[first][middle] + cost[middle + 1][last] +
+                                   static_cast<double>(dims[first]) * dims[middle + 1] * dims[last + 1];
+                if (cost[first][last] < 0 || candidate < cost[first][last]) {
+                    cost[first][last] = candidate;
+                    split[first][last] = middle;
+                }
+            }
+        }
+    }
+    return cost[0][count - 1];
+}
+
+MatrixExpr matrix_input(Runtime& runtime, const float* data, size_t rows, size_t cols, std::string name) {
+    NodePtr node = std::make_shared<Node>();
+    node->rows = rows;
+    node->cols = cols;
+    node->host = data;
+    node->name = std::move(name);
+    return MatrixExpr(&runtime, node);
+}
+
+MatrixExpr matrix_input(Runtime& runtime, cl_mem buffer, size_t rows, size_t cols, std::string name) {
+    NodePtr node = std::make_shared<Node>();
+    node->rows = rows;
+    node->cols = cols;
+    node->input = buffer;
+    node->name = std::move(name);
+    return MatrixExpr(&runtime, node);
+}
+
+size_t MatrixExpr::rows() const {
+    return node_ ? node_->rows : 0;
+}
+
+size_t MatrixExpr::cols() const {
+    return node_ ? node_->cols : 0;
+}
+
+bool MatrixExpr::valid() const {
+    return node_ && node_->error == CL_SUCCESS;
+}
+
+MatrixExpr MatrixExpr::operator*(const MatrixExpr& other) const {
+    if (!valid() || !other.valid()) {
+        return MatrixExpr(runtime_ != nullptr ? runtime_ : other.runtime_, failed(CL_INVALID_VALUE));
+    }
+    if (cols() != other.rows()) {
+        printf("Can't multiply %zu x %zu by %zu x %zu.\n", rows(), cols(), other.rows(), other.cols());
+        return MatrixExpr(runtime_, failed(CL_INVALID_VALUE));
+    }
+    NodePtr node = std::make_shared<Node>();
+    node->rows = rows();
+    node->cols = other.cols();
+    append_factors(node_, node->factors);
+    append_factors(other.node_, node->factors);
+    return MatrixExpr(runtime_, node);
+}
+
+MatrixExpr MatrixExpr::scaled(float alpha) const {
+    if (!valid()) {
+        return *this;
+    }
+    NodePtr node = extend(node_, !node_->rowBias && !node_->colBias && node_->activation == Activation::None,
+                          "scaling");
+    if (node->error == CL_SUCCESS) {
+        node->alpha *= alpha;
+        node->beta *= alpha;
+    }
+    return MatrixExpr(runtime_, node);
+}
+
+MatrixExpr MatrixExpr::plus(const MatrixExpr& other, float weight) const {
+    if (!valid() || !other.valid()) {
+        return MatrixExpr(runtime_, failed(CL_INVALID_VALUE));
+    }
+    if (rows() != other.rows() || cols() != other.cols()) {
+        printf("Can't add %zu x %zu to %zu x %zu.\n", other.rows(), other.cols(), rows(), cols());
+        return MatrixExpr(runtime_, failed(CL_INVALID_VALUE));
+    }
+    NodePtr node = extend(node_, !node_->addend && !node_->rowBias && !node_->colBias &&
+                                 node_->activation == Activation::None, "the sum");
+    if (node->error == CL_SUCCESS) {
+        node->addend = other.node_;
+        node->beta = weight;
+    }
+    return MatrixExpr(runtime_, node);
+}
+
+MatrixExpr MatrixExpr::with_row_bias(const MatrixExpr& bias) const {
+    if (!valid() || !bias.valid() || bias.rows() * bias.cols() != rows()) {
+        printf("The row bias needs %zu values.\n", rows());
+        return MatrixExpr(runtime_, failed(CL_INVALID_VALUE));
+    }
+    NodePtr node = extend(node_, !node_->rowBias && node_->activation == Activation::None, "the row bias");
+    if (node->error == CL_SUCCESS) {
+        node->rowBias = bias.node_;
+    }
+    return MatrixExpr(runtime_, node);
+}
+
+MatrixExpr MatrixExpr::with_col_bias(const MatrixExpr& bias) const {
+    if (!valid() || !bias.valid() || bias.rows() * bias.cols() != cols()) {
+        printf("The column bias needs %zu values.\n", cols());
+        return MatrixExpr(runtime_, failed(CL_INVALID_VALUE));
+    }
+    NodePtr node = extend(node_, !node_->colBias && node_->activation == Activation::None, "the column bias");
+    if (node->error == CL_SUCCESS) {
+        node->colBias = bias.node_;
+    }
+    return MatrixExpr(runtime_, node);
+}
+
+MatrixExpr MatrixExpr::activated(Activation activation) const {
+    if (!valid()) {
+        return *this;
+    }
+    NodePtr node = extend(node_, node_->activation == Activation::None, "the activation");
+    if (node->error == CL_SUCCESS) {
+        node->activation = activation;
+    }
+    return MatrixExpr(runtime_, node);
+}
+
+DeviceFuture MatrixExpr::evaluate(cl_command_queue queue) {
+    if (runtime_ == nullptr || !node_) {
+        return DeviceFuture(CL_INVALID_VALUE);
+    }
+    evaluate_node(*runtime_, queue, *node_);
+    return node_->ready;
+}
+
+cl_mem MatrixExpr::buffer() const {
+    return node_ ? node_->result : nullptr;
+}
+
+cl_int MatrixExpr::read(float* result) {
+    if (runtime_ == nullptr) {
+        return CL_INVALID_VALUE;
+    }
+    cl_command_queue queue = runtime_->queue();
+    DeviceFuture ready = evaluate(queue);
+    if (!ready.ok()) {
+        return ready.status();
+    }
+    size_t bytes = rows() * cols() * sizeof(float);
+    std::vector<cl_event> waitList = wait_list({ ready });
+    TracedEvent traced(nullptr, TraceKind::Read, "matrix result", static_cast<double>(bytes));
+    cl_int res = traced.done(clEnqueueReadBuffer(queue, buffer(), CL_TRUE, 0, bytes, result,
+                                                 static_cast<cl_uint>(waitList.size()),
+                                                 waitList.empty() ? nullptr : waitList.data(), traced.out()));
+    if (res == CL_SUCCESS) {
+        runtime_->count_copy(bytes);
+    }
+    return res;
+}
+
+std::string MatrixExpr::plan() const {
+    return node_ ? node_plan(*node_) : "<empty>";
+}
+
+double MatrixExpr::flops() const {
+    std::set<const Node*> visited;
+    return node_ ? node_flops(*node_, true, visited) : 0.0;
+}
+
+double MatrixExpr::left_to_right_flops() const {
+    std::set<const Node*> visited;
+    return node_ ? node_flops(*node_, false, visited) : 0.0;
+}
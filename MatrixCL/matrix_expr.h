@@ -0,0 +1,74 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "matrix_mul.h"
+
+// Lazy expression over float row-major matrices. Building an expression only records it:
+//
+//     MatrixExpr y = (matrix_input(runtime, A, m, m, "A") * matrix_input(runtime, B, m, m, "B") *
+//                     matrix_input(runtime, x, m, 1, "x")).activated(Activation::Relu);
+//     y.read(result);
+//
+// Products of products are flattened into one chain, and the chain is multiplied in the order that needs
+// the fewest flops for the real shapes (matrix-chain dynamic programming), so A * B * x runs as A * (B * x).
+// Element-wise operations on a product go into the epilogue of its last multiplication (MatrixEpilogue):
+// they are accepted in the order of the epilogue, scaling, then an added matrix, then biases,
+// then an activation, and an expression that doesn't fit fails with CL_INVALID_OPERATION when evaluated.
+// Nothing runs until the result is read or evaluated. Host inputs are uploaded once, intermediates live in
+// pooled device buffers, the commands only wait for each other on the device, and only the result is read back.
+// Every subexpression is evaluated once and keeps its result; host inputs must not change afterwards.
+class MatrixExpr {
+public:
+    MatrixExpr() = default;
+
+    size_t rows() const;
+    size_t cols() const;
+    // Whether the expression could be built; operations on an invalid expression stay invalid.
+    bool valid() const;
+
+    // Matrix product, the numbers of columns of this and rows of other have to match.
+    MatrixExpr operator*(const MatrixExpr& other) const;
+    // this * alpha, this has to be a product.
+    MatrixExpr scaled(float alpha) const;
+    // this + weight * other, other of the same shape.
+    MatrixExpr plus(const MatrixExpr& other, float weight = 1.0f) const;
+    // Adds bias[i] to row i, bias has rows() elements.
+    MatrixExpr with_row_bias(const MatrixExpr& bias) const;
+    // Adds bias[j] to column j, bias has cols() elements.
+    MatrixExpr with_col_bias(const MatrixExpr& bias) const;
+    MatrixExpr activated(Activation activation) const;
+
+    // Enqueues everything the expression needs on queue. The future completes when the result is in buffer().
+    DeviceFuture evaluate(cl_command_queue queue);
+    // The result on the device after evaluate, nullptr before.
+    cl_mem buffer() const;
+    // Evaluates on the runtime's queue and reads the result into rows() x cols() floats, blocking.
+    cl_int read(float* result);
+
+    // The order of the multiplications, like "(A * (B * x))".
+    std::string plan() const;
+    // Flops of the planned multiplications, and of the same chains multiplied from left to right.
+    double flops() const;
+    double left_to_right_flops() const;
+
+    struct Node;
+
+private:
+    MatrixExpr(Runtime* runtime, std::shared_ptr<Node> node) : runtime_(runtime), node_(std::move(node)) {}
+    friend MatrixExpr matrix_input(Runtime& runtime, const float* data, size_t rows, size_t cols, std::string name);
+    friend MatrixExpr matrix_input(Runtime& runtime, cl_mem buffer, size_t rows, size_t cols, std::string name);
+
+    Runtime*              runtime_ { nullptr };
+    std::shared_ptr<Node> node_;
+};
+
+// Leaf over rows x cols host floats, uploaded on the first evaluation. data has to stay valid until then.
+MatrixExpr matrix_input(Runtime& runtime, const float* data, size_t rows, size_t cols, std::string name = "");
+
+// Leaf over a device buffer of rows x cols floats, used in place.
+MatrixExpr matrix_input(Runtime& runtime, cl_mem buffer, size_t rows, size_t cols, std::string name = "");
+
+// Order of the chain of factors with shapes dims[i] x dims[i + 1] that needs the fewest multiply-adds:
+// split[i][j] is the factor after which the product of factors i..j is split. Returns the multiply-adds.
+double chain_order(const std::vector<size_t>& dims, std::vector<std::vector<size_t>>& split);
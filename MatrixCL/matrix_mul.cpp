@@ -0,0 +1,372 @@
+#include "matrix_mul.h"
+#include "trace.h"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <utility>
+
+namespace {
+
+// One line per device and shape:
+// device name <TAB> M N K layout [type] <TAB> tileM tileN tileK wptM wptN vw <TAB> GFLOPS
+const char* TUNING_FILE = "matrix_tuning.txt";
+
+const char* const TYPE_NAMES[] = { "float", "half", "bf16", "int8" };
+
+// float shapes keep the keys they had before the other types
+std::string shape_key(const MatrixShape& shape) {
+    std::string key = std::to_string(shape.M) + " " + std::to_string(shape.N) + " " + std::to_string(shape.K) + " " +
+                      shape.layout();
+    return shape.type == MatrixType::Float ? key : key + " " + shape.typeName();
+}
+
+bool load_tuned(const std::string& device, const MatrixShape& shape, MatrixConfig& config) {
+    FILE* f = fopen(TUNING_FILE, "r");
+    if (f == nullptr) {
+        return false;
+    }
+    bool found = false;
+    char line[512];
+    std::string key = shape_key(shape);
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        std::string entry(line);
+        size_t first = entry.find('\t');
+        size_t second = entry.find('\t', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        if (entry.compare(0, first, device) != 0 || entry.compare(first + 1, second - first - 1, key) != 0) continue;
+        MatrixConfig parsed;
+        if (sscanf(entry.c_str() + second + 1, "%d %d %d %d %d %d", &parsed.tileM, &parsed.tileN, &parsed.tileK,
+                   &parsed.wptM, &parsed.wptN, &parsed.vw) == 6) {
+            // later lines win, so a retune simply appends
+            config = parsed;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+void store_tuned(const std::string& device, const MatrixShape& shape, const MatrixConfig& config, double gflops) {
+    FILE* f = fopen(TUNING_FILE, "a");
+    if (f == nullptr) {
+        return;
+    }
+    fprintf(f, "%s\t%s\t%d %d %d %d %d %d\t%f\n", device.c_str(), shape_key(shape).c_str(), config.tileM,
+            config.tileN, config.tileK, config.wptM, config.wptN, config.vw, gflops);
+    fclose(f);
+}
+
+std::string kernel_options(const MatrixConfig& config, const MatrixShape& shape) {
+    return config.options() + " -D TRANS_A=" + (shape.transA ? "1" : "0") +
+           " -D TRANS_B=" + (shape.transB ? "1" : "0") + " -D INPUT=" + std::to_string(static_cast<int>(shape.type));
+}
+
+// int8 kernels take the scale after their other arguments.
+void set_scale_arg(cl_kernel kernel, const MatrixShape& shape, cl_uint index) {
+    if (shape.type == MatrixType::Int8) {
+        clSetKernelArg(kernel, index, sizeof(cl_float), &shape.scale);
+    }
+}
+
+// The enabled parts of the epilogue follow the scale in the order of MatrixEpilogue.
+void set_epilogue_args(cl_kernel kernel, const MatrixShape& shape, const MatrixEpilogue& epilogue, cl_uint index) {
+    if (shape.type == MatrixType::Int8) {
+        ++index;
+    }
+    if (epilogue.alpha != 1.0f) {
+        clSetKernelArg(kernel, index++, sizeof(cl_float), &epilogue.alpha);
+    }
+    if (epilogue.beta != 0.0f) {
+        clSetKernelArg(kernel, index++, sizeof(cl_float), &epilogue.beta);
+    }
+    if (epilogue.rowBias != nullptr) {
+        clSetKernelArg(kernel, index++, sizeof(cl_mem), &epilogue.rowBias);
+    }
+    if (epilogue.colBias != nullptr) {
+        clSetKernelArg(kernel, index++, sizeof(cl_mem), &epilogue.colBias);
+    }
+}
+
+// Arguments 0..8 shared by all matrix_mul kernels. The sizes and strides are int arguments,
+// CL_INVALID_VALUE if one of them doesn't fit.
+cl_int set_matrix_args(cl_kernel kernel, const MatrixShape& shape, cl_mem first, cl_mem second, cl_mem result) {
+    size_t sizes[6] = { shape.M, shape.N, shape.K, shape.strideA(), shape.strideB(), shape.strideC() };
+    cl_int args[6];
+    for (int i = 0; i < 6; ++i) {
+        if (sizes[i] > INT_MAX) {
+            return CL_INVALID_VALUE;
+        }
+        args[i] = static_cast<cl_int>(sizes[i]);
+    }
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &first);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &second);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), &result);
+    for (cl_uint i = 0; i < 6; ++i) {
+        clSetKernelArg(kernel, 3 + i, sizeof(cl_int), &args[i]);
+    }
+    return CL_SUCCESS;
+}
+
+// Stands in for a multiplication with nothing to compute: a marker after waitList if an event is wanted.
+cl_int enqueue_empty(cl_command_queue queue, const char* name, cl_uint waitCount, const cl_event* waitList,
+                     cl_event* event) {
+    if (event == nullptr) {
+        return CL_SUCCESS;
+    }
+    TracedEvent traced(event, TraceKind::Marker, name);
+    return traced.done(clEnqueueMarkerWithWaitList(queue, waitCount, waitList, traced.out()));
+}
+
+// The range of one multiplication, the batch is the third dimension.
+// The traced bytes are the ones every multiplication has to read and write at least.
+cl_int enqueue_matrix_kernel(cl_command_queue queue, cl_kernel kernel, const char* name, const MatrixConfig& config,
+                             const MatrixShape& shape, size_t batch,
+                             cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    if (shape.M == 0 || shape.N == 0) {
+        return enqueue_empty(queue, name, waitCount, waitList, event);
+    }
+    double count = static_cast<double>(std::max<size_t>(batch, 1));
+    double bytes = static_cast<double>(shape.M * shape.K + shape.K * shape.N) * shape.elementSize() +
+                   static_cast<double>(shape.M * shape.N) * sizeof(float);
+    TracedEvent traced(event, TraceKind::Kernel, name, bytes * count, shape.flops() * count);
+    constexpr size_t workDims = 3;
+    size_t localWorkSize[workDims]  = { static_cast<size_t>(config.tileN / config.wptN),
+                                        static_cast<size_t>(config.tileM / config.wptM), 1 };
+    size_t globalWorkSize[workDims] = { (shape.N + config.tileN - 1) / config.tileN * localWorkSize[0],
+                                        (shape.M + config.tileM - 1) / config.tileM * localWorkSize[1], batch };
+    return traced.done(clEnqueueNDRangeKernel(queue, kernel, batch == 0 ? 2 : workDims, nullptr, globalWorkSize,
+                                              localWorkSize, waitCount, waitList, traced.out()));
+}
+
+bool config_fits(cl_device_id device, const MatrixConfig& config) {
+    size_t maxGroup = 0;
+    cl_ulong localMemory = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, nullptr);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemory), &localMemory, nullptr);
+    return config.threads() <= maxGroup && config.localMemory() <= localMemory;
+}
+
+}
+
+std::string MatrixConfig::options() const {
+    return "-D TILE_M=" + std::to_string(tileM) + " -D TILE_N=" + std::to_string(tileN) +
+           " -D TILE_K=" + std::to_string(tileK) + " -D WPT_M=" + std::to_string(wptM) +
+           " -D WPT_N=" + std::to_string(wptN) + " -D VW=" + std::to_string(vw);
+}
+
+std::string MatrixEpilogue::options() const {
+    std::string res;
+    if (alpha != 1.0f) {
+        res += " -D ALPHA=1";
+    }
+    if (beta != 0.0f) {
+        res += " -D BETA=1";
+    }
+    if (rowBias != nullptr) {
+        res += " -D ROW_BIAS=1";
+    }
+    if (colBias != nullptr) {
+        res += " -D COL_BIAS=1";
+    }
+    if (activation != Activation::None) {
+        res += " -D ACTIVATION=" + std::to_string(static_cast<int>(activation));
+    }
+    return res;
+}
+
+std::string MatrixShape::layout() const {
+    return std::string(transA ? "T" : "N") + (transB ? "T" : "N");
+}
+
+size_t MatrixShape::elementSize() const {
+    switch (type) {
+        case MatrixType::Half:
+        case MatrixType::Bf16: return sizeof(cl_ushort);
+        case MatrixType::Int8: return sizeof(cl_char);
+        default:               return sizeof(cl_float);
+    }
+}
+
+std::string MatrixShape::typeName() const {
+    return TYPE_NAMES[static_cast<int>(type)];
+}
+
+cl_int matrix_mul(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config, const MatrixShape& shape,
+                  cl_mem first, cl_mem second, cl_mem result,
+                  cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    return matrix_mul(runtime, queue, config, shape, MatrixEpilogue(), first, second, result,
+                      waitCount, waitList, event);
+}
+
+cl_int matrix_mul(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config, const MatrixShape& shape,
+                  const MatrixEpilogue& epilogue, cl_mem first, cl_mem second, cl_mem result,
+                  cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    cl_kernel kernel = runtime.kernel("function_matrix.cl", kernel_options(config, shape) + epilogue.options(),
+                                      "matrix_mul");
+    if (kernel == nullptr) {
+        return CL_INVALID_KERNEL;
+    }
+    cl_int res = set_matrix_args(kernel, shape, first, second, result);
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+    set_scale_arg(kernel, shape, 9);
+    set_epilogue_args(kernel, shape, epilogue, 9);
+    return enqueue_matrix_kernel(queue, kernel, "matrix_mul", config, shape, 0, waitCount, waitList, event);
+}
+
+DeviceFuture gemm_async(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config,
+                        const MatrixShape& shape, cl_mem first, cl_mem second, cl_mem result,
+                        const std::vector<DeviceFuture>& after, const MatrixEpilogue& epilogue) {
+    cl_int res = first_error(after);
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    std::vector<cl_event> waitList = wait_list(after);
+    Event event;
+    res = matrix_mul(runtime, queue, config, shape, epilogue, first, second, result,
+                     static_cast<cl_uint>(waitList.size()), waitList.empty() ? nullptr : waitList.data(), event.out());
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    return DeviceFuture(std::move(event), {}, after);
+}
+
+cl_int matrix_mul_batched(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config,
+                          const MatrixShape& shape, size_t batch,
+                          cl_mem first, size_t strideFirst, cl_mem second, size_t strideSecond,
+                          cl_mem result, size_t strideResult,
+                          cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    if (batch == 0) {
+        return enqueue_empty(queue, "matrix_mul_batched", waitCount, waitList, event);
+    }
+    cl_kernel kernel = runtime.kernel("function_matrix.cl", kernel_options(config, shape), "matrix_mul_batched");
+    if (kernel == nullptr) {
+        return CL_INVALID_KERNEL;
+    }
+    cl_int res = set_matrix_args(kernel, shape, first, second, result);
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+    cl_ulong strides[3] = { strideFirst, strideSecond, strideResult };
+    for (cl_uint i = 0; i < 3; ++i) {
+        clSetKernelArg(kernel, 9 + i, sizeof(cl_ulong), &strides[i]);
+    }
+    set_scale_arg(kernel, shape, 12);
+    return enqueue_matrix_kernel(queue, kernel, "matrix_mul_batched", config, shape, batch, waitCount, waitList, event);
+}
+
+cl_int matrix_mul_batched_offsets(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config,
+                                  const MatrixShape& shape, size_t batch,
+                                  cl_mem first, cl_mem second, cl_mem result, cl_mem offsets,
+                                  cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    if (batch == 0) {
+        return enqueue_empty(queue, "matrix_mul_batched_offsets", waitCount, waitList, event);
+    }
+    cl_kernel kernel = runtime.kernel("function_matrix.cl", kernel_options(config, shape),
+                                      "matrix_mul_batched_offsets");
+    if (kernel == nullptr) {
+        return CL_INVALID_KERNEL;
+    }
+    cl_int res = set_matrix_args(kernel, shape, first, second, result);
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+    clSetKernelArg(kernel, 9, sizeof(cl_mem), &offsets);
+    set_scale_arg(kernel, shape, 10);
+    return enqueue_matrix_kernel(queue, kernel, "matrix_mul_batched_offsets", config, shape, batch,
+                                 waitCount, waitList, event);
+}
+
+double time_matrix_mul(Runtime& runtime, const MatrixConfig& config, const MatrixShape& shape,
+                       cl_mem first, cl_mem second, cl_mem result, int repeats) {
+    double best = -1.0;
+    for (int i = 0; i < repeats; ++i) {
+        Event event;
+        if (matrix_mul(runtime, runtime.queue(), config, shape, first, second, result, 0, nullptr,
+                       event.out()) != CL_SUCCESS) {
+            return -1.0;
+        }
+        clWaitForEvents(1, event.address());
+        double time = event_time(event.get());
+        if (best < 0 || time < best) best = time;
+    }
+    return best;
+}
+
+std::vector<MatrixConfig> candidate_configs(cl_device_id device) {
+
+    const int tiles[] = { 32, 64, 128 };
+    const int tilesK[] = { 16, 32 };
+    const int wpts[][2] = { { 2, 2 }, { 4, 4 }, { 4, 8 }, { 8, 4 }, { 8, 8 } };
+    const int vws[] = { 4, 8 };
+
+    std::vector<MatrixConfig> res;
+    for (int tileM : tiles) {
+        for (int tileN : tiles) {
+            if (tileM > 2 * tileN || tileN > 2 * tileM) continue;
+            for (int tileK : tilesK) {
+                for (const auto& wpt : wpts) {
+                    for (int vw : vws) {
+                        MatrixConfig config;
+                        config.tileM = tileM;
+                        config.tileN = tileN;
+                        config.tileK = tileK;
+                        config.wptM = wpt[0];
+                        config.wptN = wpt[1];
+                        config.vw = vw;
+                        if (config.threads() < 16 || !config_fits(device, config)) continue;
+                        res.push_back(config);
+                    }
+                }
+            }
+        }
+    }
+    return res;
+}
+
+MatrixConfig tuned_config(Runtime& runtime, const MatrixShape& shape, size_t device) {
+    MatrixConfig config;
+    load_tuned(runtime.info(device).name, shape, config);
+    return config;
+}
+
+MatrixConfig batched_config(Runtime& runtime, const MatrixShape& shape, size_t device) {
+    // one work-group per matrix with 64 work-items, so the whole batch fills the device
+    size_t size = std::max(shape.M, shape.N);
+    MatrixConfig config;
+    if (size <= 32) {
+        config.tileM = config.tileN = size <= 16 ? 16 : 32;
+        config.tileK = 16;
+        config.wptM = config.wptN = size <= 16 ? 2 : 4;
+        if (config_fits(runtime.device(device), config)) {
+            return config;
+        }
+    }
+    return tuned_config(runtime, shape, device);
+}
+
+MatrixConfig autotune(Runtime& runtime, const MatrixShape& shape, cl_mem first, cl_mem second, cl_mem result,
+                      bool retune) {
+    std::string device = device_info(runtime.device()).name;
+    MatrixConfig best;
+    if (!retune && load_tuned(device, shape, best)) {
+        printf("Tuned config: %s\n", best.options().c_str());
+        return best;
+    }
+    double bestTime = -1.0;
+    for (const MatrixConfig& config : candidate_configs(runtime.device())) {
+        double time = time_matrix_mul(runtime, config, shape, first, second, result, 2);
+        if (time <= 0) continue;
+        printf("%s: %f GFLOPS\n", config.options().c_str(), shape.flops() / time);
+        if (bestTime < 0 || time < bestTime) {
+            bestTime = time;
+            best = config;
+        }
+    }
+    if (bestTime > 0) {
+        printf("Best config: %s\n", best.options().c_str());
+        store_tuned(device, shape, best, shape.flops() / bestTime);
+    }
+    return best;
+}
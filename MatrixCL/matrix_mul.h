@@ -0,0 +1,124 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../Runtime/runtime.h"
+
+// Compile-time parameters of the matrix_mul kernel.
+struct MatrixConfig {
+    int tileM { 64 };
+    int tileN { 64 };
+    int tileK { 16 };
+    int wptM  { 4 };
+    int wptN  { 4 };
+    int vw    { 4 };
+
+    std::string options() const;
+    size_t threads() const { return static_cast<size_t>(tileM / wptM) * (tileN / wptN); }
+    size_t localMemory() const { return static_cast<size_t>(tileK) * (tileM + tileN) * sizeof(float); }
+};
+
+// Element type of first and second. Half and bf16 are 16-bit floats (bf16 is the upper half of a float)
+// multiplied in float, int8 is multiplied in int32. The result is always float.
+enum class MatrixType { Float, Half, Bf16, Int8 };
+
+// result (M x N) = op(first) * op(second), all row-major.
+// With transA first is stored K x M, with transB second is stored N x K.
+// Zero strides mean tightly packed rows, strides are in elements of the type.
+struct MatrixShape {
+    size_t M      { 0 };
+    size_t N      { 0 };
+    size_t K      { 0 };
+    bool   transA { false };
+    bool   transB { false };
+    size_t lda    { 0 };
+    size_t ldb    { 0 };
+    size_t ldc    { 0 };
+    MatrixType type { MatrixType::Float };
+    // int8 only: result = scale * op(first) * op(second), the product of the per-tensor scales
+    float  scale  { 1.0f };
+
+    size_t firstRows() const  { return transA ? K : M; }
+    size_t secondRows() const { return transB ? N : K; }
+    size_t strideA() const { return lda != 0 ? lda : (transA ? M : K); }
+    size_t strideB() const { return ldb != 0 ? ldb : (transB ? K : N); }
+    size_t strideC() const { return ldc != 0 ? ldc : N; }
+    // NN, NT, TN or TT
+    std::string layout() const;
+    double flops() const { return 2.0 * M * N * K; }
+    // bytes of one element of first and second
+    size_t elementSize() const;
+    // float, half, bf16 or int8
+    std::string typeName() const;
+};
+
+// Activation applied to every element of the result.
+enum class Activation { None, Relu, Gelu, Sigmoid };
+
+// Work done on the product before it is stored:
+// result = activation(alpha * product + beta * result + rowBias[row] + colBias[col]).
+// rowBias holds M floats, colBias N floats, nullptr leaves them out. Only the enabled parts are compiled
+// into the kernel, the default epilogue stores the bare product and doesn't read result.
+struct MatrixEpilogue {
+    float      alpha      { 1.0f };
+    float      beta       { 0.0f };
+    cl_mem     rowBias    { nullptr };
+    cl_mem     colBias    { nullptr };
+    Activation activation { Activation::None };
+
+    std::string options() const;
+};
+
+// Enqueues the multiplication on queue. event may be nullptr. An empty result (or batch) enqueues
+// only a marker after waitList, when event is given. CL_INVALID_VALUE if a size or stride exceeds INT_MAX.
+cl_int matrix_mul(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config, const MatrixShape& shape,
+                  cl_mem first, cl_mem second, cl_mem result,
+                  cl_uint waitCount = 0, const cl_event* waitList = nullptr, cl_event* event = nullptr);
+
+// The same with the epilogue fused into the kernel.
+cl_int matrix_mul(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config, const MatrixShape& shape,
+                  const MatrixEpilogue& epilogue, cl_mem first, cl_mem second, cl_mem result,
+                  cl_uint waitCount = 0, const cl_event* waitList = nullptr, cl_event* event = nullptr);
+
+// matrix_mul without blocking: it starts after the futures in after, the returned future completes with it.
+// Use Runtime::async_queue to overlap independent multiplications. A failed dependency fails the
+// multiplication without enqueueing it.
+DeviceFuture gemm_async(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config,
+                        const MatrixShape& shape, cl_mem first, cl_mem second, cl_mem result,
+                        const std::vector<DeviceFuture>& after = {},
+                        const MatrixEpilogue& epilogue = MatrixEpilogue());
+
+// batch multiplications of the shape in one launch. Matrix b of the batch starts at b * strideFirst,
+// b * strideSecond and b * strideResult elements of the buffers; a zero stride of first or second
+// shares that matrix between all multiplications.
+cl_int matrix_mul_batched(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config,
+                          const MatrixShape& shape, size_t batch,
+                          cl_mem first, size_t strideFirst, cl_mem second, size_t strideSecond,
+                          cl_mem result, size_t strideResult,
+                          cl_uint waitCount = 0, const cl_event* waitList = nullptr, cl_event* event = nullptr);
+
+// The same with the matrices anywhere in the buffers. offsets holds 3 * batch cl_ulong values,
+// the element offsets of A, B and C of every multiplication.
+cl_int matrix_mul_batched_offsets(Runtime& runtime, cl_command_queue queue, const MatrixConfig& config,
+                                  const MatrixShape& shape, size_t batch,
+                                  cl_mem first, cl_mem second, cl_mem result, cl_mem offsets,
+                                  cl_uint waitCount = 0, const cl_event* waitList = nullptr,
+                                  cl_event* event = nullptr);
+
+// Minimal kernel time in nanoseconds over repeats launches, or a negative value on failure.
+double time_matrix_mul(Runtime& runtime, const MatrixConfig& config, const MatrixShape& shape,
+                       cl_mem first, cl_mem second, cl_mem result, int repeats);
+
+// Configurations that fit the work-group and local memory limits of the device.
+std::vector<MatrixConfig> candidate_configs(cl_device_id device);
+
+// Configuration stored in matrix_tuning.txt for runtime.device(device) and the shape, the default one otherwise.
+MatrixConfig tuned_config(Runtime& runtime, const MatrixShape& shape, size_t device = 0);
+
+// Configuration for batches of the shape: small tiles for matrices up to 32 x 32,
+// the tuned configuration otherwise.
+MatrixConfig batched_config(Runtime& runtime, const MatrixShape& shape, size_t device = 0);
+
+// Best configuration for the device and shape. It is looked up in matrix_tuning.txt,
+// and found by timing every candidate on the given buffers when missing or when retune is set.
+MatrixConfig autotune(Runtime& runtime, const MatrixShape& shape, cl_mem first, cl_mem second, cl_mem result,
+                      bool retune);
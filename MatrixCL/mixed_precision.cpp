@@ -0,0 +1,51 @@
+#include "mixed_precision.h"
+#include <chrono>
+#include <cstdio>
+#include "gemm.h"
+
+namespace {
+
+double multiply_half_on_cpu(const MatrixShape& shape, const void* first, const void* second, float* result) {
+    if (shape.transA || shape.transB) {
+        printf("The CPU path multiplies NN matrices only.\n");
+        return -1.0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    gemm(shape.M, shape.N, shape.K, static_cast<const Half*>(first), shape.strideA(),
+         static_cast<const Half*>(second), shape.strideB(), result, shape.strideC());
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+double matrix_mul_host(Runtime& runtime, const MatrixShape& shape, const void* first, const void* second,
+                       float* result, bool& onCpu, bool halfOnCpu) {
+    onCpu = halfOnCpu && shape.type == MatrixType::Half && !runtime.info().fp16;
+    if (onCpu) {
+        return multiply_half_on_cpu(shape, first, second, result);
+    }
+
+    cl_command_queue queue = runtime.queue();
+    HostBuffer firstBuffer(runtime, const_cast<void*>(first),
+                           shape.firstRows() * shape.strideA() * shape.elementSize(), CL_MEM_READ_ONLY);
+    HostBuffer secondBuffer(runtime, const_cast<void*>(second),
+                            shape.secondRows() * shape.strideB() * shape.elementSize(), CL_MEM_READ_ONLY);
+    HostBuffer resultBuffer(runtime, result, shape.M * shape.strideC() * sizeof(float), CL_MEM_READ_WRITE);
+    if (!firstBuffer.get() || !secondBuffer.get() || !resultBuffer.get()) {
+        return -1.0;
+    }
+    Event event;
+    cl_int res = firstBuffer.upload(queue);
+    if (res == CL_SUCCESS) res = secondBuffer.upload(queue);
+    if (res == CL_SUCCESS) res = resultBuffer.upload(queue);
+    if (res == CL_SUCCESS) {
+        res = matrix_mul(runtime, queue, tuned_config(runtime, shape), shape, firstBuffer.get(), secondBuffer.get(),
+                         resultBuffer.get(), 0, nullptr, event.out());
+    }
+    if (res == CL_SUCCESS) res = resultBuffer.download(queue);
+    if (res != CL_SUCCESS) {
+        printf("Can't run %s matrix_mul. Error: %d\n", shape.typeName().c_str(), res);
+        return -1.0;
+    }
+    return event_time(event.get()) / 1e9;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "matrix_mul.h"
+
+// Multiplies host matrices stored as shape.type: float, Half, Bf16 or int8_t arrays (see OpenMP/gemm.h),
+// the result is float. Every type runs on the device: half and bf16 are widened to float by the kernel,
+// which needs no cl_khr_fp16 (vload_half is core OpenCL 1.2). With halfOnCpu, half is multiplied by the
+// OpenMP engine instead on devices without cl_khr_fp16, for when that is faster there; onCpu tells which
+// path was taken.
+// Returns the multiplication time in seconds (the kernel time on the device), or a negative value on failure.
+double matrix_mul_host(Runtime& runtime, const MatrixShape& shape, const void* first, const void* second,
+                       float* result, bool& onCpu, bool halfOnCpu = false);
@@ -0,0 +1,281 @@
+#include "multi_device.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include "../Runtime/numa.h"
+#include "../Runtime/trace.h"
+
+namespace {
+
+// chunks in flight per device, so a device doesn't idle while the host hands out the next one
+constexpr size_t SLOTS = 2;
+
+struct Slot {
+    // pooled copies of the panels, or buffers over the host rows for zero-copy devices
+    PooledBuffer first;
+    PooledBuffer result;
+    Mem firstHost;
+    Mem resultHost;
+    // last command of the panel, the slot is free once it completes
+    Event done;
+    bool busy { false };
+};
+
+struct DeviceState {
+    cl_command_queue queue { nullptr };
+    bool zeroCopy { false };
+    MatrixConfig config;
+    PooledBuffer second;
+    Mem secondHost;
+    Slot slots[SLOTS];
+    // panels owned by the device, taken from the front; other devices steal from the back
+    std::deque<WorkRange> pending;
+    std::vector<Event> events;
+    size_t rows { 0 };
+
+    cl_mem secondBuffer() const { return zeroCopy ? secondHost.get() : second.get(); }
+};
+
+// CL_COMPLETE or an error status
+bool finished(const Event& event, bool& failed) {
+    cl_int status = CL_COMPLETE;
+    clGetEventInfo(event.get(), CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    failed = failed || status < 0;
+    return status <= CL_COMPLETE;
+}
+
+// Next panel for device d: its own one, or one stolen from the device with the most left.
+bool take_panel(std::vector<DeviceState>& states, size_t d, bool steal, WorkRange& range) {
+    if (!states[d].pending.empty()) {
+        range = states[d].pending.front();
+        states[d].pending.pop_front();
+        return true;
+    }
+    if (!steal) {
+        return false;
+    }
+    size_t victim = d;
+    for (size_t i = 0; i < states.size(); ++i) {
+        if (states[i].pending.size() > states[victim].pending.size()) victim = i;
+    }
+    if (states[victim].pending.empty()) {
+        return false;
+    }
+    range = states[victim].pending.back();
+    states[victim].pending.pop_back();
+    return true;
+}
+
+cl_int upload_second(Runtime& runtime, DeviceState& state, const MatrixShape& shape, const float* second) {
+    size_t secondBytes = shape.secondRows() * shape.strideB() * sizeof(float);
+    if (state.zeroCopy) {
+        cl_int res;
+        state.secondHost.reset(clCreateBuffer(runtime.context().get(), CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+                                              secondBytes, const_cast<float*>(second), &res));
+        return res;
+    }
+    state.second = runtime.buffers().acquire(secondBytes, CL_MEM_READ_ONLY);
+    if (!state.second) {
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    state.events.emplace_back();
+    TracedEvent traced(state.events.back().out(), TraceKind::Write, "second", static_cast<double>(secondBytes));
+    return traced.done(clEnqueueWriteBuffer(state.queue, state.second.get(), CL_FALSE, 0, secondBytes, second, 0,
+                                            nullptr, traced.out()));
+}
+
+// Multiplies rows [range.begin, range.end) of A in place, the buffers are created over the host rows.
+// On CPU devices that keeps the panel on the NUMA node it was placed on.
+cl_int enqueue_panel_in_place(Runtime& runtime, DeviceState& state, Slot& slot, const MatrixShape& shape,
+                              const float* first, float* result, const WorkRange& range) {
+    size_t count = range.end - range.begin;
+    size_t firstBytes = ((count - 1) * shape.strideA() + shape.K) * sizeof(float);
+    size_t resultBytes = ((count - 1) * shape.strideC() + shape.N) * sizeof(float);
+    float* firstRows = const_cast<float*>(first) + range.begin * shape.strideA();
+    float* resultRows = result + range.begin * shape.strideC();
+    cl_int res;
+    slot.firstHost.reset(clCreateBuffer(runtime.context().get(), CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
+                                        firstBytes, firstRows, &res));
+    if (res != CL_SUCCESS) return res;
+    slot.resultHost.reset(clCreateBuffer(runtime.context().get(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                                         resultBytes, resultRows, &res));
+    if (res != CL_SUCCESS) return res;
+
+    MatrixShape panelShape = shape;
+    panelShape.M = count;
+    panelShape.lda = shape.strideA();
+    panelShape.ldc = shape.strideC();
+    state.events.emplace_back();
+    res = matrix_mul(runtime, state.queue, state.config, panelShape, slot.firstHost.get(), state.secondBuffer(),
+                     slot.resultHost.get(), 0, nullptr, state.events.back().out());
+    if (res != CL_SUCCESS) return res;
+
+    // map and unmap make the result visible in the host rows
+    TracedEvent mapTraced(nullptr, TraceKind::Map, "result panel");
+    void* mapped = clEnqueueMapBuffer(state.queue, slot.resultHost.get(), CL_FALSE, CL_MAP_READ, 0, resultBytes,
+                                      0, nullptr, mapTraced.out(), &res);
+    if (mapTraced.done(res) != CL_SUCCESS) return res;
+    TracedEvent traced(slot.done.out(), TraceKind::Unmap, "result panel");
+    return traced.done(clEnqueueUnmapMemObject(state.queue, slot.resultHost.get(), mapped, 0, nullptr,
+                                               traced.out()));
+}
+
+// Uploads rows [range.begin, range.end) of A, multiplies them and downloads the rows of C.
+cl_int enqueue_panel_copy(Runtime& runtime, DeviceState& state, Slot& slot, const MatrixShape& shape,
+                          const float* first, float* result, const WorkRange& range) {
+    size_t count = range.end - range.begin;
+    BufferPool& pool = runtime.buffers();
+    if (slot.first.size() < count * shape.K * sizeof(float)) {
+        slot.first = pool.acquire(count * shape.K * sizeof(float), CL_MEM_READ_ONLY);
+    }
+    if (slot.result.size() < count * shape.N * sizeof(float)) {
+        slot.result = pool.acquire(count * shape.N * sizeof(float), CL_MEM_READ_WRITE);
+    }
+    if (!slot.first || !slot.result) {
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    // panels are stored tightly on the device
+    MatrixShape panelShape = shape;
+    panelShape.M = count;
+    panelShape.lda = shape.K;
+    panelShape.ldc = shape.N;
+
+    size_t bufferOrigin[3] = { 0, 0, 0 };
+    size_t firstOrigin[3]  = { 0, range.begin, 0 };
+    size_t firstRegion[3]  = { shape.K * sizeof(float), count, 1 };
+    state.events.emplace_back();
+    TracedEvent uploadTraced(state.events.back().out(), TraceKind::Write, "first panel",
+                             static_cast<double>(count * shape.K * sizeof(float)));
+    cl_int res = clEnqueueWriteBufferRect(state.queue, slot.first.get(), CL_FALSE, bufferOrigin, firstOrigin,
+                                          firstRegion, shape.K * sizeof(float), 0, shape.strideA() * sizeof(float),
+                                          0, first, 0, nullptr, uploadTraced.out());
+    if (uploadTraced.done(res) != CL_SUCCESS) return res;
+
+    state.events.emplace_back();
+    res = matrix_mul(runtime, state.queue, state.config, panelShape, slot.first.get(), state.secondBuffer(),
+                     slot.result.get(), 0, nullptr, state.events.back().out());
+    if (res != CL_SUCCESS) return res;
+
+    size_t resultOrigin[3] = { 0, range.begin, 0 };
+    size_t resultRegion[3] = { shape.N * sizeof(float), count, 1 };
+    TracedEvent downloadTraced(slot.done.out(), TraceKind::Read, "result panel",
+                               static_cast<double>(count * shape.N * sizeof(float)));
+    return downloadTraced.done(clEnqueueReadBufferRect(state.queue, slot.result.get(), CL_FALSE, bufferOrigin,
+                                                       resultOrigin, resultRegion, shape.N * sizeof(float), 0,
+                                                       shape.strideC() * sizeof(float), 0, result, 0, nullptr,
+                                                       downloadTraced.out()));
+}
+
+cl_int enqueue_panel(Runtime& runtime, DeviceState& state, Slot& slot, const MatrixShape& shape,
+                     const float* first, float* result, const WorkRange& range) {
+    cl_int res = state.zeroCopy ? enqueue_panel_in_place(runtime, state, slot, shape, first, result, range)
+                                : enqueue_panel_copy(runtime, state, slot, shape, first, result, range);
+    if (res != CL_SUCCESS) return res;
+    state.events.push_back(slot.done);
+    clFlush(state.queue);
+    slot.busy = true;
+    state.rows += range.end - range.begin;
+    return CL_SUCCESS;
+}
+
+}
+
+MultiDeviceStats matrix_mul_multi(Runtime& runtime, WorkSplitter& splitter, const MatrixShape& shape,
+                                  const float* first, const float* second, float* result, SplitMode mode,
+                                  size_t chunkRows) {
+    MultiDeviceStats stats;
+    if (shape.transA) {
+        printf("Multi-device matrix_mul needs A stored row by row (NN or NT layout).\n");
+        return stats;
+    }
+    if (shape.type != MatrixType::Float) {
+        printf("Multi-device matrix_mul works on float matrices.\n");
+        return stats;
+    }
+    size_t devices = runtime.devices().size();
+    stats.rows.assign(devices, 0);
+    stats.deviceSeconds.assign(devices, 0.0);
+    if (shape.M == 0 || shape.N == 0) {
+        stats.ok = true;
+        return stats;
+    }
+
+    // panels go to the device on the NUMA node that holds their rows of A
+    size_t rowBytes = shape.strideA() * sizeof(float);
+    std::vector<DeviceState> states(devices);
+    if (mode == SplitMode::Weighted) {
+        std::vector<WorkRange> ranges = splitter.split(shape.M, 64);
+        numa_match_owners(runtime, first, rowBytes, ranges);
+        for (const WorkRange& range : ranges) {
+            states[range.device].pending.push_back(range);
+        }
+    } else {
+        size_t rows = chunkRows != 0 ? chunkRows : std::max<size_t>(64, shape.M / (8 * devices) / 64 * 64);
+        for (size_t row = 0, chunk = 0; row < shape.M; row += rows, ++chunk) {
+            WorkRange range;
+            range.device = chunk % devices;
+            range.begin = row;
+            range.end = std::min(row + rows, shape.M);
+            int node = numa_node_of(first + row * shape.strideA());
+            for (size_t d = 0; d < devices; ++d) {
+                if (node >= 0 && runtime.info(d).numaNode == node) range.device = d;
+            }
+            states[range.device].pending.push_back(range);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    cl_int res = CL_SUCCESS;
+    for (size_t d = 0; d < devices && res == CL_SUCCESS; ++d) {
+        DeviceState& state = states[d];
+        if (mode == SplitMode::Weighted && state.pending.empty()) continue;
+        state.queue = runtime.queue(d);
+        state.zeroCopy = runtime.zero_copy(d);
+        state.config = tuned_config(runtime, shape, d);
+        res = upload_second(runtime, state, shape, second);
+    }
+
+    bool failed = false;
+    bool steal = mode == SplitMode::Dynamic;
+    while (res == CL_SUCCESS && !failed) {
+        bool running = false;
+        bool issued = false;
+        for (size_t d = 0; d < devices && res == CL_SUCCESS; ++d) {
+            DeviceState& state = states[d];
+            if (state.queue == nullptr) continue;
+            for (Slot& slot : state.slots) {
+                if (slot.busy && !finished(slot.done, failed)) {
+                    running = true;
+                    continue;
+                }
+                slot.busy = false;
+                WorkRange range;
+                if (!take_panel(states, d, steal, range)) continue;
+                res = enqueue_panel(runtime, state, slot, shape, first, result, range);
+                if (res != CL_SUCCESS) break;
+                issued = running = true;
+            }
+        }
+        if (!running) break;
+        if (!issued) std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    for (DeviceState& state : states) {
+        if (state.queue != nullptr) clFinish(state.queue);
+    }
+    if (res != CL_SUCCESS || failed) {
+        printf("Multi-device matrix_mul failed. Error: %d\n", res);
+        return stats;
+    }
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (size_t d = 0; d < devices; ++d) {
+        stats.rows[d] = states[d].rows;
+        stats.deviceSeconds[d] = events_span(states[d].events) / 1e9;
+        splitter.record(d, 2.0 * states[d].rows * shape.N * shape.K, stats.deviceSeconds[d]);
+    }
+    stats.ok = true;
+    return stats;
+}
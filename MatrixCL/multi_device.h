@@ -0,0 +1,30 @@
+#pragma once
+#include <vector>
+#include "matrix_mul.h"
+#include "../Runtime/work_split.h"
+
+enum class SplitMode {
+    // every device gets one panel of C sized by its throughput in the WorkSplitter
+    Weighted,
+    // C is cut into chunks dealt to the devices, a device that runs out steals from the one with most left
+    Dynamic,
+};
+
+struct MultiDeviceStats {
+    bool ok         { false };
+    double seconds  { 0.0 };
+    // rows of C computed by every device and the time from its first to its last command
+    std::vector<size_t> rows;
+    std::vector<double> deviceSeconds;
+};
+
+// Multiplies host matrices on all devices of the runtime, with one in-order queue per device.
+// Every device keeps its own copy of op(B) and computes row panels of C, A must not be transposed.
+// Devices with host memory (see Runtime::zero_copy) work on the host rows in place, and a panel goes
+// to the NUMA sub-device on the node that holds its rows of A when there is one (see numa_place).
+// chunkRows is the panel height of the Dynamic mode (0 picks about eight chunks per device).
+// The measured throughput of every device is recorded into splitter, so repeated Weighted runs
+// converge to a balanced split.
+MultiDeviceStats matrix_mul_multi(Runtime& runtime, WorkSplitter& splitter, const MatrixShape& shape,
+                                  const float* first, const float* second, float* result, SplitMode mode,
+                                  size_t chunkRows = 0);
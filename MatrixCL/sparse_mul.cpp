@@ -0,0 +1,256 @@
+#include "sparse_mul.h"
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include "mixed_precision.h"
+#include "trace.h"
+
+namespace {
+
+// columns of result per work-group
+constexpr size_t LOCAL_N = 16;
+// nonzeros (plus one per row) per work-group of the CSR kernel
+constexpr size_t CSR_PART = 256;
+
+template <typename T>
+cl_int upload_array(Runtime& runtime, cl_command_queue queue, const std::vector<T>& data, const char* name,
+                    PooledBuffer& buffer) {
+    size_t bytes = data.size() * sizeof(T);
+    // empty matrices still get a buffer to pass to the kernel
+    buffer = runtime.buffers().acquire(std::max(bytes, sizeof(T)), CL_MEM_READ_ONLY);
+    if (!buffer) {
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+    if (bytes == 0) {
+        return CL_SUCCESS;
+    }
+    TracedEvent traced(nullptr, TraceKind::Write, name, static_cast<double>(bytes));
+    return traced.done(clEnqueueWriteBuffer(queue, buffer.get(), CL_TRUE, 0, bytes, data.data(), 0, nullptr,
+                                            traced.out()));
+}
+
+// The crossover is measured like spmmMaxDensity: matrix_mul once and sparse_mul at the two densities
+// on CALIBRATION_SIZE square matrices, the best kernel time of CALIBRATION_REPEATS runs each.
+constexpr size_t CALIBRATION_SIZE = 1024;
+constexpr double CALIBRATION_LOW = 0.01;
+constexpr double CALIBRATION_HIGH = 0.1;
+constexpr int CALIBRATION_REPEATS = 3;
+
+double time_sparse_mul(Runtime& runtime, const CsrMatrix& csr, cl_mem second, cl_mem result) {
+    cl_command_queue queue = runtime.queue();
+    SparseBuffers A;
+    if (upload_sparse(runtime, queue, csr, choose_sparse_format(runtime, csr), A) != CL_SUCCESS) {
+        return -1.0;
+    }
+    double best = -1.0;
+    for (int i = 0; i < CALIBRATION_REPEATS; ++i) {
+        Event event;
+        if (sparse_mul(runtime, queue, A, csr.cols, second, csr.cols, result, csr.cols, 0, nullptr,
+                       event.out()) != CL_SUCCESS) {
+            clFinish(queue);
+            return -1.0;
+        }
+        clWaitForEvents(1, event.address());
+        double time = event_time(event.get());
+        if (best < 0 || time < best) best = time;
+    }
+    return best;
+}
+
+// 0 (never sparse) if anything fails, the dense path always works.
+double calibrate_max_density(Runtime& runtime) {
+    size_t n = CALIBRATION_SIZE;
+    MatrixShape shape;
+    shape.M = shape.N = shape.K = n;
+    std::vector<float> host(n * n);
+    std::minstd_rand random(12345);
+    std::uniform_real_distribution<float> values(-1.0f, 1.0f);
+    std::uniform_real_distribution<double> positions(0.0, 1.0);
+    for (float& value : host) {
+        value = values(random);
+    }
+    cl_command_queue queue = runtime.queue();
+    PooledBuffer first = runtime.buffers().acquire(n * n * sizeof(float), CL_MEM_READ_ONLY);
+    PooledBuffer second = runtime.buffers().acquire(n * n * sizeof(float), CL_MEM_READ_ONLY);
+    PooledBuffer result = runtime.buffers().acquire(n * n * sizeof(float));
+    if (!first || !second || !result ||
+        clEnqueueWriteBuffer(queue, first.get(), CL_TRUE, 0, n * n * sizeof(float), host.data(), 0, nullptr,
+                             nullptr) != CL_SUCCESS ||
+        clEnqueueWriteBuffer(queue, second.get(), CL_TRUE, 0, n * n * sizeof(float), host.data(), 0, nullptr,
+                             nullptr) != CL_SUCCESS) {
+        return 0.0;
+    }
+    double dense = time_matrix_mul(runtime, tuned_config(runtime, shape), shape, first.get(), second.get(),
+                                   result.get(), CALIBRATION_REPEATS);
+
+    double times[2];
+    const double densities[2] = { CALIBRATION_LOW, CALIBRATION_HIGH };
+    for (int d = 0; d < 2; ++d) {
+        for (float& value : host) {
+            value = positions(random) < densities[d] ? values(random) : 0.0f;
+        }
+        times[d] = time_sparse_mul(runtime, denseToCsr(n, n, host.data(), n), second.get(), result.get());
+    }
+    if (dense < 0 || times[0] < 0 || times[1] < 0) {
+        return 0.0;
+    }
+    double slope = (times[1] - times[0]) / (CALIBRATION_HIGH - CALIBRATION_LOW);
+    if (slope <= 0) {
+        return times[1] < dense ? CALIBRATION_HIGH : 0.0;
+    }
+    double crossover = CALIBRATION_LOW + (dense - times[0]) / slope;
+    return std::min(1.0, std::max(0.0, crossover));
+}
+
+}
+
+double sparse_max_density(Runtime& runtime) {
+    static const double density = calibrate_max_density(runtime);
+    return density;
+}
+
+SlicedEllMatrix csr_to_sliced_ell(const CsrMatrix& A, size_t sliceHeight) {
+    SlicedEllMatrix res;
+    res.rows = A.rows;
+    res.cols = A.cols;
+    res.sliceHeight = sliceHeight;
+    size_t slices = (A.rows + sliceHeight - 1) / sliceHeight;
+    res.sliceStart.resize(slices + 1);
+    res.sliceStart[0] = 0;
+    for (size_t s = 0; s < slices; ++s) {
+        size_t width = 0;
+        for (size_t i = s * sliceHeight; i < std::min(A.rows, (s + 1) * sliceHeight); ++i) {
+            width = std::max<size_t>(width, A.rowStart[i + 1] - A.rowStart[i]);
+        }
+        res.sliceStart[s + 1] = static_cast<uint32_t>(res.sliceStart[s] + width * sliceHeight);
+    }
+    res.columns.assign(res.sliceStart[slices], 0);
+    res.values.assign(res.sliceStart[slices], 0.0f);
+    for (size_t i = 0; i < A.rows; ++i) {
+        size_t base = res.sliceStart[i / sliceHeight] + i % sliceHeight;
+        for (uint32_t p = A.rowStart[i]; p < A.rowStart[i + 1]; ++p) {
+            size_t pos = base + (p - A.rowStart[i]) * sliceHeight;
+            res.columns[pos] = A.columns[p];
+            res.values[pos] = A.values[p];
+        }
+    }
+    return res;
+}
+
+SparseFormat choose_sparse_format(Runtime& runtime, const CsrMatrix& A, size_t device) {
+    if ((runtime.info(device).type & CL_DEVICE_TYPE_GPU) == 0) {
+        return SparseFormat::Csr;
+    }
+    size_t stored = 0;
+    for (size_t first = 0; first < A.rows; first += ELL_SLICE) {
+        size_t width = 0;
+        for (size_t i = first; i < std::min(A.rows, first + ELL_SLICE); ++i) {
+            width = std::max<size_t>(width, A.rowStart[i + 1] - A.rowStart[i]);
+        }
+        stored += width * ELL_SLICE;
+    }
+    return 2 * stored <= 3 * A.nonZeros() ? SparseFormat::SlicedEll : SparseFormat::Csr;
+}
+
+cl_int upload_sparse(Runtime& runtime, cl_command_queue queue, const CsrMatrix& A, SparseFormat format,
+                     SparseBuffers& buffers) {
+    buffers.format = format;
+    buffers.rows = A.rows;
+    buffers.cols = A.cols;
+    buffers.nonZeros = A.nonZeros();
+    if (format == SparseFormat::Csr) {
+        cl_int res = upload_array(runtime, queue, A.rowStart, "csr row start", buffers.offsets);
+        if (res == CL_SUCCESS) res = upload_array(runtime, queue, A.columns, "csr columns", buffers.columns);
+        if (res == CL_SUCCESS) res = upload_array(runtime, queue, A.values, "csr values", buffers.values);
+        return res;
+    }
+    SlicedEllMatrix ell = csr_to_sliced_ell(A, ELL_SLICE);
+    cl_int res = upload_array(runtime, queue, ell.sliceStart, "ell slice start", buffers.offsets);
+    if (res == CL_SUCCESS) res = upload_array(runtime, queue, ell.columns, "ell columns", buffers.columns);
+    if (res == CL_SUCCESS) res = upload_array(runtime, queue, ell.values, "ell values", buffers.values);
+    return res;
+}
+
+cl_int sparse_mul(Runtime& runtime, cl_command_queue queue, const SparseBuffers& A, size_t N,
+                  cl_mem second, size_t ldb, cl_mem result, size_t ldc,
+                  cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    if (A.rows == 0 || N == 0) {
+        // nothing to compute, a marker keeps the event and the wait list
+        if (event == nullptr) {
+            return CL_SUCCESS;
+        }
+        TracedEvent traced(event, TraceKind::Marker, "sparse_mul");
+        return traced.done(clEnqueueMarkerWithWaitList(queue, waitCount, waitList, traced.out()));
+    }
+    bool csr = A.format == SparseFormat::Csr;
+    cl_kernel kernel = csr ? runtime.kernel("function_spmm.cl", "", "spmm_csr")
+                           : runtime.kernel("function_spmm.cl", "-D SLICE=" + std::to_string(ELL_SLICE), "spmm_ell");
+    if (kernel == nullptr) {
+        return CL_INVALID_KERNEL;
+    }
+    cl_mem buffers[5] = { A.offsets.get(), A.columns.get(), A.values.get(), second, result };
+    for (cl_uint i = 0; i < 5; ++i) {
+        clSetKernelArg(kernel, i, sizeof(cl_mem), &buffers[i]);
+    }
+    cl_uint args[4] = { static_cast<cl_uint>(A.rows), static_cast<cl_uint>(N), static_cast<cl_uint>(ldb),
+                        static_cast<cl_uint>(ldc) };
+    for (cl_uint i = 0; i < 4; ++i) {
+        clSetKernelArg(kernel, 5 + i, sizeof(cl_uint), &args[i]);
+    }
+
+    size_t localWorkSize[2] = { LOCAL_N, 1 };
+    size_t globalWorkSize[2] = { (N + LOCAL_N - 1) / LOCAL_N * LOCAL_N, 0 };
+    if (csr) {
+        size_t parts = std::max<size_t>(1, std::min(A.rows, (A.nonZeros + A.rows) / CSR_PART));
+        cl_uint partsArg = static_cast<cl_uint>(parts);
+        clSetKernelArg(kernel, 9, sizeof(cl_uint), &partsArg);
+        globalWorkSize[1] = parts;
+    } else {
+        localWorkSize[1] = ELL_SLICE;
+        globalWorkSize[1] = (A.rows + ELL_SLICE - 1) / ELL_SLICE * ELL_SLICE;
+    }
+    // every nonzero reads a row of second, every row of result is written once
+    double bytes = static_cast<double>(A.nonZeros) * (sizeof(cl_uint) + (N + 1) * sizeof(float)) +
+                   static_cast<double>(A.rows * N) * sizeof(float);
+    TracedEvent traced(event, TraceKind::Kernel, csr ? "spmm_csr" : "spmm_ell", bytes, 2.0 * A.nonZeros * N);
+    return traced.done(clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, globalWorkSize, localWorkSize,
+                                              waitCount, waitList, traced.out()));
+}
+
+double matrix_mul_auto(Runtime& runtime, const MatrixShape& shape, const float* first, const float* second,
+                       float* result, bool& sparse, double maxDensity) {
+    if (maxDensity < 0) {
+        maxDensity = sparse_max_density(runtime);
+    }
+    sparse = shape.type == MatrixType::Float && !shape.transA && !shape.transB &&
+             preferSparse(shape.M, shape.K, countNonZeros(shape.M, shape.K, first, shape.strideA()), maxDensity);
+    if (!sparse) {
+        bool onCpu = false;
+        return matrix_mul_host(runtime, shape, first, second, result, onCpu);
+    }
+
+    cl_command_queue queue = runtime.queue();
+    CsrMatrix csr = denseToCsr(shape.M, shape.K, first, shape.strideA());
+    SparseBuffers A;
+    HostBuffer secondBuffer(runtime, const_cast<float*>(second), shape.K * shape.strideB() * sizeof(float),
+                            CL_MEM_READ_ONLY);
+    HostBuffer resultBuffer(runtime, result, shape.M * shape.strideC() * sizeof(float), CL_MEM_READ_WRITE);
+    if (!secondBuffer.get() || !resultBuffer.get()) {
+        return -1.0;
+    }
+    Event event;
+    cl_int res = upload_sparse(runtime, queue, csr, choose_sparse_format(runtime, csr), A);
+    if (res == CL_SUCCESS) res = secondBuffer.upload(queue);
+    if (res == CL_SUCCESS) res = resultBuffer.upload(queue);
+    if (res == CL_SUCCESS) {
+        res = sparse_mul(runtime, queue, A, shape.N, secondBuffer.get(), shape.strideB(), resultBuffer.get(),
+                         shape.strideC(), 0, nullptr, event.out());
+    }
+    if (res == CL_SUCCESS) res = resultBuffer.download(queue);
+    if (res != CL_SUCCESS) {
+        printf("Can't run sparse_mul. Error: %d\n", res);
+        return -1.0;
+    }
+    return event_time(event.get()) / 1e9;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <vector>
+#include "matrix_mul.h"
+#include "spmm.h"
+
+// Device format of a sparse matrix (function_spmm.cl). CSR suits any matrix; sliced ELL pads the rows
+// of every slice to the longest one, which GPUs run without divergence when the rows are of similar length.
+enum class SparseFormat { Csr, SlicedEll };
+
+// Rows of a sliced ELL slice, one work-group of sparse_mul.
+constexpr size_t ELL_SLICE = 16;
+
+// A in sliced ELL form: entry j of row i of slice s is at sliceStart[s] + j * sliceHeight + i,
+// padding has value 0 and column 0. With sliceHeight >= rows it is plain ELL.
+struct SlicedEllMatrix {
+    size_t rows        { 0 };
+    size_t cols        { 0 };
+    size_t sliceHeight { ELL_SLICE };
+    // rows / sliceHeight + 1 values, sliceStart.back() is the number of stored entries
+    std::vector<uint32_t> sliceStart;
+    std::vector<uint32_t> columns;
+    std::vector<float>    values;
+
+    size_t stored() const { return values.size(); }
+};
+
+SlicedEllMatrix csr_to_sliced_ell(const CsrMatrix& A, size_t sliceHeight = ELL_SLICE);
+
+// Sliced ELL on GPUs when the padding adds at most half of the nonzeros, CSR otherwise.
+SparseFormat choose_sparse_format(Runtime& runtime, const CsrMatrix& A, size_t device = 0);
+
+// A uploaded to the device: offsets is rowStart for CSR and sliceStart for sliced ELL.
+struct SparseBuffers {
+    SparseFormat format   { SparseFormat::Csr };
+    size_t       rows     { 0 };
+    size_t       cols     { 0 };
+    size_t       nonZeros { 0 };
+    PooledBuffer offsets;
+    PooledBuffer columns;
+    PooledBuffer values;
+};
+
+// Copies A to pooled buffers in the format, blocking.
+cl_int upload_sparse(Runtime& runtime, cl_command_queue queue, const CsrMatrix& A, SparseFormat format,
+                     SparseBuffers& buffers);
+
+// Enqueues result (A.rows x N) = A * second, second (A.cols x N) and result are row-major with strides
+// ldb and ldc in floats. event may be nullptr. An empty result enqueues only a marker after waitList,
+// when event is given.
+cl_int sparse_mul(Runtime& runtime, cl_command_queue queue, const SparseBuffers& A, size_t N,
+                  cl_mem second, size_t ldb, cl_mem result, size_t ldc,
+                  cl_uint waitCount = 0, const cl_event* waitList = nullptr, cl_event* event = nullptr);
+
+// Density of A below which sparse_mul is faster than matrix_mul on the default device of runtime.
+// Measured on the first call like spmmMaxDensity, with 1024 x 1024 matrices; 0 if the measurement fails.
+double sparse_max_density(Runtime& runtime);
+
+// result = first * second for host float NN matrices, first may be mostly zeros: first is counted, and
+// multiplied by sparse_mul in the format of choose_sparse_format if preferSparse, by matrix_mul otherwise.
+// A negative maxDensity uses sparse_max_density.
+// sparse tells which path was taken. Returns the kernel time in seconds, or a negative value on failure.
+double matrix_mul_auto(Runtime& runtime, const MatrixShape& shape, const float* first, const float* second,
+                       float* result, bool& sparse, double maxDensity = -1.0);
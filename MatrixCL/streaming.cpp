@@ -0,0 +1,158 @@
+#include "streaming.h"
+#include "../Runtime/trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+namespace {
+
+constexpr size_t BUFFERS = 2;
+
+// Rows per panel so that B plus the double-buffered panels take at most half of the device memory,
+// with at least four panels to keep the pipeline busy.
+size_t choose_panel_rows(Runtime& runtime, const MatrixConfig& config, const MatrixShape& shape) {
+    cl_ulong globalMemory = 0;
+    cl_ulong maxAlloc = 0;
+    clGetDeviceInfo(runtime.device(), CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(globalMemory), &globalMemory, nullptr);
+    clGetDeviceInfo(runtime.device(), CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, nullptr);
+
+    size_t tile = static_cast<size_t>(config.tileM);
+    size_t secondBytes = shape.secondRows() * shape.strideB() * sizeof(float);
+    size_t rowBytes = (shape.K + shape.N) * sizeof(float);
+    size_t budget = globalMemory / 2 > secondBytes ? globalMemory / 2 - secondBytes : 0;
+    size_t rows = budget / (BUFFERS * rowBytes);
+    rows = std::min(rows, static_cast<size_t>(maxAlloc) / (std::max(shape.K, shape.N) * sizeof(float)));
+    rows = std::min(rows, (shape.M + 3) / 4);
+    return std::max(tile, rows / tile * tile);
+}
+
+double command_seconds(const std::vector<Event>& events) {
+    double res = 0.0;
+    for (const Event& event : events) {
+        if (event) res += event_time(event.get()) / 1e9;
+    }
+    return res;
+}
+
+}
+
+StreamingStats matrix_mul_streaming(Runtime& runtime, const MatrixConfig& config, const MatrixShape& shape,
+                                    const float* first, const float* second, float* result, size_t panelRows) {
+    StreamingStats stats;
+    if (shape.transA) {
+        printf("Streaming needs A stored row by row (NN or NT layout).\n");
+        return stats;
+    }
+    if (shape.type != MatrixType::Float) {
+        printf("Streaming works on float matrices.\n");
+        return stats;
+    }
+    if (shape.M == 0 || shape.N == 0) {
+        stats.ok = true;
+        return stats;
+    }
+    if (shape.K == 0) {
+        // an empty sum, and there would be nothing to upload: the zero-size writes are invalid in OpenCL
+        for (size_t i = 0; i < shape.M; ++i) {
+            std::fill(result + i * shape.strideC(), result + i * shape.strideC() + shape.N, 0.0f);
+        }
+        stats.ok = true;
+        return stats;
+    }
+    Context& context = runtime.context();
+    cl_command_queue upload   = context.queue(0, CL_QUEUE_PROFILING_ENABLE, 1);
+    cl_command_queue compute  = context.queue(0, CL_QUEUE_PROFILING_ENABLE, 2);
+    cl_command_queue download = context.queue(0, CL_QUEUE_PROFILING_ENABLE, 3);
+
+    size_t rows = panelRows != 0 ? std::min(panelRows, shape.M) : choose_panel_rows(runtime, config, shape);
+    size_t panels = (shape.M + rows - 1) / rows;
+    stats.panels = panels;
+    stats.panelRows = rows;
+
+    // panels are stored tightly on the device
+    MatrixShape panelShape = shape;
+    panelShape.lda = shape.K;
+    panelShape.ldc = shape.N;
+
+    size_t secondBytes = shape.secondRows() * shape.strideB() * sizeof(float);
+    BufferPool& pool = runtime.buffers();
+    PooledBuffer secondBuffer = pool.acquire(secondBytes, CL_MEM_READ_ONLY);
+    PooledBuffer firstBuffers[BUFFERS];
+    PooledBuffer resultBuffers[BUFFERS];
+    for (size_t i = 0; i < BUFFERS; ++i) {
+        firstBuffers[i] = pool.acquire(rows * shape.K * sizeof(float), CL_MEM_READ_ONLY);
+        resultBuffers[i] = pool.acquire(rows * shape.N * sizeof(float), CL_MEM_READ_WRITE);
+        if (!firstBuffers[i] || !resultBuffers[i]) {
+            return stats;
+        }
+    }
+    if (!secondBuffer) {
+        return stats;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Event> uploaded(panels + 1);
+    std::vector<Event> computed(panels);
+    std::vector<Event> downloaded(panels);
+    Event& secondUploaded = uploaded[panels];
+    TracedEvent secondTraced(secondUploaded.out(), TraceKind::Write, "second", static_cast<double>(secondBytes));
+    cl_int res = secondTraced.done(clEnqueueWriteBuffer(upload, secondBuffer.get(), CL_FALSE, 0, secondBytes, second,
+                                                        0, nullptr, secondTraced.out()));
+
+    for (size_t i = 0; i < panels && res == CL_SUCCESS; ++i) {
+        size_t row = i * rows;
+        size_t count = std::min(rows, shape.M - row);
+        size_t slot = i % BUFFERS;
+        panelShape.M = count;
+
+        // the panel buffer is free once the kernel of panel i - BUFFERS is done
+        cl_event waitUpload[1];
+        cl_uint waitUploadCount = 0;
+        if (i >= BUFFERS) waitUpload[waitUploadCount++] = computed[i - BUFFERS].get();
+        size_t bufferOrigin[3] = { 0, 0, 0 };
+        size_t firstOrigin[3]  = { 0, row, 0 };
+        size_t firstRegion[3]  = { shape.K * sizeof(float), count, 1 };
+        TracedEvent uploadTraced(uploaded[i].out(), TraceKind::Write, "first panel",
+                                 static_cast<double>(count * shape.K * sizeof(float)));
+        res = uploadTraced.done(clEnqueueWriteBufferRect(upload, firstBuffers[slot].get(), CL_FALSE, bufferOrigin,
+                                                         firstOrigin, firstRegion, shape.K * sizeof(float), 0,
+                                                         shape.strideA() * sizeof(float), 0, first, waitUploadCount,
+                                                         waitUpload, uploadTraced.out()));
+        clFlush(upload);
+        if (res != CL_SUCCESS) break;
+
+        // ... and the result buffer once panel i - BUFFERS is downloaded
+        cl_event waitCompute[3];
+        cl_uint waitComputeCount = 0;
+        waitCompute[waitComputeCount++] = uploaded[i].get();
+        waitCompute[waitComputeCount++] = secondUploaded.get();
+        if (i >= BUFFERS) waitCompute[waitComputeCount++] = downloaded[i - BUFFERS].get();
+        res = matrix_mul(runtime, compute, config, panelShape, firstBuffers[slot].get(), secondBuffer.get(),
+                         resultBuffers[slot].get(), waitComputeCount, waitCompute, computed[i].out());
+        clFlush(compute);
+        if (res != CL_SUCCESS) break;
+
+        size_t resultOrigin[3] = { 0, row, 0 };
+        size_t resultRegion[3] = { shape.N * sizeof(float), count, 1 };
+        TracedEvent downloadTraced(downloaded[i].out(), TraceKind::Read, "result panel",
+                                   static_cast<double>(count * shape.N * sizeof(float)));
+        res = downloadTraced.done(clEnqueueReadBufferRect(download, resultBuffers[slot].get(), CL_FALSE, bufferOrigin,
+                                                          resultOrigin, resultRegion, shape.N * sizeof(float), 0,
+                                                          shape.strideC() * sizeof(float), 0, result, 1,
+                                                          computed[i].address(), downloadTraced.out()));
+        clFlush(download);
+    }
+    clFinish(upload);
+    clFinish(compute);
+    clFinish(download);
+    if (res != CL_SUCCESS) {
+        printf("Streaming matrix_mul failed. Error: %d\n", res);
+        return stats;
+    }
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.kernelSeconds = command_seconds(computed);
+    stats.transferSeconds = command_seconds(uploaded) + command_seconds(downloaded);
+    stats.ok = true;
+    return stats;
+}
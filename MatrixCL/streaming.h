@@ -0,0 +1,21 @@
+#pragma once
+#include "matrix_mul.h"
+
+struct StreamingStats {
+    bool   ok              { false };
+    size_t panels          { 0 };
+    size_t panelRows       { 0 };
+    double seconds         { 0.0 };
+    // summed command times, compare with seconds to see the overlap
+    double kernelSeconds   { 0.0 };
+    double transferSeconds { 0.0 };
+};
+
+// Multiplies host matrices that don't have to fit into device memory.
+// A and C are split into row panels of panelRows rows (0 picks it from the device memory size),
+// only op(B) and two panels of A and C are resident on the device.
+// Uploads, kernels and downloads go to three in-order queues linked by events,
+// so panel i + 1 is uploaded while panel i is computed and panel i - 1 is downloaded.
+// first, second and result may point into MappedFile mappings. A must not be transposed.
+StreamingStats matrix_mul_streaming(Runtime& runtime, const MatrixConfig& config, const MatrixShape& shape,
+                                    const float* first, const float* second, float* result, size_t panelRows = 0);
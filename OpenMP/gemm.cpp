@@ -0,0 +1,566 @@
+#include "gemm.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <omp.h>
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__)) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+#if defined(__AVX512F__)
+constexpr size_t MR = 6;
+constexpr size_t NR = 32;
+#elif defined(__AVX2__) && defined(__FMA__)
+constexpr size_t MR = 6;
+constexpr size_t NR = 16;
+#else
+constexpr size_t MR = 4;
+constexpr size_t NR = 16;
+#endif
+
+// KC x NR panels of B stay in L1, MC x KC blocks of A in L2, KC x NC panels of B in L3.
+constexpr size_t KC = 256;
+constexpr size_t MC = MR * 24;
+constexpr size_t NC = NR * 256;
+// columns of one macro-tile, the unit of work of a thread
+constexpr size_t NT = NR * 16;
+
+size_t roundUp(size_t value, size_t mode) {
+    return (value + mode - 1) / mode * mode;
+}
+
+// Values as they are stored in the packed panels: floats for the floating-point types, int32 for int8.
+inline float widen(float value) { return value; }
+inline float widen(Half value) { return halfToFloat(value); }
+inline float widen(Bf16 value) { return bf16ToFloat(value); }
+inline int32_t widen(int8_t value) { return value; }
+
+// A[0:mc, 0:kc] -> MR-row panels, inside a panel element (i, p) is at p * MR + i.
+// Rows past mc are zero so the microkernel never needs a tail. The values are multiplied by alpha.
+template<typename Src, typename Packed>
+void packA(size_t mc, size_t kc, const Src* A, size_t lda, Packed* packed, Packed alpha = Packed(1)) {
+    for (size_t ir = 0; ir < mc; ir += MR) {
+        size_t mr = std::min(MR, mc - ir);
+        for (size_t p = 0; p < kc; ++p) {
+            for (size_t i = 0; i < mr; ++i) {
+                packed[p * MR + i] = alpha * widen(A[(ir + i) * lda + p]);
+            }
+            for (size_t i = mr; i < MR; ++i) {
+                packed[p * MR + i] = Packed();
+            }
+        }
+        packed += MR * kc;
+    }
+}
+
+// B[0:kc, 0:nc] -> NR-column panels, inside a panel element (p, j) is at p * NR + j.
+template<typename Src, typename Packed>
+void packB(size_t kc, size_t nc, const Src* B, size_t ldb, Packed* packed) {
+    for (size_t jr = 0; jr < nc; jr += NR) {
+        size_t nr = std::min(NR, nc - jr);
+        for (size_t p = 0; p < kc; ++p) {
+            const Src* row = B + p * ldb + jr;
+            for (size_t j = 0; j < nr; ++j) {
+                packed[p * NR + j] = widen(row[j]);
+            }
+            for (size_t j = nr; j < NR; ++j) {
+                packed[p * NR + j] = Packed();
+            }
+        }
+        packed += NR * kc;
+    }
+}
+
+// C[0:MR, 0:NR] (+)= a * b over kc packed steps.
+#if defined(__AVX512F__)
+void microKernel(size_t kc, const float* a, const float* b, float* C, size_t ldc, bool accumulate) {
+    __m512 c[MR][2];
+    for (size_t i = 0; i < MR; ++i) {
+        c[i][0] = _mm512_setzero_ps();
+        c[i][1] = _mm512_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        __m512 b0 = _mm512_loadu_ps(b + p * NR);
+        __m512 b1 = _mm512_loadu_ps(b + p * NR + 16);
+        for (size_t i = 0; i < MR; ++i) {
+            __m512 ai = _mm512_set1_ps(a[p * MR + i]);
+            c[i][0] = _mm512_fmadd_ps(ai, b0, c[i][0]);
+            c[i][1] = _mm512_fmadd_ps(ai, b1, c[i][1]);
+        }
+    }
+    for (size_t i = 0; i < MR; ++i) {
+        float* row = C + i * ldc;
+        if (accumulate) {
+            c[i][0] = _mm512_add_ps(c[i][0], _mm512_loadu_ps(row));
+            c[i][1] = _mm512_add_ps(c[i][1], _mm512_loadu_ps(row + 16));
+        }
+        _mm512_storeu_ps(row, c[i][0]);
+        _mm512_storeu_ps(row + 16, c[i][1]);
+    }
+}
+const char* KERNEL_NAME = "avx512";
+#elif defined(__AVX2__) && defined(__FMA__)
+void microKernel(size_t kc, const float* a, const float* b, float* C, size_t ldc, bool accumulate) {
+    __m256 c[MR][2];
+    for (size_t i = 0; i < MR; ++i) {
+        c[i][0] = _mm256_setzero_ps();
+        c[i][1] = _mm256_setzero_ps();
+    }
+    for (size_t p = 0; p < kc; ++p) {
+        __m256 b0 = _mm256_loadu_ps(b + p * NR);
+        __m256 b1 = _mm256_loadu_ps(b + p * NR + 8);
+        for (size_t i = 0; i < MR; ++i) {
+            __m256 ai = _mm256_broadcast_ss(a + p * MR + i);
+            c[i][0] = _mm256_fmadd_ps(ai, b0, c[i][0]);
+            c[i][1] = _mm256_fmadd_ps(ai, b1, c[i][1]);
+        }
+    }
+    for (size_t i = 0; i < MR; ++i) {
+        float* row = C + i * ldc;
+        if (accumulate) {
+            c[i][0] = _mm256_add_ps(c[i][0], _mm256_loadu_ps(row));
+            c[i][1] = _mm256_add_ps(c[i][1], _mm256_loadu_ps(row + 8));
+        }
+        _mm256_storeu_ps(row, c[i][0]);
+        _mm256_storeu_ps(row + 8, c[i][1]);
+    }
+}
+const char* KERNEL_NAME = "avx2";
+#else
+void microKernel(size_t kc, const float* a, const float* b, float* C, size_t ldc, bool accumulate) {
+    float c[MR][NR] = {};
+    for (size_t p = 0; p < kc; ++p) {
+        for (size_t i = 0; i < MR; ++i) {
+            float ai = a[p * MR + i];
+            #pragma omp simd
+            for (size_t j = 0; j < NR; ++j) {
+                c[i][j] += ai * b[p * NR + j];
+            }
+        }
+    }
+    for (size_t i = 0; i < MR; ++i) {
+        float* row = C + i * ldc;
+        #pragma omp simd
+        for (size_t j = 0; j < NR; ++j) {
+            row[j] = accumulate ? row[j] + c[i][j] : c[i][j];
+        }
+    }
+}
+const char* KERNEL_NAME = "omp simd";
+#endif
+
+// int8 products in int32, the compiler vectorizes the row updates.
+void microKernel(size_t kc, const int32_t* a, const int32_t* b, int32_t* C, size_t ldc, bool accumulate) {
+    int32_t c[MR][NR] = {};
+    for (size_t p = 0; p < kc; ++p) {
+        for (size_t i = 0; i < MR; ++i) {
+            int32_t ai = a[p * MR + i];
+            #pragma omp simd
+            for (size_t j = 0; j < NR; ++j) {
+                c[i][j] += ai * b[p * NR + j];
+            }
+        }
+    }
+    for (size_t i = 0; i < MR; ++i) {
+        int32_t* row = C + i * ldc;
+        #pragma omp simd
+        for (size_t j = 0; j < NR; ++j) {
+            row[j] = accumulate ? row[j] + c[i][j] : c[i][j];
+        }
+    }
+}
+
+// Edge tiles go through a full MR x NR scratch tile.
+template<typename Packed>
+void edgeKernel(size_t mr, size_t nr, size_t kc, const Packed* a, const Packed* b, Packed* C, size_t ldc,
+                bool accumulate) {
+    Packed tile[MR * NR];
+    microKernel(kc, a, b, tile, NR, false);
+    for (size_t i = 0; i < mr; ++i) {
+        for (size_t j = 0; j < nr; ++j) {
+            C[i * ldc + j] = accumulate ? C[i * ldc + j] + tile[i * NR + j] : tile[i * NR + j];
+        }
+    }
+}
+
+// The activation of n values, a separate loop per function so that each one vectorizes.
+void activate(float* values, size_t n, GemmActivation activation) {
+    switch (activation) {
+        case GemmActivation::Relu:
+            #pragma omp simd
+            for (size_t j = 0; j < n; ++j) {
+                values[j] = std::max(values[j], 0.0f);
+            }
+            break;
+        case GemmActivation::Gelu:
+            for (size_t j = 0; j < n; ++j) {
+                float x = values[j];
+                values[j] = 0.5f * x * (1.0f + std::tanh(0.7978845608f * (x + 0.044715f * x * x * x)));
+            }
+            break;
+        case GemmActivation::Sigmoid:
+            for (size_t j = 0; j < n; ++j) {
+                values[j] = 1.0f / (1.0f + std::exp(-values[j]));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Before the first product of the mr x nr tile: C *= beta, so the products can be added to it.
+void startTile(size_t mr, size_t nr, float* C, size_t ldc, float beta) {
+    for (size_t i = 0; i < mr; ++i) {
+        #pragma omp simd
+        for (size_t j = 0; j < nr; ++j) {
+            C[i * ldc + j] *= beta;
+        }
+    }
+}
+
+// After the last product of the tile at (row, col) of C: bias and activation.
+void finishTile(size_t mr, size_t nr, float* C, size_t ldc, size_t row, size_t col, const GemmEpilogue& epilogue) {
+    for (size_t i = 0; i < mr; ++i) {
+        float rowBias = epilogue.rowBias != nullptr ? epilogue.rowBias[row + i] : 0.0f;
+        float* c = C + i * ldc;
+        if (epilogue.colBias != nullptr) {
+            #pragma omp simd
+            for (size_t j = 0; j < nr; ++j) {
+                c[j] += rowBias + epilogue.colBias[col + j];
+            }
+        } else if (epilogue.rowBias != nullptr) {
+            #pragma omp simd
+            for (size_t j = 0; j < nr; ++j) {
+                c[j] += rowBias;
+            }
+        }
+        activate(c, nr, epilogue.activation);
+    }
+}
+
+// Which parts of the epilogue run; int32 results have none.
+struct EpilogueParts {
+    bool beta   { false };
+    bool finish { false };
+};
+
+EpilogueParts epilogueParts(const GemmEpilogue& epilogue) {
+    EpilogueParts parts;
+    parts.beta = epilogue.beta != 0.0f;
+    parts.finish = epilogue.rowBias != nullptr || epilogue.colBias != nullptr ||
+                   epilogue.activation != GemmActivation::None;
+    return parts;
+}
+
+void startTile(size_t, size_t, int32_t*, size_t, float) {}
+void finishTile(size_t, size_t, int32_t*, size_t, size_t, size_t, const GemmEpilogue&) {}
+
+// One multiplication on the calling thread, the packing buffers are reused between calls.
+void gemmSerial(size_t M, size_t N, size_t K,
+                const float* A, size_t lda,
+                const float* B, size_t ldb,
+                float* C, size_t ldc,
+                std::vector<float>& packedA, std::vector<float>& packedB) {
+    if (K == 0) {
+        for (size_t i = 0; i < M; ++i) {
+            std::fill(C + i * ldc, C + i * ldc + N, 0.0f);
+        }
+        return;
+    }
+    packedA.resize(std::max(packedA.size(), roundUp(std::min(M, MC), MR) * KC));
+    packedB.resize(std::max(packedB.size(), roundUp(std::min(N, NC), NR) * KC));
+    for (size_t jc = 0; jc < N; jc += NC) {
+        size_t nc = std::min(NC, N - jc);
+        for (size_t pc = 0; pc < K; pc += KC) {
+            size_t kc = std::min(KC, K - pc);
+            bool accumulate = pc != 0;
+            for (size_t jr = 0; jr < nc; jr += NR) {
+                packB(kc, std::min(NR, nc - jr), B + pc * ldb + jc + jr, ldb, packedB.data() + jr * kc);
+            }
+            for (size_t ic = 0; ic < M; ic += MC) {
+                size_t mc = std::min(MC, M - ic);
+                packA(mc, kc, A + ic * lda + pc, lda, packedA.data());
+                for (size_t jr = 0; jr < nc; jr += NR) {
+                    size_t nr = std::min(NR, nc - jr);
+                    for (size_t ir = 0; ir < mc; ir += MR) {
+                        size_t mr = std::min(MR, mc - ir);
+                        const float* a = packedA.data() + ir * kc;
+                        const float* b = packedB.data() + jr * kc;
+                        float* c = C + (ic + ir) * ldc + jc + jr;
+                        if (mr == MR && nr == NR) {
+                            microKernel(kc, a, b, c, ldc, accumulate);
+                        } else {
+                            edgeKernel(mr, nr, kc, a, b, c, ldc, accumulate);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The parallel multiplication for every element type, Packed is the type of the panels and of C.
+// The epilogue is only used for float results.
+template<typename Src, typename Packed>
+void gemmPacked(size_t M, size_t N, size_t K,
+                const Src* A, size_t lda,
+                const Src* B, size_t ldb,
+                Packed* C, size_t ldc, const GemmEpilogue& epilogue = GemmEpilogue()) {
+    if (M == 0 || N == 0) {
+        return;
+    }
+    EpilogueParts parts = epilogueParts(epilogue);
+    if (K == 0) {
+        for (size_t i = 0; i < M; ++i) {
+            if (parts.beta) {
+                startTile(1, N, C + i * ldc, ldc, epilogue.beta);
+            } else {
+                std::fill(C + i * ldc, C + i * ldc + N, Packed());
+            }
+            if (parts.finish) {
+                finishTile(1, N, C + i * ldc, ldc, i, 0, epilogue);
+            }
+        }
+        return;
+    }
+    Packed alpha = static_cast<Packed>(epilogue.alpha);
+
+    size_t mBlocks = (M + MC - 1) / MC;
+    std::vector<Packed> packedA(roundUp(M, MR) * KC);
+    std::vector<Packed> packedB(roundUp(std::min(N, NC), NR) * KC);
+
+    for (size_t jc = 0; jc < N; jc += NC) {
+        size_t nc = std::min(NC, N - jc);
+        size_t nPanels = (nc + NR - 1) / NR;
+        size_t nTiles = (nc + NT - 1) / NT;
+
+        for (size_t pc = 0; pc < K; pc += KC) {
+            size_t kc = std::min(KC, K - pc);
+            // with beta the first products are added to beta * C
+            bool start = pc == 0 && parts.beta;
+            bool accumulate = pc != 0 || parts.beta;
+            bool finish = pc + kc == K && parts.finish;
+
+            #pragma omp parallel
+            {
+                // both operands are packed cooperatively, then each thread takes whole macro-tiles
+                #pragma omp for schedule(static) nowait
+                for (size_t panel = 0; panel < nPanels; ++panel) {
+                    size_t jr = panel * NR;
+                    packB(kc, std::min(NR, nc - jr), B + pc * ldb + jc + jr, ldb, packedB.data() + panel * NR * kc);
+                }
+                #pragma omp for schedule(static)
+                for (size_t block = 0; block < mBlocks; ++block) {
+                    size_t ic = block * MC;
+                    packA(std::min(MC, M - ic), kc, A + ic * lda + pc, lda, packedA.data() + ic * kc, alpha);
+                }
+
+                #pragma omp for collapse(2) schedule(dynamic)
+                for (size_t block = 0; block < mBlocks; ++block) {
+                    for (size_t tile = 0; tile < nTiles; ++tile) {
+                        size_t ic = block * MC;
+                        size_t mc = std::min(MC, M - ic);
+                        size_t jt = tile * NT;
+                        size_t nt = std::min(NT, nc - jt);
+                        for (size_t jr = jt; jr < jt + nt; jr += NR) {
+                            size_t nr = std::min(NR, nc - jr);
+                            const Packed* b = packedB.data() + jr * kc;
+                            for (size_t ir = 0; ir < mc; ir += MR) {
+                                size_t mr = std::min(MR, mc - ir);
+                                const Packed* a = packedA.data() + (ic + ir) * kc;
+                                Packed* c = C + (ic + ir) * ldc + jc + jr;
+                                if (start) {
+                                    startTile(mr, nr, c, ldc, epilogue.beta);
+                                }
+                                if (mr == MR && nr == NR) {
+                                    microKernel(kc, a, b, c, ldc, accumulate);
+                                } else {
+                                    edgeKernel(mr, nr, kc, a, b, c, ldc, accumulate);
+                                }
+                                if (finish) {
+                                    finishTile(mr, nr, c, ldc, ic + ir, jc + jr, epilogue);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+}
+
+const char* gemmKernelName() {
+    return KERNEL_NAME;
+}
+
+float halfToFloat(Half value) {
+#if defined(__F16C__)
+    return _cvtsh_ss(value.bits);
+#else
+    uint32_t sign = static_cast<uint32_t>(value.bits & 0x8000) << 16;
+    uint32_t exponent = (value.bits >> 10) & 0x1f;
+    uint32_t mantissa = value.bits & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0) {
+        // zero and subnormals are mantissa * 2^-24
+        float res = mantissa * (1.0f / 16777216.0f);
+        return sign != 0 ? -res : res;
+    } else if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+#endif
+}
+
+Half floatToHalf(float value) {
+#if defined(__F16C__)
+    return Half { static_cast<uint16_t>(_cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT)) };
+#else
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return Half { static_cast<uint16_t>(sign | 0x7e00) };
+    }
+    if (exponent >= 31) {
+        return Half { static_cast<uint16_t>(sign | 0x7c00) };
+    }
+    uint32_t res;
+    uint32_t rest;
+    uint32_t middle;
+    if (exponent <= 0) {
+        // subnormal, or zero below half of the smallest one
+        if (exponent < -10) {
+            return Half { static_cast<uint16_t>(sign) };
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = static_cast<uint32_t>(14 - exponent);
+        res = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        middle = 1u << (shift - 1);
+    } else {
+        res = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        middle = 0x1000;
+    }
+    // a carry out of the mantissa correctly moves to the next exponent, up to infinity
+    if (rest > middle || (rest == middle && (res & 1) != 0)) {
+        ++res;
+    }
+    return Half { static_cast<uint16_t>(sign | res) };
+#endif
+}
+
+float bf16ToFloat(Bf16 value) {
+    uint32_t bits = static_cast<uint32_t>(value.bits) << 16;
+    float res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+Bf16 floatToBf16(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        // keep NaNs quiet
+        return Bf16 { static_cast<uint16_t>((bits >> 16) | 0x40) };
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return Bf16 { static_cast<uint16_t>(bits >> 16) };
+}
+
+void gemm(size_t M, size_t N, size_t K,
+          const float* A, size_t lda,
+          const float* B, size_t ldb,
+          float* C, size_t ldc, const GemmEpilogue& epilogue) {
+    gemmPacked(M, N, K, A, lda, B, ldb, C, ldc, epilogue);
+}
+
+void gemm(size_t M, size_t N, size_t K,
+          const Half* A, size_t lda,
+          const Half* B, size_t ldb,
+          float* C, size_t ldc, const GemmEpilogue& epilogue) {
+    gemmPacked(M, N, K, A, lda, B, ldb, C, ldc, epilogue);
+}
+
+void gemm(size_t M, size_t N, size_t K,
+          const Bf16* A, size_t lda,
+          const Bf16* B, size_t ldb,
+          float* C, size_t ldc, const GemmEpilogue& epilogue) {
+    gemmPacked(M, N, K, A, lda, B, ldb, C, ldc, epilogue);
+}
+
+void gemm(size_t M, size_t N, size_t K,
+          const int8_t* A, size_t lda,
+          const int8_t* B, size_t ldb,
+          int32_t* C, size_t ldc) {
+    gemmPacked(M, N, K, A, lda, B, ldb, C, ldc);
+}
+
+void gemm(size_t M, size_t N, size_t K,
+          const int8_t* A, size_t lda,
+          const int8_t* B, size_t ldb,
+          float* C, size_t ldc, float scale, const GemmEpilogue& epilogue) {
+    std::vector<int32_t> products(M * N);
+    gemmPacked(M, N, K, A, lda, B, ldb, products.data(), N);
+    EpilogueParts parts = epilogueParts(epilogue);
+    float factor = scale * epilogue.alpha;
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < M; ++i) {
+        float* c = C + i * ldc;
+        for (size_t j = 0; j < N; ++j) {
+            float product = factor * static_cast<float>(products[i * N + j]);
+            c[j] = parts.beta ? product + epilogue.beta * c[j] : product;
+        }
+        if (parts.finish) {
+            finishTile(1, N, c, ldc, i, 0, epilogue);
+        }
+    }
+}
+
+void gemmBatched(size_t batch, size_t M, size_t N, size_t K,
+                 const float* const* A, size_t lda,
+                 const float* const* B, size_t ldb,
+                 float* const* C, size_t ldc) {
+    if (M == 0 || N == 0) {
+        return;
+    }
+    #pragma omp parallel
+    {
+        std::vector<float> packedA;
+        std::vector<float> packedB;
+        #pragma omp for schedule(dynamic, 16)
+        for (size_t i = 0; i < batch; ++i) {
+            gemmSerial(M, N, K, A[i], lda, B[i], ldb, C[i], ldc, packedA, packedB);
+        }
+    }
+}
+
+void gemmStridedBatched(size_t batch, size_t M, size_t N, size_t K,
+                        const float* A, size_t lda, size_t strideA,
+                        const float* B, size_t ldb, size_t strideB,
+                        float* C, size_t ldc, size_t strideC) {
+    if (M == 0 || N == 0) {
+        return;
+    }
+    #pragma omp parallel
+    {
+        std::vector<float> packedA;
+        std::vector<float> packedB;
+        #pragma omp for schedule(dynamic, 16)
+        for (size_t i = 0; i < batch; ++i) {
+            gemmSerial(M, N, K, A + i * strideA, lda, B + i * strideB, ldb, C + i * strideC, ldc, packedA, packedB);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// 16-bit floating-point storage: IEEE binary16, and bfloat16, which keeps the upper 16 bits of a float.
+struct Half { uint16_t bits; };
+struct Bf16 { uint16_t bits; };
+
+// Conversions round to nearest even.
+float halfToFloat(Half value);
+Half floatToHalf(float value);
+float bf16ToFloat(Bf16 value);
+Bf16 floatToBf16(float value);
+
+// Element-wise function applied to C at the end of the multiplication.
+enum class GemmActivation { None, Relu, Gelu, Sigmoid };
+
+// C = activation(alpha * A * B + beta * C + rowBias[i] + colBias[j]); the defaults give C = A * B.
+// Nothing costs an extra pass over C: alpha is folded into the packing of A, beta scales each register tile
+// of C before its first product is added, bias and activation are applied to the tile after its last one.
+// With beta == 0 C isn't read. Gelu is the tanh approximation.
+struct GemmEpilogue {
+    float alpha { 1.0f };
+    float beta  { 0.0f };
+    // M values, one per row of C, or nullptr
+    const float* rowBias { nullptr };
+    // N values, one per column of C, or nullptr
+    const float* colBias { nullptr };
+    GemmActivation activation { GemmActivation::None };
+};
+
+// C = A * B for row-major A (M x K), B (K x N) and C (M x N), with the epilogue if given.
+// lda, ldb and ldc are the row strides in elements.
+//
+// A and B are packed into cache-sized panels (KC x NC of B for L3, MC x KC of A for L2)
+// and multiplied by an MR x NR register microkernel: AVX-512 or AVX2+FMA when the
+// compiler targets them, a #pragma omp simd loop otherwise.
+// Macro-tiles of C are distributed over the OpenMP threads.
+void gemm(size_t M, size_t N, size_t K,
+          const float* A, size_t lda,
+          const float* B, size_t ldb,
+          float* C, size_t ldc, const GemmEpilogue& epilogue = GemmEpilogue());
+
+// Mixed precision: 16-bit A and B are widened to float while they are packed,
+// so the multiplication and the accumulation are the float ones above.
+void gemm(size_t M, size_t N, size_t K,
+          const Half* A, size_t lda,
+          const Half* B, size_t ldb,
+          float* C, size_t ldc, const GemmEpilogue& epilogue = GemmEpilogue());
+void gemm(size_t M, size_t N, size_t K,
+          const Bf16* A, size_t lda,
+          const Bf16* B, size_t ldb,
+          float* C, size_t ldc, const GemmEpilogue& epilogue = GemmEpilogue());
+
+// int8 A and B with int32 accumulation, exact as long as the sums fit in int32.
+void gemm(size_t M, size_t N, size_t K,
+          const int8_t* A, size_t lda,
+          const int8_t* B, size_t ldb,
+          int32_t* C, size_t ldc);
+
+// The same with a float result C = scale * A * B, where scale is the product of the per-tensor scales
+// of A and B. The int32 products go through a temporary M x N buffer; the epilogue is applied
+// while they are converted, with scale * alpha as the factor of the product.
+void gemm(size_t M, size_t N, size_t K,
+          const int8_t* A, size_t lda,
+          const int8_t* B, size_t ldb,
+          float* C, size_t ldc, float scale, const GemmEpilogue& epilogue = GemmEpilogue());
+
+// batch independent multiplications of the same shape, C[i] = A[i] * B[i].
+// Every multiplication runs on one thread with the same packing and microkernel as gemm,
+// the OpenMP threads share out the batch. Meant for many small matrices.
+void gemmBatched(size_t batch, size_t M, size_t N, size_t K,
+                 const float* const* A, size_t lda,
+                 const float* const* B, size_t ldb,
+                 float* const* C, size_t ldc);
+
+// The same with matrix i at A + i * strideA, B + i * strideB and C + i * strideC.
+// A zero stride of A or B shares that matrix between the whole batch.
+void gemmStridedBatched(size_t batch, size_t M, size_t N, size_t K,
+                        const float* A, size_t lda, size_t strideA,
+                        const float* B, size_t ldb, size_t strideB,
+                        float* C, size_t ldc, size_t strideC);
+
+// Name of the microkernel the engine was built with.
+const char* gemmKernelName();
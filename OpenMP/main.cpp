@@ -1,8 +1,14 @@
+#include <algorithm>
 #include <iostream>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <chrono>
+#include <type_traits>
+#include <vector>
 #include <omp.h>
+#include "gemm.h"
+#include "spmm.h"
 
 float* createMatrix(size_t shapeX, size_t shapeY) {
     size_t len = sizeof(float) * shapeX * shapeY;
@@ -21,14 +27,6 @@ void clearMatrix(float* matrix) {
     free(matrix);
 }
 
-void transpose(const float* src, float* dst, size_t shapeX, size_t shapeY) {
-    for(size_t i = 0; i < shapeX; ++i) {
-        for(size_t j = 0; j < shapeY; ++j) {
-            dst[j * shapeX + i] = src[i * shapeY + j];
-        }
-    }
-}
-
 void mulMatrixSeq(const float* firstMatrix, size_t shapeX1, size_t shapeY1,
                   const float* secondMatrix, size_t shapeX2, size_t shapeY2, float* resultMatrix) {
     for (int i = 0; i < shapeX1; ++i) {
@@ -42,20 +40,17 @@ void mulMatrixSeq(const float* firstMatrix, size_t shapeX1, size_t shapeY1,
 
 void mulMatrix(const float* firstMatrix, size_t shapeX1, size_t shapeY1,
                const float* secondMatrix, size_t shapeX2, size_t shapeY2, float* resultMatrix) {
-    #pragma omp parallel shared(firstMatrix, secondMatrix, resultMatrix)
-    {
-        int i, j, k;
-        #pragma omp for schedule (static)
-        for (i = 0; i < shapeX1; ++i) {
-            for (j = 0; j < shapeY2; ++j) {
-                float sum;
-                for (k = 0; k < shapeY1; ++k) {
-                    sum += firstMatrix[i * shapeY1 + k] * secondMatrix[j * shapeX2 + k];
-                }
-                resultMatrix[i * shapeY2 + j] = sum;
-            }
+    gemm(shapeX1, shapeY2, shapeY1, firstMatrix, shapeY1, secondMatrix, shapeY2, resultMatrix, shapeY2);
+}
+
+bool check(const float* expected, const float* actual, size_t shapeX, size_t shapeY) {
+    for (size_t i = 0; i < shapeX * shapeY; ++i) {
+        if (expected[i] != actual[i]) {
+            printf("Expected: %f. Actual: %f. i = %zu, j = %zu\n", expected[i], actual[i], i / shapeY, i % shapeY);
+            return false;
         }
     }
+    return true;
 }
 
 void printMatrix(const char* name, const float* matrix, size_t shapeX, size_t shapeY) {
@@ -68,48 +63,277 @@ void printMatrix(const char* name, const float* matrix, size_t shapeX, size_t sh
     }
 }
 
+// batch multiplications of M x K and K x N matrices in one call, reported in matrices per second.
+int runBatched(size_t M, size_t K, size_t N, size_t batch) {
+    float* firstMatrices  = createMatrix(batch * M, K);
+    float* secondMatrices = createMatrix(batch * K, N);
+    float* resultMatrices = createMatrix(batch * M, N);
+    float* expectedMatrix = createMatrix(M, N);
+    randomMatrix(firstMatrices, batch * M, K);
+    randomMatrix(secondMatrices, batch * K, N);
+
+    auto start = std::chrono::steady_clock::now();
+    gemmStridedBatched(batch, M, N, K, firstMatrices, K, M * K, secondMatrices, N, K * N, resultMatrices, N, M * N);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the last multiplication of the batch against the sequential one
+    size_t last = batch - 1;
+    mulMatrixSeq(firstMatrices + last * M * K, M, K, secondMatrices + last * K * N, K, N, expectedMatrix);
+    bool ok = check(expectedMatrix, resultMatrices + last * M * N, M, N);
+    if (ok) {
+        std::cout << "Threads: " << omp_get_max_threads() << ", kernel: " << gemmKernelName() << std::endl;
+        std::cout << "Batch: " << batch << " x " << M << "x" << K << "x" << N << ", time: " << elapsed << " s." << std::endl;
+        std::cout << "Matrices/s: " << batch / elapsed << std::endl;
+        std::cout << "GFLOPS: " << 2.0 * M * K * N * batch / elapsed / 1e9 << std::endl;
+    }
+    clearMatrix(firstMatrices);
+    clearMatrix(secondMatrices);
+    clearMatrix(resultMatrices);
+    clearMatrix(expectedMatrix);
+    return ok ? 0 : 1;
+}
+
+template<typename T>
+T fromFloat(float value);
+template<> Half fromFloat<Half>(float value) { return floatToHalf(value); }
+template<> Bf16 fromFloat<Bf16>(float value) { return floatToBf16(value); }
+template<> int8_t fromFloat<int8_t>(float value) { return static_cast<int8_t>(value); }
+
+double toDouble(Half value) { return halfToFloat(value); }
+double toDouble(Bf16 value) { return bf16ToFloat(value); }
+double toDouble(int8_t value) { return value; }
+
+void mulLowPrecision(size_t M, size_t N, size_t K, const Half* A, const Half* B, float* C) {
+    gemm(M, N, K, A, K, B, N, C, N);
+}
+void mulLowPrecision(size_t M, size_t N, size_t K, const Bf16* A, const Bf16* B, float* C) {
+    gemm(M, N, K, A, K, B, N, C, N);
+}
+// int8 values are quantized with the per-tensor scale 1/16
+void mulLowPrecision(size_t M, size_t N, size_t K, const int8_t* A, const int8_t* B, float* C) {
+    gemm(M, N, K, A, K, B, N, C, N, 1.0f / 256);
+}
+
+// Multiplies 16-bit or int8 matrices and checks the result against an fp64 product of the same inputs.
+// The worst error is relative to the sum of |a * b| of the entry, the bound of the fp32 accumulation error.
+template<typename T>
+int runLowPrecision(size_t M, size_t K, size_t N, const char* name) {
+    std::vector<T> first(M * K);
+    std::vector<T> second(K * N);
+    bool quantized = std::is_same<T, int8_t>::value;
+    double scale = quantized ? 1.0 / 16 : 1.0;
+    for (T& value : first) value = fromFloat<T>(quantized ? rand() % 255 - 127 : (rand() % 2001 - 1000) / 100.0f);
+    for (T& value : second) value = fromFloat<T>(quantized ? rand() % 255 - 127 : (rand() % 2001 - 1000) / 100.0f);
+    float* resultMatrix = createMatrix(M, N);
+
+    auto start = std::chrono::steady_clock::now();
+    mulLowPrecision(M, N, K, first.data(), second.data(), resultMatrix);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double worst = 0.0;
+    for (size_t i = 0; i < M; ++i) {
+        for (size_t j = 0; j < N; ++j) {
+            double expected = 0.0;
+            double magnitude = 0.0;
+            for (size_t k = 0; k < K; ++k) {
+                double product = toDouble(first[i * K + k]) * scale * toDouble(second[k * N + j]) * scale;
+                expected += product;
+                magnitude += std::fabs(product);
+            }
+            if (magnitude > 0) {
+                worst = std::max(worst, std::fabs(resultMatrix[i * N + j] - expected) / magnitude);
+            }
+        }
+    }
+    clearMatrix(resultMatrix);
+    // fp32 accumulation is good to about K * 2^-24 of the magnitude, int32 accumulation is exact
+    bool ok = worst <= (quantized ? 1e-6 : K * 6e-8);
+    std::cout << "Type: " << name << ", kernel: " << gemmKernelName() << ", max relative error vs fp64: " << worst
+              << (ok ? "" : " (too large)") << std::endl;
+    std::cout << "Input bytes: " << (M * K + K * N) * sizeof(T) << " (float: " << (M * K + K * N) * sizeof(float)
+              << ")" << std::endl;
+    std::cout << "Time: " << elapsed << " s, GFLOPS: " << 2.0 * M * K * N / elapsed / 1e9 << std::endl;
+    return ok ? 0 : 1;
+}
+
+// C = relu(0.5 * A * B + 2 * C + rowBias + colBias) fused into gemm, against the sequential product
+// followed by the epilogue, and timed against gemm followed by a separate pass over C.
+int runEpilogue(size_t M, size_t K, size_t N) {
+    float* firstMatrix  = createMatrix(M, K);
+    float* secondMatrix = createMatrix(K, N);
+    float* resultMatrix = createMatrix(M, N);
+    float* separateMatrix = createMatrix(M, N);
+    float* expectedMatrix = createMatrix(M, N);
+    float* initialMatrix = createMatrix(M, N);
+    randomMatrix(firstMatrix, M, K);
+    randomMatrix(secondMatrix, K, N);
+    randomMatrix(initialMatrix, M, N);
+    std::vector<float> rowBias(M);
+    std::vector<float> colBias(N);
+    for (float& value : rowBias) value = rand() % 2001 - 1000;
+    for (float& value : colBias) value = rand() % 2001 - 1000;
+    // negative values, so relu clips a part of C
+    for (size_t i = 0; i < M * N; ++i) initialMatrix[i] -= 50;
+
+    GemmEpilogue epilogue;
+    epilogue.alpha = 0.5f;
+    epilogue.beta = 2.0f;
+    epilogue.rowBias = rowBias.data();
+    epilogue.colBias = colBias.data();
+    epilogue.activation = GemmActivation::Relu;
+
+    memcpy(resultMatrix, initialMatrix, M * N * sizeof(float));
+    auto start = std::chrono::steady_clock::now();
+    gemm(M, N, K, firstMatrix, K, secondMatrix, N, resultMatrix, N, epilogue);
+    double fused = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    gemm(M, N, K, firstMatrix, K, secondMatrix, N, separateMatrix, N);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < M; ++i) {
+        for (size_t j = 0; j < N; ++j) {
+            float value = 0.5f * separateMatrix[i * N + j] + 2.0f * initialMatrix[i * N + j] + rowBias[i] + colBias[j];
+            separateMatrix[i * N + j] = std::max(value, 0.0f);
+        }
+    }
+    double separate = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the products are integers below 2^24, so only alpha and the additions round
+    mulMatrixSeq(firstMatrix, M, K, secondMatrix, K, N, expectedMatrix);
+    bool ok = true;
+    for (size_t i = 0; i < M && ok; ++i) {
+        for (size_t j = 0; j < N && ok; ++j) {
+            double value = 0.5 * expectedMatrix[i * N + j] + 2.0 * initialMatrix[i * N + j] + rowBias[i] + colBias[j];
+            double expected = std::max(value, 0.0);
+            if (std::fabs(resultMatrix[i * N + j] - expected) > 1e-6 * (std::fabs(expected) + 1.0)) {
+                printf("Expected: %f. Actual: %f. i = %zu, j = %zu\n", expected, resultMatrix[i * N + j], i, j);
+                ok = false;
+            }
+        }
+    }
+    if (ok) {
+        std::cout << "Threads: " << omp_get_max_threads() << ", kernel: " << gemmKernelName() << std::endl;
+        std::cout << "Fused epilogue: " << fused << " s, separate pass: " << separate << " s." << std::endl;
+        std::cout << "GFLOPS: " << 2.0 * M * K * N / fused / 1e9 << std::endl;
+    }
+    clearMatrix(firstMatrix);
+    clearMatrix(secondMatrix);
+    clearMatrix(resultMatrix);
+    clearMatrix(separateMatrix);
+    clearMatrix(expectedMatrix);
+    clearMatrix(initialMatrix);
+    return ok ? 0 : 1;
+}
+
+// A with the given fraction of nonzeros multiplied by spmm and by gemm. The values are integers,
+// so both products are exact and have to be equal.
+int runSparse(size_t M, size_t K, size_t N, double density) {
+    float* firstMatrix  = createMatrix(M, K);
+    float* secondMatrix = createMatrix(K, N);
+    float* resultMatrix = createMatrix(M, N);
+    float* denseMatrix  = createMatrix(M, N);
+    for (size_t i = 0; i < M * K; ++i) {
+        if (rand() < density * RAND_MAX) {
+            firstMatrix[i] = rand() % 99 + 1;
+        }
+    }
+    randomMatrix(secondMatrix, K, N);
+
+    auto start = std::chrono::steady_clock::now();
+    CsrMatrix sparse = denseToCsr(M, K, firstMatrix, K);
+    double convert = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    spmm(sparse, N, secondMatrix, N, resultMatrix, N);
+    double sparseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    gemm(M, N, K, firstMatrix, K, secondMatrix, N, denseMatrix, N);
+    double denseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool ok = memcmp(resultMatrix, denseMatrix, M * N * sizeof(float)) == 0;
+    if (!ok) {
+        printf("spmm and gemm results differ\n");
+    } else {
+        std::cout << "Threads: " << omp_get_max_threads() << ", nonzeros: " << sparse.nonZeros() << " (density "
+                  << sparse.density() << ")" << std::endl;
+        std::cout << "spmm: " << sparseTime << " s (CSR conversion " << convert << " s), gemm: " << denseTime
+                  << " s, " << (preferSparse(M, K, sparse.nonZeros()) ? "sparse" : "dense")
+                  << " is preferred (below density " << spmmMaxDensity() << ")." << std::endl;
+    }
+    clearMatrix(firstMatrix);
+    clearMatrix(secondMatrix);
+    clearMatrix(resultMatrix);
+    clearMatrix(denseMatrix);
+    return ok ? 0 : 1;
+}
+
+// OpenMP [M K N [--batch COUNT | --type half|bf16|int8 | --epilogue | --density D]]
 int main(int argc, char** argv) {
     srand(time(nullptr));
-    omp_set_num_threads(8);
     size_t shapeX1 = 1000;
     size_t shapeY1 = 500;
     size_t shapeX2 = 500;
     size_t shapeY2 = 1000;
+    if (argc > 3) {
+        shapeX1 = strtoul(argv[1], nullptr, 10);
+        shapeY1 = shapeX2 = strtoul(argv[2], nullptr, 10);
+        shapeY2 = strtoul(argv[3], nullptr, 10);
+    }
+
+    if (argc > 5 && strcmp(argv[4], "--batch") == 0) {
+        return runBatched(shapeX1, shapeY1, shapeY2, strtoul(argv[5], nullptr, 10));
+    }
+    if (argc > 5 && strcmp(argv[4], "--density") == 0) {
+        return runSparse(shapeX1, shapeY1, shapeY2, strtod(argv[5], nullptr));
+    }
+    if (argc > 4 && strcmp(argv[4], "--epilogue") == 0) {
+        return runEpilogue(shapeX1, shapeY1, shapeY2);
+    }
+    if (argc > 5 && strcmp(argv[4], "--type") == 0) {
+        if (strcmp(argv[5], "half") == 0) return runLowPrecision<Half>(shapeX1, shapeY1, shapeY2, argv[5]);
+        if (strcmp(argv[5], "bf16") == 0) return runLowPrecision<Bf16>(shapeX1, shapeY1, shapeY2, argv[5]);
+        if (strcmp(argv[5], "int8") == 0) return runLowPrecision<int8_t>(shapeX1, shapeY1, shapeY2, argv[5]);
+        printf("Unknown type %s\n", argv[5]);
+        return 1;
+    }
 
     if (shapeY1 != shapeX2) {
         printf("Incorrect dims. shapeY1: %zu, shapeX2: %zu", shapeY1, shapeX2);
         return 0;
     }
 
-    float* firstMatrix  = createMatrix(shapeX1, shapeY1);
-    float* secondMatrix = createMatrix(shapeX2, shapeY2);
-    float* resultMatrix = createMatrix(shapeX1, shapeY2);
+    float* firstMatrix   = createMatrix(shapeX1, shapeY1);
+    float* secondMatrix  = createMatrix(shapeX2, shapeY2);
+    float* expectedMatrix = createMatrix(shapeX1, shapeY2);
+    float* resultMatrix  = createMatrix(shapeX1, shapeY2);
 
     randomMatrix(firstMatrix, shapeX1, shapeY1);
     randomMatrix(secondMatrix, shapeX2, shapeY2);
 
-    float* secondMatrixT = createMatrix(shapeX2, shapeY2);
-    transpose(secondMatrix, secondMatrixT, shapeX2, shapeY2);
-
     auto startSEQ = std::chrono::steady_clock::now();
-    mulMatrixSeq(firstMatrix, shapeX1, shapeY1, secondMatrix, shapeX2, shapeY2, resultMatrix);
+    mulMatrixSeq(firstMatrix, shapeX1, shapeY1, secondMatrix, shapeX2, shapeY2, expectedMatrix);
     auto endSEQ = std::chrono::steady_clock::now();
     auto elapsedSEQ = std::chrono::duration_cast<std::chrono::microseconds>(endSEQ - startSEQ);
 
     auto startMP = std::chrono::steady_clock::now();
-    mulMatrix(firstMatrix, shapeX1, shapeY1, secondMatrixT, shapeX2, shapeY2, resultMatrix);
+    mulMatrix(firstMatrix, shapeX1, shapeY1, secondMatrix, shapeX2, shapeY2, resultMatrix);
     auto endMP = std::chrono::steady_clock::now();
     auto elapsedMP = std::chrono::duration_cast<std::chrono::microseconds>(endMP - startMP);
 
+    if (!check(expectedMatrix, resultMatrix, shapeX1, shapeY2)) {
+        return 1;
+    }
+
+    std::cout << "Threads: " << omp_get_max_threads() << ", kernel: " << gemmKernelName() << std::endl;
     std::cout << "TimeSEQ: " << elapsedSEQ.count() << "mc (" << (elapsedSEQ.count() / 1000000.0) << " s)." << std::endl;
     std::cout << "TimeMP: " << elapsedMP.count() << "mc (" << (elapsedMP.count() / 1000000.0) << " s)." << std::endl;
     std::cout << "Speed up :" << ((float)elapsedSEQ.count() / elapsedMP.count()) << std::endl;
+    std::cout << "GFLOPS: " << 2.0 * shapeX1 * shapeY1 * shapeY2 / (elapsedMP.count() * 1000.0) << std::endl;
 
     //printMatrix("result", resultMatrix, shapeX1, shapeY2);
 
     clearMatrix(firstMatrix);
     clearMatrix(secondMatrix);
-    clearMatrix(secondMatrixT);
+    clearMatrix(expectedMatrix);
     clearMatrix(resultMatrix);
     return 0;
-}
\ No newline at end of file
+}
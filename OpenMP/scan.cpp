@@ -0,0 +1,116 @@
+#include "scan.h"
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// below this the threads cost more than they save
+constexpr size_t PARALLEL_MIN = 1 << 15;
+// block boundaries stay aligned to whole vectors
+constexpr size_t BLOCK_ALIGN = 16;
+
+// out[0:n] = offset + inclusive scan of in[0:n].
+#if defined(__AVX512F__)
+template<int shift>
+__m512 shiftUp(__m512 x) {
+    // elements move up by shift, zeros come in from below
+    return _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(x), _mm512_setzero_si512(), 16 - shift));
+}
+
+size_t scanVectors(const float* in, float* out, size_t n, float& offset) {
+    __m512 carry = _mm512_set1_ps(offset);
+    const __m512i last = _mm512_set1_epi32(15);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 x = _mm512_loadu_ps(in + i);
+        x = _mm512_add_ps(x, shiftUp<1>(x));
+        x = _mm512_add_ps(x, shiftUp<2>(x));
+        x = _mm512_add_ps(x, shiftUp<4>(x));
+        x = _mm512_add_ps(x, shiftUp<8>(x));
+        x = _mm512_add_ps(x, carry);
+        _mm512_storeu_ps(out + i, x);
+        carry = _mm512_permutexvar_ps(last, x);
+    }
+    offset = _mm512_cvtss_f32(carry);
+    return i;
+}
+#elif defined(__AVX2__)
+size_t scanVectors(const float* in, float* out, size_t n, float& offset) {
+    __m256 carry = _mm256_set1_ps(offset);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        // scan inside both 128-bit lanes ...
+        x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+        x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+        // ... then add the total of the low lane to the high one
+        __m256 low = _mm256_permute_ps(x, _MM_SHUFFLE(3, 3, 3, 3));
+        x = _mm256_add_ps(x, _mm256_permute2f128_ps(low, low, 0x08));
+        x = _mm256_add_ps(x, carry);
+        _mm256_storeu_ps(out + i, x);
+        __m256 high = _mm256_permute_ps(x, _MM_SHUFFLE(3, 3, 3, 3));
+        carry = _mm256_permute2f128_ps(high, high, 0x11);
+    }
+    offset = _mm256_cvtss_f32(carry);
+    return i;
+}
+#else
+size_t scanVectors(const float*, float*, size_t, float&) {
+    return 0;
+}
+#endif
+
+void scanBlock(const float* in, float* out, size_t n, float offset) {
+    size_t i = scanVectors(in, out, n, offset);
+    for (; i < n; ++i) {
+        offset += in[i];
+        out[i] = offset;
+    }
+}
+
+}
+
+void inclusiveScan(const float* in, float* out, size_t n) {
+    if (n < PARALLEL_MIN || omp_get_max_threads() == 1) {
+        scanBlock(in, out, n, 0.0f);
+        return;
+    }
+    // sums[t + 1] is the sum of block t, then the sum of the blocks up to t
+    std::vector<float> sums(omp_get_max_threads() + 1, 0.0f);
+#pragma omp parallel
+    {
+        size_t thread = omp_get_thread_num();
+        size_t threads = omp_get_num_threads();
+        size_t block = (n + threads - 1) / threads;
+        block = (block + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+        size_t begin = std::min(n, thread * block);
+        size_t end = std::min(n, begin + block);
+
+        float sum = 0.0f;
+#pragma omp simd reduction(+:sum)
+        for (size_t i = begin; i < end; ++i) {
+            sum += in[i];
+        }
+        sums[thread + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+        for (size_t t = 1; t <= threads; ++t) {
+            sums[t] += sums[t - 1];
+        }
+        scanBlock(in + begin, out + begin, end - begin, sums[thread]);
+    }
+}
+
+const char* scanKernelName() {
+#if defined(__AVX512F__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#else
+    return "scalar";
+#endif
+}
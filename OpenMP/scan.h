@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+
+// out[i] = in[0] + ... + in[i]. in and out may be the same array.
+//
+// Two passes over per-thread blocks: every thread sums its block, the block sums are scanned,
+// then every thread scans its block starting from the sum of the blocks before it.
+// The second pass scans 16 (AVX-512) or 8 (AVX2) elements in registers with shifted adds,
+// a scalar loop otherwise. Small arrays are scanned by the calling thread.
+void inclusiveScan(const float* in, float* out, size_t n);
+
+// Name of the in-register scan the engine was built with.
+const char* scanKernelName();
@@ -0,0 +1,167 @@
+#include "spmm.h"
+#include "gemm.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <omp.h>
+
+namespace {
+
+// columns of C per block, the block of a row of C stays in L1 while the rows of B are added to it
+constexpr size_t NB = 1024;
+// parts per thread, so that rows much longer than the average don't leave the other threads idle
+constexpr size_t PARTS_PER_THREAD = 4;
+
+// First row of every part and rows at the end. A row costs its nonzeros plus one for writing it,
+// so the cost of rows [0, i) is rowStart[i] + i and the parts are cut where it passes multiples of total / parts.
+std::vector<size_t> balancedRows(const CsrMatrix& A, size_t parts) {
+    size_t total = A.nonZeros() + A.rows;
+    std::vector<size_t> res(parts + 1, A.rows);
+    res[0] = 0;
+    for (size_t part = 1; part < parts; ++part) {
+        size_t target = total * part / parts;
+        size_t low = res[part - 1];
+        size_t high = A.rows;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (A.rowStart[mid] + mid < target) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        res[part] = low;
+    }
+    return res;
+}
+
+// The crossover is measured on CALIBRATION_SIZE square matrices: gemm once, spmm at the two densities,
+// the best of CALIBRATION_REPEATS runs each. The spmm time grows linearly with the nonzeros.
+constexpr size_t CALIBRATION_SIZE = 1024;
+constexpr double CALIBRATION_LOW = 0.02;
+constexpr double CALIBRATION_HIGH = 0.2;
+constexpr int CALIBRATION_REPEATS = 3;
+
+template<typename Function>
+double bestTime(Function run) {
+    double best = -1.0;
+    for (int i = 0; i < CALIBRATION_REPEATS; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (best < 0 || time < best) best = time;
+    }
+    return best;
+}
+
+double calibrateMaxDensity() {
+    size_t n = CALIBRATION_SIZE;
+    std::vector<float> A(n * n), B(n * n), C(n * n);
+    std::minstd_rand random(12345);
+    std::uniform_real_distribution<float> values(-1.0f, 1.0f);
+    std::uniform_real_distribution<double> positions(0.0, 1.0);
+    for (size_t i = 0; i < n * n; ++i) {
+        A[i] = values(random);
+        B[i] = values(random);
+    }
+    double dense = bestTime([&]() { gemm(n, n, n, A.data(), n, B.data(), n, C.data(), n); });
+
+    double times[2];
+    const double densities[2] = { CALIBRATION_LOW, CALIBRATION_HIGH };
+    for (int d = 0; d < 2; ++d) {
+        for (size_t i = 0; i < n * n; ++i) {
+            A[i] = positions(random) < densities[d] ? values(random) : 0.0f;
+        }
+        CsrMatrix sparse = denseToCsr(n, n, A.data(), n);
+        times[d] = bestTime([&]() { spmm(sparse, n, B.data(), n, C.data(), n); });
+    }
+    double slope = (times[1] - times[0]) / (CALIBRATION_HIGH - CALIBRATION_LOW);
+    if (slope <= 0) {
+        return times[1] < dense ? CALIBRATION_HIGH : 0.0;
+    }
+    double crossover = CALIBRATION_LOW + (dense - times[0]) / slope;
+    return std::min(1.0, std::max(0.0, crossover));
+}
+
+}
+
+double spmmMaxDensity() {
+    static const double density = calibrateMaxDensity();
+    return density;
+}
+
+double CsrMatrix::density() const {
+    return rows == 0 || cols == 0 ? 0.0 : static_cast<double>(nonZeros()) / (static_cast<double>(rows) * cols);
+}
+
+CsrMatrix denseToCsr(size_t M, size_t K, const float* A, size_t lda) {
+    CsrMatrix res;
+    res.rows = M;
+    res.cols = K;
+    res.rowStart.resize(M + 1);
+    for (size_t i = 0; i < M; ++i) {
+        res.rowStart[i] = static_cast<uint32_t>(res.values.size());
+        for (size_t k = 0; k < K; ++k) {
+            if (A[i * lda + k] != 0.0f) {
+                res.columns.push_back(static_cast<uint32_t>(k));
+                res.values.push_back(A[i * lda + k]);
+            }
+        }
+    }
+    res.rowStart[M] = static_cast<uint32_t>(res.values.size());
+    return res;
+}
+
+size_t countNonZeros(size_t M, size_t K, const float* A, size_t lda) {
+    size_t res = 0;
+    #pragma omp parallel for reduction(+:res) schedule(static)
+    for (size_t i = 0; i < M; ++i) {
+        for (size_t k = 0; k < K; ++k) {
+            res += A[i * lda + k] != 0.0f;
+        }
+    }
+    return res;
+}
+
+void spmm(const CsrMatrix& A, size_t N, const float* B, size_t ldb, float* C, size_t ldc) {
+    if (A.rows == 0 || N == 0) {
+        return;
+    }
+    size_t parts = static_cast<size_t>(omp_get_max_threads()) * PARTS_PER_THREAD;
+    std::vector<size_t> bounds = balancedRows(A, parts);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t part = 0; part < parts; ++part) {
+        for (size_t jc = 0; jc < N; jc += NB) {
+            size_t nb = std::min(NB, N - jc);
+            for (size_t i = bounds[part]; i < bounds[part + 1]; ++i) {
+                float* c = C + i * ldc + jc;
+                std::fill(c, c + nb, 0.0f);
+                for (uint32_t p = A.rowStart[i]; p < A.rowStart[i + 1]; ++p) {
+                    float value = A.values[p];
+                    const float* b = B + A.columns[p] * ldb + jc;
+                    #pragma omp simd
+                    for (size_t j = 0; j < nb; ++j) {
+                        c[j] += value * b[j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool preferSparse(size_t M, size_t K, size_t nonZeros, double maxDensity) {
+    return M != 0 && K != 0 && static_cast<double>(nonZeros) < maxDensity * static_cast<double>(M) * K;
+}
+
+bool gemmAuto(size_t M, size_t N, size_t K,
+              const float* A, size_t lda,
+              const float* B, size_t ldb,
+              float* C, size_t ldc, double maxDensity) {
+    if (!preferSparse(M, K, countNonZeros(M, K, A, lda), maxDensity)) {
+        gemm(M, N, K, A, lda, B, ldb, C, ldc);
+        return false;
+    }
+    spmm(denseToCsr(M, K, A, lda), N, B, ldb, C, ldc);
+    return true;
+}
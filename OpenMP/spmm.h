@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Sparse matrix in compressed sparse row form. 32-bit indices, the same arrays go to OpenCL as they are.
+struct CsrMatrix {
+    size_t rows { 0 };
+    size_t cols { 0 };
+    // rowStart[i] is the index of the first nonzero of row i and rowStart[rows] the number of nonzeros:
+    // the exclusive prefix sum of the row lengths
+    std::vector<uint32_t> rowStart;
+    std::vector<uint32_t> columns;
+    std::vector<float>    values;
+
+    size_t nonZeros() const { return values.size(); }
+    double density() const;
+};
+
+// The nonzeros of the dense row-major M x K matrix A.
+CsrMatrix denseToCsr(size_t M, size_t K, const float* A, size_t lda);
+
+size_t countNonZeros(size_t M, size_t K, const float* A, size_t lda);
+
+// C = A * B for a sparse A (M x K) and row-major B (K x N) and C (M x N).
+// Every row of C is the sum of the rows of B picked by the nonzeros of the row of A, N columns at a time
+// in blocks that stay in L1. The rows are split between the threads by the prefix sum of their lengths
+// (rowStart), so every thread gets about the same number of nonzeros however the rows vary.
+void spmm(const CsrMatrix& A, size_t N, const float* B, size_t ldb, float* C, size_t ldc);
+
+// Density of A below which spmm is faster than gemm with the OpenMP threads of this process.
+// Measured on the first call, like ScanDispatcher calibrates its threshold, by gemm and spmm of 1024 x 1024
+// matrices, which takes a fraction of a second. gemm scales with the cores better than the memory-bound
+// spmm, so the crossover falls as the threads grow (about 12% with one thread).
+double spmmMaxDensity();
+
+// Whether an M x K matrix with nonZeros nonzeros should be multiplied as sparse.
+bool preferSparse(size_t M, size_t K, size_t nonZeros, double maxDensity = spmmMaxDensity());
+
+// C = A * B for a dense row-major A that may be mostly zeros: A is counted, and converted to CSR
+// and multiplied by spmm if preferSparse, multiplied by gemm otherwise. Returns whether spmm was used.
+bool gemmAuto(size_t M, size_t N, size_t K,
+              const float* A, size_t lda,
+              const float* B, size_t ldb,
+              float* C, size_t ldc, double maxDensity = spmmMaxDensity());
@@ -1,25 +1,199 @@
-kernel void tiles_pref_sums(global const float* elements, global float* res, global const size_t* size) {
+// LOCAL_GROUP_SIZE is a power of two.
+// One work-group scans a tile of LOCAL_GROUP_SIZE * ELEMENTS elements.
+#define TILE_SIZE (LOCAL_GROUP_SIZE * ELEMENTS)
+
+// The variant is chosen by build options:
+// T is the element type, SCAN_OP the operator and IDENTITY its neutral element for T,
+// EXCLUSIVE makes element i the result of the elements before i,
+// SEGMENTED restarts the scan at every element with a nonzero head flag.
+#define SCAN_SUM 0
+#define SCAN_MIN 1
+#define SCAN_MAX 2
+#ifdef SCAN_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+#ifndef T
+#define T float
+#endif
+#ifndef SCAN_OP
+#define SCAN_OP SCAN_SUM
+#endif
+#if SCAN_OP == SCAN_MIN
+#define OP(a, b) min(a, b)
+#elif SCAN_OP == SCAN_MAX
+#define OP(a, b) max(a, b)
+#else
+#define OP(a, b) ((a) + (b))
+#endif
+#ifndef IDENTITY
+#define IDENTITY 0
+#endif
+#ifndef EXCLUSIVE
+#define EXCLUSIVE 0
+#endif
+#ifndef SEGMENTED
+#define SEGMENTED 0
+#endif
+
+// Scan of every tile. The inclusive total of the tile goes to sums[group].
+// Elements past size are read as IDENTITY, so size doesn't have to be a multiple of TILE_SIZE.
+// elements and res may be the same buffer.
+// Segmented: flags are the head flags of the elements, sum_flags[group] tells whether the tile has a head,
+// first_head[group] is the index of its first head in the tile (TILE_SIZE if none).
+// The tile totals with sum_flags are again a segmented scan input.
+kernel void tiles_pref_sums(global const T* elements, global T* res, global T* sums, const uint size
+#if SEGMENTED
+                            , global const uchar* flags, global uchar* sum_flags, global uint* first_head
+#endif
+                            ) {
     size_t loc_id = get_local_id(0);
-    size_t id = get_global_id(0);
-    local float loc[LOCAL_GROUP_SIZE];
-    loc[loc_id] = elements[id];
-    for (size_t shift = 1; shift < LOCAL_GROUP_SIZE; shift *= 2) {
-        float add = 0.0;
+    size_t group = get_group_id(0);
+    size_t base = group * TILE_SIZE;
+
+    local T tile[TILE_SIZE];
+    local T part[LOCAL_GROUP_SIZE];
+#if SEGMENTED
+    local uchar tile_flags[TILE_SIZE];
+    local uchar part_flags[LOCAL_GROUP_SIZE];
+#endif
+
+    // coalesced load of the tile
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        tile[ind] = base + ind < size ? elements[base + ind] : (T)(IDENTITY);
+#if SEGMENTED
+        tile_flags[ind] = base + ind < size && flags[base + ind] != 0;
+#endif
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // serial scan of the run owned by this work-item
+    T acc = IDENTITY;
+#if SEGMENTED
+    uchar run_flag = 0;
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = loc_id * ELEMENTS + elem;
+        acc = tile_flags[ind] ? tile[ind] : OP(acc, tile[ind]);
+        run_flag |= tile_flags[ind];
+        tile[ind] = acc;
+    }
+    part_flags[loc_id] = run_flag;
+#else
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        acc = OP(acc, tile[loc_id * ELEMENTS + elem]);
+        tile[loc_id * ELEMENTS + elem] = acc;
+    }
+#endif
+    part[loc_id] = acc;
+
+    // exclusive scan of the run totals: up-sweep ...
+    // With segments the totals are (flag, value) pairs, a pair with a head discards the values before it.
+    for (size_t stride = 1; stride < LOCAL_GROUP_SIZE; stride *= 2) {
         barrier(CLK_LOCAL_MEM_FENCE);
-        if (shift <= loc_id) {
-            add = loc[loc_id - shift];
+        size_t ind = (loc_id + 1) * stride * 2 - 1;
+        if (ind < LOCAL_GROUP_SIZE) {
+#if SEGMENTED
+            part[ind] = part_flags[ind] ? part[ind] : OP(part[ind - stride], part[ind]);
+            part_flags[ind] |= part_flags[ind - stride];
+#else
+            part[ind] = OP(part[ind - stride], part[ind]);
+#endif
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (loc_id == 0) {
+        sums[group] = part[LOCAL_GROUP_SIZE - 1];
+        part[LOCAL_GROUP_SIZE - 1] = IDENTITY;
+#if SEGMENTED
+        sum_flags[group] = part_flags[LOCAL_GROUP_SIZE - 1];
+        if (!part_flags[LOCAL_GROUP_SIZE - 1]) {
+            first_head[group] = TILE_SIZE;
         }
+        part_flags[LOCAL_GROUP_SIZE - 1] = 0;
+#endif
+    }
+    // ... and down-sweep
+    for (size_t stride = LOCAL_GROUP_SIZE / 2; stride > 0; stride /= 2) {
         barrier(CLK_LOCAL_MEM_FENCE);
-        loc[loc_id] += add;
+        size_t ind = (loc_id + 1) * stride * 2 - 1;
+        if (ind < LOCAL_GROUP_SIZE) {
+            T left = part[ind - stride];
+            part[ind - stride] = part[ind];
+#if SEGMENTED
+            uchar left_flag = part_flags[ind - stride];
+            part_flags[ind - stride] = part_flags[ind];
+            part[ind] = left_flag ? left : OP(part[ind], left);
+            part_flags[ind] |= left_flag;
+#else
+            part[ind] = OP(part[ind], left);
+#endif
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // the offset of the previous runs reaches the elements up to the first head of the run
+    T offset = part[loc_id];
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = loc_id * ELEMENTS + elem;
+#if SEGMENTED
+        if (tile_flags[ind]) {
+            // part_flags now tells whether a previous run has a head
+            if (!part_flags[loc_id]) {
+                first_head[group] = ind;
+            }
+            break;
+        }
+#endif
+        tile[ind] = OP(offset, tile[ind]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        if (base + ind < size) {
+#if EXCLUSIVE && SEGMENTED
+            res[base + ind] = ind == 0 || tile_flags[ind] ? (T)(IDENTITY) : tile[ind - 1];
+#elif EXCLUSIVE
+            res[base + ind] = ind == 0 ? (T)(IDENTITY) : tile[ind - 1];
+#else
+            res[base + ind] = tile[ind];
+#endif
+        }
     }
-    res[id] = loc[loc_id];
 }
 
-kernel void add_sums(global const float* sums, global float* res, global const size_t* size) {
-    size_t id = get_global_id(0);
-    float add = 0.0;
-    for (size_t i = LOCAL_GROUP_SIZE - 1; i < id; i += LOCAL_GROUP_SIZE) {
-        add += sums[i];
+// Adds the scanned totals of the previous tiles to every element of the tile,
+// with segments only to the elements before the first head of the tile.
+// sums holds the inclusive scan of the tile totals written by tiles_pref_sums.
+kernel void add_sums(global T* res, global const T* sums, const uint size
+#if SEGMENTED
+                     , global const uint* first_head
+#endif
+                     ) {
+    size_t group = get_group_id(0);
+    if (group == 0) {
+        return;
     }
-    res[id] = sums[id] + add;
-}
\ No newline at end of file
+    T add = sums[group - 1];
+#if SEGMENTED
+    size_t limit = first_head[group];
+#else
+    size_t limit = TILE_SIZE;
+#endif
+    size_t base = group * TILE_SIZE;
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + get_local_id(0);
+        if (ind < limit && base + ind < size) {
+            res[base + ind] = OP(add, res[base + ind]);
+        }
+    }
+}
+
+// Applies offset to the first size elements of res.
+// Used to join scans of consecutive parts computed on different devices.
+kernel void add_offset(global T* res, const T offset, const uint size) {
+    size_t ind = get_global_id(0);
+    if (ind < size) {
+        res[ind] = OP(offset, res[ind]);
+    }
+}
@@ -0,0 +1,266 @@
+// Compaction and LSD radix sort. Both work per tile of LOCAL_GROUP_SIZE * ELEMENTS elements:
+// a first kernel counts the tile, the counts of all tiles are scanned by the scan of function_pref_sum.cl,
+// and a second kernel writes every element of the tile at the offset of its tile plus its rank in the tile.
+// LOCAL_GROUP_SIZE is a power of two. Work-item i owns the ELEMENTS consecutive elements of the tile
+// from i * ELEMENTS, so ranks follow the order of the elements and both operations are stable.
+#define TILE_SIZE (LOCAL_GROUP_SIZE * ELEMENTS)
+
+// Compaction keeps the elements of type T for which COMPARE(element, value) holds.
+#define COMPARE_LESS 0
+#define COMPARE_LESS_EQUAL 1
+#define COMPARE_GREATER 2
+#define COMPARE_GREATER_EQUAL 3
+#define COMPARE_EQUAL 4
+#define COMPARE_NOT_EQUAL 5
+#ifdef SORT_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+#ifndef T
+#define T float
+#endif
+#ifndef COMPARE
+#define COMPARE COMPARE_NOT_EQUAL
+#endif
+#if COMPARE == COMPARE_LESS
+#define KEEP(x) ((x) < value)
+#elif COMPARE == COMPARE_LESS_EQUAL
+#define KEEP(x) ((x) <= value)
+#elif COMPARE == COMPARE_GREATER
+#define KEEP(x) ((x) > value)
+#elif COMPARE == COMPARE_GREATER_EQUAL
+#define KEEP(x) ((x) >= value)
+#elif COMPARE == COMPARE_EQUAL
+#define KEEP(x) ((x) == value)
+#else
+#define KEEP(x) ((x) != value)
+#endif
+
+// The radix sort orders unsigned KEY values by RADIX_BITS per pass, VALUE is the type of the values
+// moved with the keys, if any.
+#ifndef KEY
+#define KEY uint
+#endif
+#define RADIX_BITS 4
+#define RADIX (1 << RADIX_BITS)
+#define DIGIT(key) ((uint)((key) >> shift) & (RADIX - 1))
+#ifdef VALUE
+#define VALUE_PARAMS , global const VALUE* values, global VALUE* values_out
+#else
+#define VALUE_PARAMS
+#endif
+
+// Exclusive scan of the LOCAL_GROUP_SIZE * run values of data in place, work-item i scans
+// the run values from i * run, then the totals of the runs are scanned in part (LOCAL_GROUP_SIZE values)
+// as in tiles_pref_sums. Returns the total of data to every work-item.
+uint local_exclusive_scan(local uint* data, local uint* part, const uint run) {
+    size_t loc_id = get_local_id(0);
+    // data may come from any work-item
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint acc = 0;
+    for (uint i = 0; i < run; ++i) {
+        uint value = data[loc_id * run + i];
+        data[loc_id * run + i] = acc;
+        acc += value;
+    }
+    part[loc_id] = acc;
+
+    for (size_t stride = 1; stride < LOCAL_GROUP_SIZE; stride *= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        size_t ind = (loc_id + 1) * stride * 2 - 1;
+        if (ind < LOCAL_GROUP_SIZE) {
+            part[ind] += part[ind - stride];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint total = part[LOCAL_GROUP_SIZE - 1];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (loc_id == 0) {
+        part[LOCAL_GROUP_SIZE - 1] = 0;
+    }
+    for (size_t stride = LOCAL_GROUP_SIZE / 2; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        size_t ind = (loc_id + 1) * stride * 2 - 1;
+        if (ind < LOCAL_GROUP_SIZE) {
+            uint left = part[ind - stride];
+            part[ind - stride] = part[ind];
+            part[ind] += left;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint offset = part[loc_id];
+    for (uint i = 0; i < run; ++i) {
+        data[loc_id * run + i] += offset;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return total;
+}
+
+// Number of kept elements of every tile into counts[group].
+kernel void compact_counts(global const T* elements, global uint* counts, const uint size, const T value) {
+    size_t loc_id = get_local_id(0);
+    size_t group = get_group_id(0);
+    size_t base = group * TILE_SIZE;
+
+    local uint runs[LOCAL_GROUP_SIZE];
+    local uint part[LOCAL_GROUP_SIZE];
+
+    uint count = 0;
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        count += base + ind < size && KEEP(elements[base + ind]);
+    }
+    runs[loc_id] = count;
+    uint total = local_exclusive_scan(runs, part, 1);
+    if (loc_id == 0) {
+        counts[group] = total;
+    }
+}
+
+// Copies the kept elements of the tile to res from offsets[group], the exclusive scan of counts.
+// The last tile writes the number of kept elements to count[0].
+kernel void compact_scatter(global const T* elements, global T* res, global const uint* offsets,
+                            global uint* count, const uint size, const T value) {
+    size_t loc_id = get_local_id(0);
+    size_t group = get_group_id(0);
+    size_t base = group * TILE_SIZE;
+
+    local T tile[TILE_SIZE];
+    local uint runs[LOCAL_GROUP_SIZE];
+    local uint part[LOCAL_GROUP_SIZE];
+
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        if (base + ind < size) {
+            tile[ind] = elements[base + ind];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // the run of the work-item moves to registers, the kept elements go back to the front of the tile
+    T run[ELEMENTS];
+    uint kept = 0;
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = loc_id * ELEMENTS + elem;
+        run[elem] = tile[ind];
+        kept += base + ind < size && KEEP(run[elem]);
+    }
+    runs[loc_id] = kept;
+    uint total = local_exclusive_scan(runs, part, 1);
+
+    uint pos = runs[loc_id];
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        if (base + loc_id * ELEMENTS + elem < size && KEEP(run[elem])) {
+            tile[pos++] = run[elem];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint offset = offsets[group];
+    for (size_t ind = loc_id; ind < total; ind += LOCAL_GROUP_SIZE) {
+        res[offset + ind] = tile[ind];
+    }
+    if (loc_id == 0 && group == get_num_groups(0) - 1) {
+        count[0] = offset + total;
+    }
+}
+
+// Digit counts of every tile for the pass at shift, digit-major: histograms[digit * groups + group].
+// The exclusive scan of histograms is the first position of every digit of every tile in the output.
+kernel void radix_histogram(global const KEY* keys, global uint* histograms, const uint size, const uint shift) {
+    size_t loc_id = get_local_id(0);
+    size_t group = get_group_id(0);
+    size_t base = group * TILE_SIZE;
+
+    local uint counts[RADIX];
+    for (size_t digit = loc_id; digit < RADIX; digit += LOCAL_GROUP_SIZE) {
+        counts[digit] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        if (base + ind < size) {
+            atomic_inc(&counts[DIGIT(keys[base + ind])]);
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (size_t digit = loc_id; digit < RADIX; digit += LOCAL_GROUP_SIZE) {
+        histograms[digit * get_num_groups(0) + group] = counts[digit];
+    }
+}
+
+// One pass: every key of the tile (and its value) goes to offsets[digit * groups + group] plus the number
+// of keys of the tile before it with the same digit. The tile is first sorted by the digit in local memory,
+// so the keys of a digit are written to consecutive addresses.
+kernel void radix_scatter(global const KEY* keys, global KEY* keys_out VALUE_PARAMS,
+                          global const uint* offsets, const uint size, const uint shift) {
+    size_t loc_id = get_local_id(0);
+    size_t group = get_group_id(0);
+    size_t groups = get_num_groups(0);
+    size_t base = group * TILE_SIZE;
+
+    local KEY tile[TILE_SIZE];
+#ifdef VALUE
+    local VALUE tile_values[TILE_SIZE];
+#endif
+    // digit-major counts of the runs: counts[digit * LOCAL_GROUP_SIZE + work-item]
+    local uint counts[RADIX * LOCAL_GROUP_SIZE];
+    local uint part[LOCAL_GROUP_SIZE];
+
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        if (base + ind < size) {
+            tile[ind] = keys[base + ind];
+#ifdef VALUE
+            tile_values[ind] = values[base + ind];
+#endif
+        }
+    }
+    for (size_t digit = 0; digit < RADIX; ++digit) {
+        counts[digit * LOCAL_GROUP_SIZE + loc_id] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    KEY run[ELEMENTS];
+#ifdef VALUE
+    VALUE run_values[ELEMENTS];
+#endif
+    size_t valid = base + TILE_SIZE <= size ? TILE_SIZE : size - base;
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = loc_id * ELEMENTS + elem;
+        if (ind < valid) {
+            run[elem] = tile[ind];
+#ifdef VALUE
+            run_values[elem] = tile_values[ind];
+#endif
+            ++counts[DIGIT(run[elem]) * LOCAL_GROUP_SIZE + loc_id];
+        }
+    }
+    // counts becomes the position of the first key of every run and digit in the sorted tile
+    local_exclusive_scan(counts, part, RADIX);
+
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        if (loc_id * ELEMENTS + elem < valid) {
+            uint pos = counts[DIGIT(run[elem]) * LOCAL_GROUP_SIZE + loc_id]++;
+            tile[pos] = run[elem];
+#ifdef VALUE
+            tile_values[pos] = run_values[elem];
+#endif
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // counts[digit * LOCAL_GROUP_SIZE - 1] is now the end of the previous digit in the sorted tile
+    for (size_t elem = 0; elem < ELEMENTS; ++elem) {
+        size_t ind = elem * LOCAL_GROUP_SIZE + loc_id;
+        if (ind < valid) {
+            uint digit = DIGIT(tile[ind]);
+            uint start = digit == 0 ? 0 : counts[digit * LOCAL_GROUP_SIZE - 1];
+            size_t pos = offsets[digit * groups + group] + ind - start;
+            keys_out[pos] = tile[ind];
+#ifdef VALUE
+            values_out[pos] = tile_values[ind];
+#endif
+        }
+    }
+}
@@ -1,9 +1,15 @@
 #include <cstdio>
+#include <cstdint>
 #include <cstdlib>
 #include <chrono>
 #include <cstring>
-#include <cmath>
+#include <string>
+#include <vector>
 #include "../utils.h"
+#include "pref_sum.h"
+#include "scan.h"
+#include "scan_dispatch.h"
+#include "trace.h"
 
 void init_rand_array(float* array, size_t size) {
     for (size_t i = 0; i < size; ++i) {
@@ -30,80 +36,100 @@ void print_array(const char* prefix, float* array, size_t size) {
     printf("\n");
 }
 
-int main() {
-    srand(time(nullptr));
-    std::shared_ptr<Environment> params(new Environment());
-    params->localWorkSize = 256;
-    size_t cnt = get_nearest_up(1000000, params->localWorkSize);
-    auto* array  = alloc_array<float>(cnt);
-    init_rand_array(array, cnt);
-    auto* result_array = alloc_array<float>(cnt);
-
-    init(params);
-    create_context(params);
-    read_and_build("function_pref_sum.cl", params,
-            "-D LOCAL_GROUP_SIZE=" + std::to_string(params->localWorkSize) +
-                  " -D ELEMENTS=" + std::to_string(params->elementsOneThread));
-
-    params->kernelsCount = 2;
-    params->kernels = static_cast<cl_kernel*>(malloc(sizeof(cl_kernel) * params->kernelsCount));
-    params->kernels[0] = clCreateKernel(params->program, "tiles_pref_sums", nullptr);
+// Scans array into result_array with device buffers over both arrays.
+// On CPU devices they share the host memory, otherwise the data is copied.
+bool run(Runtime &runtime, const ScanKernels &kernels, float* array, float* result_array, size_t cnt) {
+    cl_command_queue queue = runtime.queue();
+    runtime.reset_copied_bytes();
 
     size_t size = cnt * sizeof(float);
-    // set arguments
-    cl_int result;
-    cl_mem arrayBuffer  = clCreateBuffer(params->context, CL_MEM_READ_ONLY,  size, nullptr, &result);
-    cl_mem sumsBuffer = clCreateBuffer(params->context, CL_MEM_READ_WRITE, size, nullptr, &result);
-
-    cl_mem sizeBuffer = clCreateBuffer(params->context, CL_MEM_READ_ONLY, sizeof(size_t), nullptr, &result);
-
-    clEnqueueWriteBuffer(params->commandQueue, arrayBuffer, CL_TRUE, 0, size, array, 0, nullptr, nullptr);
-    clEnqueueWriteBuffer(params->commandQueue, sizeBuffer,  CL_TRUE, 0, sizeof(size_t), &size, 0, nullptr,
-                         nullptr);
+    HostBuffer arrayBuffer(runtime, array, size, CL_MEM_READ_ONLY);
+    HostBuffer resultBuffer(runtime, result_array, size, CL_MEM_READ_WRITE);
+    arrayBuffer.upload(queue);
+    resultBuffer.upload(queue);
+
+    // device copy of the same data as the bandwidth baseline
+    Event copyEvent;
+    TracedEvent traced(copyEvent.out(), TraceKind::Copy, "baseline copy", 2.0 * size);
+    traced.done(clEnqueueCopyBuffer(queue, arrayBuffer.get(), resultBuffer.get(), 0, 0, size, 0, nullptr,
+                                    traced.out()));
+    clWaitForEvents(1, copyEvent.address());
+    double copyTime = event_time(copyEvent.get());
 
-    clSetKernelArg(params->kernels[0], 0, sizeof(cl_mem), &arrayBuffer);
-    clSetKernelArg(params->kernels[0], 1, sizeof(cl_mem), &sumsBuffer);
-    clSetKernelArg(params->kernels[0], 2, sizeof(cl_mem), &sizeBuffer);
-
-    params->kernels[1] = clCreateKernel(params->program, "add_sums", nullptr);
-    cl_mem resultBuffer = clCreateBuffer(params->context, CL_MEM_READ_WRITE, size, nullptr, &result);
-    clSetKernelArg(params->kernels[1], 0, sizeof(cl_mem), &sumsBuffer);
-    clSetKernelArg(params->kernels[1], 1, sizeof(cl_mem), &resultBuffer);
-    clSetKernelArg(params->kernels[1], 2, sizeof(cl_mem), &sizeBuffer);
-
-    cl_event event;
-    cl_ulong time_start;
-    cl_ulong time_end;
-    double time = 0.0;
     // execution
-    constexpr size_t workDims = 1;
-    size_t globalWorkSize[workDims] = { cnt };
-    size_t localWorkSize[workDims]  = { params->localWorkSize };
+    std::vector<Event> events;
+    std::vector<PooledBuffer> buffers;
+    cl_int res = scan(runtime, queue, kernels, arrayBuffer.get(), resultBuffer.get(), static_cast<cl_uint>(cnt),
+                      events, buffers);
+    clFinish(queue);
+    if (res != CL_SUCCESS) {
+        printf("Can't run the scan. Error: %d\n", res);
+        return false;
+    }
 
-    for (size_t i = 0; i < params->kernelsCount; ++i) {
-        result = clEnqueueNDRangeKernel(params->commandQueue, params->kernels[i], workDims, nullptr, globalWorkSize,
-                                        localWorkSize, 0, nullptr, &event);
+    double time = 0.0;
+    for (const Event& event : events) {
+        time += event_time(event.get());
+    }
 
-        clWaitForEvents(1, &event);
-        clFinish(params->commandQueue);
+    resultBuffer.download(queue);
+    printf("Zero-copy: %s. Bytes copied: %zu.\n", resultBuffer.zeroCopy() ? "yes" : "no", runtime.copied_bytes());
 
-        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, nullptr);
-        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, nullptr);
-        time += time_end - time_start;
+    if (!check(result_array, array, cnt)) {
+//        print_array("array", array, cnt);
+//        print_array("result", result_array, cnt);
+        return false;
     }
+    // every element is read once and written once
+    printf("Time: %f seconds.\n", time / 1e9);
+    printf("GB/s: %f.\n", 2.0 * size / time);
+    printf("Copy GB/s: %f.\n", 2.0 * size / copyTime);
+    return true;
+}
+
+int main() {
+    srand(time(nullptr));
+    size_t cnt = 1000000;
+    auto* array  = alloc_array<float>(cnt);
+    init_rand_array(array, cnt);
+    auto* result_array = alloc_array<float>(cnt);
 
-    result = clEnqueueReadBuffer(params->commandQueue, resultBuffer, CL_TRUE, 0, size, result_array, 0, nullptr,
-                                 nullptr);
+    Runtime& runtime = Runtime::instance();
+    if (!runtime.valid()) {
+        return EXIT_FAILURE;
+    }
+    ScanKernels kernels;
+    if (!load_scan_kernels(runtime, kernels)) {
+        return EXIT_FAILURE;
+    }
+    bool ok = run(runtime, kernels, array, result_array, cnt);
+
+    // the same scan on the CPU engine
+    std::memset(result_array, 0, cnt * sizeof(float));
+    auto start = std::chrono::steady_clock::now();
+    inclusiveScan(array, result_array, cnt);
+    double cpuTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!check(result_array, array, cnt)) {
+        ok = false;
+    } else {
+        printf("CPU (%s) time: %f seconds. GB/s: %f.\n", scanKernelName(), cpuTime,
+               2.0 * cnt * sizeof(float) / cpuTime / 1e9);
+    }
 
-    if (check(result_array, array, cnt)) {
-        printf("Time: %f seconds.\n", time / 1e9);
-        printf("GFLOPS: %f.\n", log2(cnt) * cnt / time);
+    ScanDispatcher dispatcher(&runtime);
+    for (const ScanDispatcher::Timing& timing : dispatcher.timings()) {
+        printf("Scan of %zu elements: CPU %f ms, OpenCL %f ms.\n", timing.size, timing.cpu * 1e3,
+               timing.opencl * 1e3);
+    }
+    if (dispatcher.threshold() == SIZE_MAX) {
+        printf("Dispatcher: CPU for every size.\n");
     } else {
-//        print_array("array", array, cnt);
-//        print_array("result", result_array, cnt);
+        printf("Dispatcher: OpenCL from %zu elements.\n", dispatcher.threshold());
     }
 
+    // OPENCL_TRACE=file.json writes the timeline of the run
+    Trace::instance().finish();
     clear_array(array);
     clear_array(result_array);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,321 @@
+#include "pref_sum.h"
+#include "../Runtime/numa.h"
+#include "../Runtime/trace.h"
+#include <cstdio>
+#include <string>
+#include <utility>
+
+namespace {
+
+const char* const TYPE_NAMES[] = { "float", "int", "long", "double" };
+const char* const OP_NAMES[] = { "sum", "min", "max" };
+
+// Neutral element of the operator for the type, in OpenCL C
+const char* identity(const ScanVariant& variant) {
+    if (variant.op == ScanOp::Sum) {
+        return "0";
+    }
+    bool min = variant.op == ScanOp::Min;
+    switch (variant.type) {
+        case ScanType::Int:  return min ? "INT_MAX" : "INT_MIN";
+        case ScanType::Long: return min ? "LONG_MAX" : "LONG_MIN";
+        default:             return min ? "INFINITY" : "-INFINITY";
+    }
+}
+
+std::string build_options(const ScanKernels& kernels, const ScanVariant& variant) {
+    return "-D LOCAL_GROUP_SIZE=" + std::to_string(kernels.localWorkSize) +
+           " -D ELEMENTS=" + std::to_string(kernels.elementsOneThread) + variant.options();
+}
+
+}
+
+size_t ScanVariant::elementSize() const {
+    switch (type) {
+        case ScanType::Int:    return sizeof(cl_int);
+        case ScanType::Long:   return sizeof(cl_long);
+        case ScanType::Double: return sizeof(cl_double);
+        default:               return sizeof(cl_float);
+    }
+}
+
+std::string ScanVariant::options() const {
+    std::string res = std::string(" -D T=") + TYPE_NAMES[static_cast<int>(type)] +
+                      " -D SCAN_OP=" + std::to_string(static_cast<int>(op)) +
+                      " -D IDENTITY=" + identity(*this) +
+                      " -D EXCLUSIVE=" + (exclusive ? "1" : "0") +
+                      " -D SEGMENTED=" + (segmented ? "1" : "0");
+    if (type == ScanType::Double) {
+        res += " -D SCAN_FP64";
+    }
+    return res;
+}
+
+std::string ScanVariant::name() const {
+    std::string res = std::string(TYPE_NAMES[static_cast<int>(type)]) + "-" + OP_NAMES[static_cast<int>(op)];
+    if (exclusive) res += "-exclusive";
+    if (segmented) res += "-segmented";
+    return res;
+}
+
+bool parse_scan_variant(const std::string& name, ScanVariant& variant) {
+    for (int type = 0; type < 4; ++type) {
+        for (int op = 0; op < 3; ++op) {
+            for (int kind = 0; kind < 4; ++kind) {
+                ScanVariant candidate;
+                candidate.type = static_cast<ScanType>(type);
+                candidate.op = static_cast<ScanOp>(op);
+                candidate.exclusive = (kind & 1) != 0;
+                candidate.segmented = (kind & 2) != 0;
+                if (candidate.name() == name) {
+                    variant = candidate;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool load_scan_kernels(Runtime &runtime, ScanKernels &kernels) {
+    if (kernels.variant.type == ScanType::Double && !runtime.info().fp64) {
+        printf("%s doesn't support double.\n", runtime.info().name.c_str());
+        return false;
+    }
+    std::string options = build_options(kernels, kernels.variant);
+    kernels.tiles = runtime.kernel("function_pref_sum.cl", options, "tiles_pref_sums");
+    kernels.add   = runtime.kernel("function_pref_sum.cl", options, "add_sums");
+    kernels.offset = runtime.kernel("function_pref_sum.cl", options, "add_offset");
+    kernels.totals = kernels.tiles;
+    if (kernels.variant.exclusive) {
+        ScanVariant inclusive = kernels.variant;
+        inclusive.exclusive = false;
+        kernels.totals = runtime.kernel("function_pref_sum.cl", build_options(kernels, inclusive),
+                                        "tiles_pref_sums");
+    }
+    return kernels.tiles != nullptr && kernels.totals != nullptr && kernels.add != nullptr &&
+           kernels.offset != nullptr;
+}
+
+namespace {
+
+// One level of the scan with the given tiles kernel; the totals are scanned by kernels.totals.
+// The tiles kernel waits for waitList, every later command for the one it needs,
+// so the level is ordered on out-of-order queues too. events.back() is its last command,
+// or an empty event if a temporary buffer can't be acquired or a kernel can't be enqueued.
+cl_int scan_level(Runtime &runtime, cl_command_queue queue, const ScanKernels &kernels, cl_kernel tiles,
+                cl_mem input, cl_mem output, cl_mem flags, cl_uint size, cl_uint waitCount, const cl_event* waitList,
+                std::vector<Event> &events, std::vector<PooledBuffer> &buffers) {
+    if (size == 0) {
+        // an empty range is not a valid NDRange, a marker keeps the scan chainable
+        events.emplace_back();
+        TracedEvent traced(events.back().out(), TraceKind::Marker, "scan");
+        return traced.done(clEnqueueMarkerWithWaitList(queue, waitCount, waitList, traced.out()));
+    }
+    size_t tile = kernels.localWorkSize * kernels.elementsOneThread;
+    cl_uint groups = static_cast<cl_uint>((size + tile - 1) / tile);
+    bool segmented = kernels.variant.segmented;
+
+    buffers.push_back(runtime.buffers().acquire(groups * kernels.variant.elementSize()));
+    cl_mem sumsBuffer = buffers.back().get();
+    cl_mem sumFlagsBuffer = nullptr;
+    cl_mem firstHeadBuffer = nullptr;
+    if (segmented) {
+        buffers.push_back(runtime.buffers().acquire(groups * sizeof(cl_uchar)));
+        sumFlagsBuffer = buffers.back().get();
+        buffers.push_back(runtime.buffers().acquire(groups * sizeof(cl_uint)));
+        firstHeadBuffer = buffers.back().get();
+    }
+    events.emplace_back();
+    if (sumsBuffer == nullptr || (segmented && (sumFlagsBuffer == nullptr || firstHeadBuffer == nullptr))) {
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    constexpr size_t workDims = 1;
+    size_t globalWorkSize[workDims] = { groups * kernels.localWorkSize };
+    size_t localWorkSize[workDims]  = { kernels.localWorkSize };
+
+    clSetKernelArg(tiles, 0, sizeof(cl_mem), &input);
+    clSetKernelArg(tiles, 1, sizeof(cl_mem), &output);
+    clSetKernelArg(tiles, 2, sizeof(cl_mem), &sumsBuffer);
+    clSetKernelArg(tiles, 3, sizeof(cl_uint), &size);
+    if (segmented) {
+        clSetKernelArg(tiles, 4, sizeof(cl_mem), &flags);
+        clSetKernelArg(tiles, 5, sizeof(cl_mem), &sumFlagsBuffer);
+        clSetKernelArg(tiles, 6, sizeof(cl_mem), &firstHeadBuffer);
+    }
+    // every element is read and written once
+    double bytes = 2.0 * size * kernels.variant.elementSize();
+    TracedEvent tilesTraced(events.back().out(), TraceKind::Kernel, "tiles_pref_sums", bytes);
+    cl_int res = tilesTraced.done(clEnqueueNDRangeKernel(queue, tiles, workDims, nullptr, globalWorkSize,
+                                                         localWorkSize, waitCount, waitList, tilesTraced.out()));
+    if (groups == 1 || res != CL_SUCCESS) {
+        return res;
+    }
+
+    // raw handles, the events may move when the vector grows
+    cl_event tilesDone = events.back().get();
+    res = scan_level(runtime, queue, kernels, kernels.totals, sumsBuffer, sumsBuffer, sumFlagsBuffer, groups, 1,
+                     &tilesDone, events, buffers);
+    cl_event totalsDone = events.back().get();
+    events.emplace_back();
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+
+    clSetKernelArg(kernels.add, 0, sizeof(cl_mem), &output);
+    clSetKernelArg(kernels.add, 1, sizeof(cl_mem), &sumsBuffer);
+    clSetKernelArg(kernels.add, 2, sizeof(cl_uint), &size);
+    if (segmented) {
+        clSetKernelArg(kernels.add, 3, sizeof(cl_mem), &firstHeadBuffer);
+    }
+    TracedEvent addTraced(events.back().out(), TraceKind::Kernel, "add_sums", bytes);
+    return addTraced.done(clEnqueueNDRangeKernel(queue, kernels.add, workDims, nullptr, globalWorkSize,
+                                                 localWorkSize, 1, &totalsDone, addTraced.out()));
+}
+
+}
+
+cl_int scan(Runtime &runtime, cl_command_queue queue, const ScanKernels &kernels, cl_mem input, cl_mem output,
+            cl_uint size, std::vector<Event> &events, std::vector<PooledBuffer> &buffers, cl_mem flags,
+            cl_uint waitCount, const cl_event* waitList) {
+    return scan_level(runtime, queue, kernels, kernels.tiles, input, output, flags, size, waitCount, waitList,
+                      events, buffers);
+}
+
+DeviceFuture scan_async(Runtime &runtime, cl_command_queue queue, const ScanKernels &kernels, cl_mem input,
+                        cl_mem output, cl_uint size, const std::vector<DeviceFuture> &after, cl_mem flags) {
+    cl_int res = first_error(after);
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    std::vector<cl_event> waitList = wait_list(after);
+    std::vector<Event> events;
+    std::vector<PooledBuffer> buffers;
+    res = scan_level(runtime, queue, kernels, kernels.tiles, input, output, flags, size,
+                     static_cast<cl_uint>(waitList.size()), waitList.empty() ? nullptr : waitList.data(), events,
+                     buffers);
+    if (res != CL_SUCCESS) {
+        // the commands that did start still use the buffers
+        clFinish(queue);
+        return DeviceFuture(res);
+    }
+    return DeviceFuture(std::move(events.back()), std::move(buffers), after);
+}
+
+bool scan_multi(Runtime &runtime, WorkSplitter &splitter, const ScanKernels &kernels, const float* elements,
+                float* result, size_t size) {
+    if (kernels.variant.name() != ScanVariant().name()) {
+        printf("Multi-device scan needs the float-sum kernels.\n");
+        return false;
+    }
+    std::vector<WorkRange> ranges = splitter.split(size, kernels.localWorkSize * kernels.elementsOneThread);
+    // every part runs on the NUMA node that holds it, where possible
+    numa_match_owners(runtime, elements, sizeof(float), ranges);
+    // parts of zero-copy devices are scanned in place, the others in pooled device buffers
+    std::vector<Mem> inPlace;
+    std::vector<PooledBuffer> parts;
+    std::vector<cl_mem> outputs;
+    std::vector<std::vector<Event>> events(runtime.devices().size());
+    std::vector<PooledBuffer> buffers;
+    std::vector<float> totals(ranges.size());
+    cl_int res = CL_SUCCESS;
+
+    // every device scans its part and reads back the total
+    for (size_t i = 0; i < ranges.size() && res == CL_SUCCESS; ++i) {
+        const WorkRange& range = ranges[i];
+        cl_command_queue queue = runtime.queue(range.device);
+        size_t count = range.end - range.begin;
+        std::vector<Event> &deviceEvents = events[range.device];
+        cl_mem input;
+        if (runtime.zero_copy(range.device)) {
+            cl_context context = runtime.context().get();
+            inPlace.emplace_back(clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, count * sizeof(float),
+                                                const_cast<float*>(elements) + range.begin, &res));
+            input = inPlace.back().get();
+            if (res != CL_SUCCESS) break;
+            inPlace.emplace_back(clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                                                count * sizeof(float), result + range.begin, &res));
+            outputs.push_back(inPlace.back().get());
+            if (res != CL_SUCCESS) break;
+        } else {
+            parts.push_back(runtime.buffers().acquire(count * sizeof(float)));
+            input = parts.back().get();
+            outputs.push_back(input);
+            if (input == nullptr) {
+                res = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+                break;
+            }
+            deviceEvents.emplace_back();
+            TracedEvent traced(deviceEvents.back().out(), TraceKind::Write, "scan part",
+                               static_cast<double>(count * sizeof(float)));
+            res = traced.done(clEnqueueWriteBuffer(queue, input, CL_FALSE, 0, count * sizeof(float),
+                                                   elements + range.begin, 0, nullptr, traced.out()));
+            if (res != CL_SUCCESS) break;
+        }
+        res = scan(runtime, queue, kernels, input, outputs.back(), static_cast<cl_uint>(count), deviceEvents,
+                   buffers);
+        if (res != CL_SUCCESS) break;
+        deviceEvents.emplace_back();
+        TracedEvent totalTraced(deviceEvents.back().out(), TraceKind::Read, "scan total", sizeof(float));
+        res = totalTraced.done(clEnqueueReadBuffer(queue, outputs.back(), CL_FALSE, (count - 1) * sizeof(float),
+                                                   sizeof(float), &totals[i], 0, nullptr, totalTraced.out()));
+        clFlush(queue);
+    }
+    for (const WorkRange &range : ranges) {
+        clFinish(runtime.queue(range.device));
+    }
+
+    // the offset of a part is the sum of the totals before it
+    float offset = 0.0f;
+    for (size_t i = 0; i < ranges.size() && res == CL_SUCCESS; ++i) {
+        const WorkRange& range = ranges[i];
+        cl_command_queue queue = runtime.queue(range.device);
+        cl_uint count = static_cast<cl_uint>(range.end - range.begin);
+        cl_mem output = outputs[i];
+        std::vector<Event> &deviceEvents = events[range.device];
+        if (i > 0) {
+            size_t globalWorkSize[1] = { (count + kernels.localWorkSize - 1) / kernels.localWorkSize *
+                                         kernels.localWorkSize };
+            size_t localWorkSize[1]  = { kernels.localWorkSize };
+            clSetKernelArg(kernels.offset, 0, sizeof(cl_mem), &output);
+            clSetKernelArg(kernels.offset, 1, sizeof(float), &offset);
+            clSetKernelArg(kernels.offset, 2, sizeof(cl_uint), &count);
+            deviceEvents.emplace_back();
+            TracedEvent traced(deviceEvents.back().out(), TraceKind::Kernel, "add_offset", 2.0 * count * sizeof(float));
+            res = traced.done(clEnqueueNDRangeKernel(queue, kernels.offset, 1, nullptr, globalWorkSize, localWorkSize,
+                                                     0, nullptr, traced.out()));
+            if (res != CL_SUCCESS) break;
+        }
+        deviceEvents.emplace_back();
+        if (runtime.zero_copy(range.device)) {
+            // map and unmap make the result visible in the host array
+            TracedEvent mapTraced(nullptr, TraceKind::Map, "scan part");
+            void* mapped = clEnqueueMapBuffer(queue, output, CL_FALSE, CL_MAP_READ, 0, count * sizeof(float), 0,
+                                              nullptr, mapTraced.out(), &res);
+            if (mapTraced.done(res) != CL_SUCCESS) break;
+            TracedEvent traced(deviceEvents.back().out(), TraceKind::Unmap, "scan part");
+            res = traced.done(clEnqueueUnmapMemObject(queue, output, mapped, 0, nullptr, traced.out()));
+        } else {
+            TracedEvent traced(deviceEvents.back().out(), TraceKind::Read, "scan part",
+                               static_cast<double>(count * sizeof(float)));
+            res = traced.done(clEnqueueReadBuffer(queue, output, CL_FALSE, 0, count * sizeof(float),
+                                                  result + range.begin, 0, nullptr, traced.out()));
+        }
+        clFlush(queue);
+        offset += totals[i];
+    }
+    for (const WorkRange &range : ranges) {
+        clFinish(runtime.queue(range.device));
+    }
+    if (res != CL_SUCCESS) {
+        printf("Multi-device scan failed. Error: %d\n", res);
+        return false;
+    }
+
+    for (const WorkRange &range : ranges) {
+        splitter.record(range.device, static_cast<double>(range.end - range.begin),
+                        events_span(events[range.device]) / 1e9);
+    }
+    return true;
+}
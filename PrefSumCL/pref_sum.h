@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../Runtime/runtime.h"
+#include "../Runtime/work_split.h"
+
+enum class ScanType { Float, Int, Long, Double };
+enum class ScanOp { Sum, Min, Max };
+
+// Element type, operator and kind of a scan; every variant is one build of function_pref_sum.cl.
+struct ScanVariant {
+    ScanType type      { ScanType::Float };
+    ScanOp   op        { ScanOp::Sum };
+    // element i gets the result of the elements before i
+    bool     exclusive { false };
+    // the scan restarts at every element with a nonzero head flag (one cl_uchar per element)
+    bool     segmented { false };
+
+    size_t elementSize() const;
+    // -D options of the build
+    std::string options() const;
+    // "float-sum", "int-max-exclusive-segmented", ...
+    std::string name() const;
+};
+
+// Parses a name made by ScanVariant::name. False if it isn't one.
+bool parse_scan_variant(const std::string& name, ScanVariant& variant);
+
+struct ScanKernels {
+    ScanVariant variant;
+    cl_kernel tiles             { nullptr };
+    // the inclusive tiles kernel of the variant, for the tile totals
+    cl_kernel totals            { nullptr };
+    cl_kernel add               { nullptr };
+    cl_kernel offset            { nullptr };
+    size_t    localWorkSize     { 256 };
+    size_t    elementsOneThread { 4 };
+};
+
+// Builds tiles_pref_sums, add_sums and add_offset of kernels.variant from function_pref_sum.cl.
+// False if they can't be built.
+bool load_scan_kernels(Runtime &runtime, ScanKernels &kernels);
+
+// Scans size elements of input into output (they may be the same buffer) on queue.
+// Tile totals are scanned recursively and added back, so any size is supported; an empty input only
+// enqueues a marker.
+// flags are the head flags of a segmented variant and are ignored otherwise.
+// The first kernel waits for waitList, events.back() is the last one. If a temporary buffer can't be
+// acquired or a kernel can't be enqueued, nothing more is enqueued, events.back() is empty and the error
+// is returned.
+// Every enqueued kernel event is appended to events, every temporary buffer to buffers;
+// keep the buffers until the events complete.
+cl_int scan(Runtime &runtime, cl_command_queue queue, const ScanKernels &kernels, cl_mem input, cl_mem output,
+            cl_uint size, std::vector<Event> &events, std::vector<PooledBuffer> &buffers, cl_mem flags = nullptr,
+            cl_uint waitCount = 0, const cl_event* waitList = nullptr);
+
+// scan without blocking: the scan starts after the futures in after and the returned future completes
+// with it. The temporary buffers live as long as the future. Use Runtime::async_queue to overlap
+// independent scans. A failed dependency fails the scan without enqueueing it.
+DeviceFuture scan_async(Runtime &runtime, cl_command_queue queue, const ScanKernels &kernels, cl_mem input,
+                        cl_mem output, cl_uint size, const std::vector<DeviceFuture> &after = {},
+                        cl_mem flags = nullptr);
+
+// Scans size host elements into result on all devices of the runtime (inclusive float sum kernels), one in-order queue per device.
+// The array is split between the devices by splitter, every device scans its part, then the totals
+// of the previous parts are added on the devices. The measured throughput is recorded into splitter.
+// Zero-copy devices scan their part in place, each part goes to the NUMA sub-device of its node if any.
+bool scan_multi(Runtime &runtime, WorkSplitter &splitter, const ScanKernels &kernels, const float* elements,
+                float* result, size_t size);
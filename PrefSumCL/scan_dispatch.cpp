@@ -0,0 +1,93 @@
+#include "scan_dispatch.h"
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <vector>
+#include "scan.h"
+#include "../utils.h"
+
+namespace {
+
+// calibration sizes are 4^k from MIN_SIZE to MAX_SIZE, the best of REPEATS runs counts
+constexpr size_t MIN_SIZE = 1 << 12;
+constexpr size_t MAX_SIZE = 1 << 22;
+constexpr int REPEATS = 3;
+
+template<typename Function>
+double best_time(Function run) {
+    double best = -1.0;
+    for (int i = 0; i < REPEATS; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        if (!run()) {
+            return -1.0;
+        }
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (best < 0 || time < best) best = time;
+    }
+    return best;
+}
+
+}
+
+ScanDispatcher::ScanDispatcher(Runtime* runtime) : runtime_(runtime), threshold_(SIZE_MAX) {
+    if (runtime_ == nullptr || !runtime_->valid() || !load_scan_kernels(*runtime_, kernels_)) {
+        runtime_ = nullptr;
+        return;
+    }
+    calibrate();
+}
+
+bool ScanDispatcher::scan(const float* elements, float* result, size_t size) {
+    if (!uses_opencl(size)) {
+        inclusiveScan(elements, result, size);
+        return true;
+    }
+    return scan_opencl(elements, result, size);
+}
+
+bool ScanDispatcher::scan_opencl(const float* elements, float* result, size_t size) {
+    // the scan kernels count elements in cl_uint
+    if (size > UINT_MAX) {
+        return false;
+    }
+    cl_command_queue queue = runtime_->queue();
+    HostBuffer elementsBuffer(*runtime_, const_cast<float*>(elements), size * sizeof(float), CL_MEM_READ_ONLY);
+    HostBuffer resultBuffer(*runtime_, result, size * sizeof(float), CL_MEM_READ_WRITE);
+    if (!elementsBuffer.get() || !resultBuffer.get() || elementsBuffer.upload(queue) != CL_SUCCESS ||
+        resultBuffer.upload(queue) != CL_SUCCESS) {
+        return false;
+    }
+    std::vector<Event> events;
+    std::vector<PooledBuffer> buffers;
+    if (::scan(*runtime_, queue, kernels_, elementsBuffer.get(), resultBuffer.get(), static_cast<cl_uint>(size),
+               events, buffers) != CL_SUCCESS) {
+        // the commands that did start still use the buffers
+        clFinish(queue);
+        return false;
+    }
+    return resultBuffer.download(queue) == CL_SUCCESS;
+}
+
+void ScanDispatcher::calibrate() {
+    float* elements = alloc_array<float>(MAX_SIZE);
+    float* result = alloc_array<float>(MAX_SIZE);
+    for (size_t i = 0; i < MAX_SIZE; ++i) {
+        elements[i] = 1.0f;
+    }
+    // the threshold is the smallest size from which OpenCL stays faster
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+        double cpu = best_time([&]() {
+            inclusiveScan(elements, result, size);
+            return true;
+        });
+        double opencl = best_time([&]() { return scan_opencl(elements, result, size); });
+        timings_.push_back({ size, cpu, opencl });
+        if (opencl > 0 && opencl < cpu) {
+            threshold_ = std::min(threshold_, size);
+        } else {
+            threshold_ = SIZE_MAX;
+        }
+    }
+    clear_array(elements);
+    clear_array(result);
+}
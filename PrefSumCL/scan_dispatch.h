@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "pref_sum.h"
+
+// Scans host arrays on the CPU engine (OpenMP/scan.h) or on the OpenCL device, whichever is faster
+// for the size. Small arrays are dominated by kernel launches and transfers, so the CPU wins up to
+// some size. That threshold is measured when the dispatcher is created: both paths scan arrays
+// of growing size host to host, and OpenCL is used from the size where it becomes faster.
+class ScanDispatcher {
+public:
+    // Best times of one calibration size in seconds, negative if the path failed.
+    struct Timing {
+        size_t size;
+        double cpu;
+        double opencl;
+    };
+
+    // Without a valid runtime every scan runs on the CPU.
+    explicit ScanDispatcher(Runtime* runtime);
+
+    // result[i] = elements[0] + ... + elements[i]. False if the OpenCL path failed.
+    bool scan(const float* elements, float* result, size_t size);
+
+    bool uses_opencl(size_t size) const { return size >= threshold_; }
+    // Smallest size scanned with OpenCL, SIZE_MAX if the CPU always wins.
+    size_t threshold() const { return threshold_; }
+    // The measurements the threshold was chosen from, empty without a valid runtime.
+    const std::vector<Timing>& timings() const { return timings_; }
+
+private:
+    bool scan_opencl(const float* elements, float* result, size_t size);
+    void calibrate();
+
+    Runtime* runtime_;
+    ScanKernels kernels_;
+    size_t threshold_;
+    std::vector<Timing> timings_;
+};
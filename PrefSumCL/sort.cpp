@@ -0,0 +1,266 @@
+#include "sort.h"
+#include "../Runtime/trace.h"
+#include <cstdio>
+#include <string>
+#include <utility>
+
+namespace {
+
+const char* const TYPE_NAMES[] = { "float", "int", "long", "double" };
+
+// digits of function_sort.cl
+constexpr cl_uint RADIX_BITS = 4;
+constexpr cl_uint RADIX = 1 << RADIX_BITS;
+
+std::string tile_options(size_t localWorkSize, size_t elementsOneThread) {
+    return "-D LOCAL_GROUP_SIZE=" + std::to_string(localWorkSize) +
+           " -D ELEMENTS=" + std::to_string(elementsOneThread);
+}
+
+bool load_offsets_kernels(Runtime &runtime, ScanKernels &offsets) {
+    offsets.variant.type = ScanType::Int;
+    offsets.variant.op = ScanOp::Sum;
+    offsets.variant.exclusive = true;
+    return load_scan_kernels(runtime, offsets);
+}
+
+// The compared value as an element of the type.
+void set_value_arg(cl_kernel kernel, cl_uint index, ScanType type, double value) {
+    switch (type) {
+        case ScanType::Int: {
+            cl_int converted = static_cast<cl_int>(value);
+            clSetKernelArg(kernel, index, sizeof(converted), &converted);
+            break;
+        }
+        case ScanType::Long: {
+            cl_long converted = static_cast<cl_long>(value);
+            clSetKernelArg(kernel, index, sizeof(converted), &converted);
+            break;
+        }
+        case ScanType::Double:
+            clSetKernelArg(kernel, index, sizeof(value), &value);
+            break;
+        default: {
+            cl_float converted = static_cast<cl_float>(value);
+            clSetKernelArg(kernel, index, sizeof(converted), &converted);
+        }
+    }
+}
+
+// Future of the last event of the enqueued commands, or of the error once the commands that did start
+// are done with the buffers.
+DeviceFuture to_future(cl_int res, cl_command_queue queue, std::vector<Event> &events,
+                       std::vector<PooledBuffer> &buffers, const std::vector<DeviceFuture> &after) {
+    if (res != CL_SUCCESS) {
+        clFinish(queue);
+        return DeviceFuture(res);
+    }
+    if (events.empty() || !events.back()) {
+        return DeviceFuture(CL_INVALID_EVENT);
+    }
+    return DeviceFuture(std::move(events.back()), std::move(buffers), after);
+}
+
+}
+
+bool load_compact_kernels(Runtime &runtime, CompactKernels &kernels) {
+    if (kernels.type == ScanType::Double && !runtime.info().fp64) {
+        printf("%s doesn't support double.\n", runtime.info().name.c_str());
+        return false;
+    }
+    std::string options = tile_options(kernels.localWorkSize, kernels.elementsOneThread) +
+                          " -D T=" + TYPE_NAMES[static_cast<int>(kernels.type)] +
+                          " -D COMPARE=" + std::to_string(static_cast<int>(kernels.compare));
+    if (kernels.type == ScanType::Double) {
+        options += " -D SORT_FP64";
+    }
+    kernels.counts = runtime.kernel("function_sort.cl", options, "compact_counts");
+    kernels.scatter = runtime.kernel("function_sort.cl", options, "compact_scatter");
+    return kernels.counts != nullptr && kernels.scatter != nullptr && load_offsets_kernels(runtime, kernels.offsets);
+}
+
+cl_int compact(Runtime &runtime, cl_command_queue queue, const CompactKernels &kernels, cl_mem input, cl_mem output,
+               cl_mem count, cl_uint size, double value, std::vector<Event> &events,
+               std::vector<PooledBuffer> &buffers, cl_uint waitCount, const cl_event* waitList) {
+    if (size == 0) {
+        static const cl_uint zero = 0;
+        events.emplace_back();
+        TracedEvent traced(events.back().out(), TraceKind::Write, "compact count", sizeof(zero));
+        return traced.done(clEnqueueWriteBuffer(queue, count, CL_FALSE, 0, sizeof(zero), &zero, waitCount, waitList,
+                                                traced.out()));
+    }
+    size_t tile = kernels.localWorkSize * kernels.elementsOneThread;
+    cl_uint groups = static_cast<cl_uint>((size + tile - 1) / tile);
+    buffers.push_back(runtime.buffers().acquire(groups * sizeof(cl_uint)));
+    cl_mem counts = buffers.back().get();
+    if (counts == nullptr) {
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    size_t globalWorkSize[1] = { groups * kernels.localWorkSize };
+    size_t localWorkSize[1]  = { kernels.localWorkSize };
+    ScanVariant elements;
+    elements.type = kernels.type;
+    double bytes = static_cast<double>(size) * elements.elementSize();
+
+    clSetKernelArg(kernels.counts, 0, sizeof(cl_mem), &input);
+    clSetKernelArg(kernels.counts, 1, sizeof(cl_mem), &counts);
+    clSetKernelArg(kernels.counts, 2, sizeof(cl_uint), &size);
+    set_value_arg(kernels.counts, 3, kernels.type, value);
+    events.emplace_back();
+    TracedEvent countsTraced(events.back().out(), TraceKind::Kernel, "compact_counts", bytes);
+    cl_int res = countsTraced.done(clEnqueueNDRangeKernel(queue, kernels.counts, 1, nullptr, globalWorkSize,
+                                                          localWorkSize, waitCount, waitList, countsTraced.out()));
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+    cl_event countsDone = events.back().get();
+    res = scan(runtime, queue, kernels.offsets, counts, counts, groups, events, buffers, nullptr, 1, &countsDone);
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+    cl_event offsetsDone = events.back().get();
+
+    clSetKernelArg(kernels.scatter, 0, sizeof(cl_mem), &input);
+    clSetKernelArg(kernels.scatter, 1, sizeof(cl_mem), &output);
+    clSetKernelArg(kernels.scatter, 2, sizeof(cl_mem), &counts);
+    clSetKernelArg(kernels.scatter, 3, sizeof(cl_mem), &count);
+    clSetKernelArg(kernels.scatter, 4, sizeof(cl_uint), &size);
+    set_value_arg(kernels.scatter, 5, kernels.type, value);
+    events.emplace_back();
+    // at most every element is written back
+    TracedEvent scatterTraced(events.back().out(), TraceKind::Kernel, "compact_scatter", 2.0 * bytes);
+    return scatterTraced.done(clEnqueueNDRangeKernel(queue, kernels.scatter, 1, nullptr, globalWorkSize,
+                                                     localWorkSize, 1, &offsetsDone, scatterTraced.out()));
+}
+
+DeviceFuture compact_async(Runtime &runtime, cl_command_queue queue, const CompactKernels &kernels, cl_mem input,
+                           cl_mem output, cl_mem count, cl_uint size, double value,
+                           const std::vector<DeviceFuture> &after) {
+    cl_int res = first_error(after);
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    std::vector<cl_event> waitList = wait_list(after);
+    std::vector<Event> events;
+    std::vector<PooledBuffer> buffers;
+    res = compact(runtime, queue, kernels, input, output, count, size, value, events, buffers,
+                  static_cast<cl_uint>(waitList.size()), waitList.empty() ? nullptr : waitList.data());
+    return to_future(res, queue, events, buffers, after);
+}
+
+bool load_sort_kernels(Runtime &runtime, SortKernels &kernels) {
+    if ((kernels.keyBits != 32 && kernels.keyBits != 64) ||
+        (kernels.valueBits != 0 && kernels.valueBits != 32 && kernels.valueBits != 64)) {
+        printf("Radix sort supports 32 and 64-bit keys and values.\n");
+        return false;
+    }
+    std::string options = tile_options(kernels.localWorkSize, kernels.elementsOneThread) +
+                          " -D KEY=" + (kernels.keyBits == 64 ? "ulong" : "uint");
+    if (kernels.valueBits != 0) {
+        options += std::string(" -D VALUE=") + (kernels.valueBits == 64 ? "ulong" : "uint");
+    }
+    kernels.histogram = runtime.kernel("function_sort.cl", options, "radix_histogram");
+    kernels.scatter = runtime.kernel("function_sort.cl", options, "radix_scatter");
+    return kernels.histogram != nullptr && kernels.scatter != nullptr &&
+           load_offsets_kernels(runtime, kernels.offsets);
+}
+
+cl_int radix_sort(Runtime &runtime, cl_command_queue queue, const SortKernels &kernels, cl_mem keys, cl_mem values,
+                  cl_uint size, std::vector<Event> &events, std::vector<PooledBuffer> &buffers,
+                  cl_uint waitCount, const cl_event* waitList) {
+    if (size <= 1) {
+        events.emplace_back();
+        TracedEvent traced(events.back().out(), TraceKind::Marker, "radix_sort");
+        return traced.done(clEnqueueMarkerWithWaitList(queue, waitCount, waitList, traced.out()));
+    }
+    size_t tile = kernels.localWorkSize * kernels.elementsOneThread;
+    cl_uint groups = static_cast<cl_uint>((size + tile - 1) / tile);
+    size_t keySize = kernels.keyBits / 8;
+    size_t valueSize = kernels.valueBits / 8;
+    bool withValues = kernels.valueBits != 0;
+
+    buffers.push_back(runtime.buffers().acquire(size * keySize));
+    cl_mem keysTemp = buffers.back().get();
+    cl_mem valuesTemp = nullptr;
+    if (withValues) {
+        buffers.push_back(runtime.buffers().acquire(size * valueSize));
+        valuesTemp = buffers.back().get();
+    }
+    cl_uint histogramSize = RADIX * groups;
+    buffers.push_back(runtime.buffers().acquire(histogramSize * sizeof(cl_uint)));
+    cl_mem histograms = buffers.back().get();
+    if (keysTemp == nullptr || (withValues && valuesTemp == nullptr) || histograms == nullptr) {
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+    size_t globalWorkSize[1] = { groups * kernels.localWorkSize };
+    size_t localWorkSize[1]  = { kernels.localWorkSize };
+    double keyBytes = static_cast<double>(size) * keySize;
+    double moveBytes = 2.0 * size * (keySize + valueSize);
+
+    // every pass reads one buffer of the pair and writes the other, the passes are ordered by their events
+    cl_mem keysIn = keys;
+    cl_mem keysOut = keysTemp;
+    cl_mem valuesIn = values;
+    cl_mem valuesOut = valuesTemp;
+    cl_event previous = nullptr;
+    for (cl_uint shift = 0; shift < kernels.keyBits; shift += RADIX_BITS) {
+        clSetKernelArg(kernels.histogram, 0, sizeof(cl_mem), &keysIn);
+        clSetKernelArg(kernels.histogram, 1, sizeof(cl_mem), &histograms);
+        clSetKernelArg(kernels.histogram, 2, sizeof(cl_uint), &size);
+        clSetKernelArg(kernels.histogram, 3, sizeof(cl_uint), &shift);
+        events.emplace_back();
+        TracedEvent histogramTraced(events.back().out(), TraceKind::Kernel, "radix_histogram", keyBytes);
+        cl_int res = histogramTraced.done(clEnqueueNDRangeKernel(
+                queue, kernels.histogram, 1, nullptr, globalWorkSize, localWorkSize,
+                previous == nullptr ? waitCount : 1, previous == nullptr ? waitList : &previous,
+                histogramTraced.out()));
+        if (res != CL_SUCCESS) {
+            return res;
+        }
+        cl_event histogramDone = events.back().get();
+        res = scan(runtime, queue, kernels.offsets, histograms, histograms, histogramSize, events, buffers, nullptr,
+                   1, &histogramDone);
+        if (res != CL_SUCCESS) {
+            return res;
+        }
+        cl_event offsetsDone = events.back().get();
+
+        cl_uint arg = 0;
+        clSetKernelArg(kernels.scatter, arg++, sizeof(cl_mem), &keysIn);
+        clSetKernelArg(kernels.scatter, arg++, sizeof(cl_mem), &keysOut);
+        if (withValues) {
+            clSetKernelArg(kernels.scatter, arg++, sizeof(cl_mem), &valuesIn);
+            clSetKernelArg(kernels.scatter, arg++, sizeof(cl_mem), &valuesOut);
+        }
+        clSetKernelArg(kernels.scatter, arg++, sizeof(cl_mem), &histograms);
+        clSetKernelArg(kernels.scatter, arg++, sizeof(cl_uint), &size);
+        clSetKernelArg(kernels.scatter, arg++, sizeof(cl_uint), &shift);
+        events.emplace_back();
+        TracedEvent scatterTraced(events.back().out(), TraceKind::Kernel, "radix_scatter", moveBytes);
+        res = scatterTraced.done(clEnqueueNDRangeKernel(queue, kernels.scatter, 1, nullptr, globalWorkSize,
+                                                        localWorkSize, 1, &offsetsDone, scatterTraced.out()));
+        if (res != CL_SUCCESS) {
+            return res;
+        }
+        previous = events.back().get();
+        std::swap(keysIn, keysOut);
+        std::swap(valuesIn, valuesOut);
+    }
+    return CL_SUCCESS;
+}
+
+DeviceFuture radix_sort_async(Runtime &runtime, cl_command_queue queue, const SortKernels &kernels, cl_mem keys,
+                              cl_mem values, cl_uint size, const std::vector<DeviceFuture> &after) {
+    cl_int res = first_error(after);
+    if (res != CL_SUCCESS) {
+        return DeviceFuture(res);
+    }
+    std::vector<cl_event> waitList = wait_list(after);
+    std::vector<Event> events;
+    std::vector<PooledBuffer> buffers;
+    res = radix_sort(runtime, queue, kernels, keys, values, size, events, buffers,
+                     static_cast<cl_uint>(waitList.size()), waitList.empty() ? nullptr : waitList.data());
+    return to_future(res, queue, events, buffers, after);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include "pref_sum.h"
+
+// Device operations built on the scan (function_sort.cl): every tile of the input is counted,
+// the counts of all tiles are scanned on the device, and every tile writes its elements from its offset.
+// The data stays on the device between the kernels and the host doesn't wait for any of them.
+
+// Elements kept by compact: element OP value.
+enum class CompareOp { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+struct CompactKernels {
+    ScanType    type    { ScanType::Float };
+    CompareOp   compare { CompareOp::NotEqual };
+    cl_kernel   counts  { nullptr };
+    cl_kernel   scatter { nullptr };
+    // exclusive int sum of the tile counts
+    ScanKernels offsets;
+    size_t      localWorkSize     { 256 };
+    size_t      elementsOneThread { 4 };
+};
+
+// Builds the compaction kernels of kernels.type and kernels.compare. False if they can't be built.
+bool load_compact_kernels(Runtime &runtime, CompactKernels &kernels);
+
+// Copies the size elements of input for which `element OP value` holds to the front of output,
+// in their order, and writes their number to count (one cl_uint) on the device.
+// The first kernel waits for waitList, events.back() is the last command. Every enqueued event is
+// appended to events, every temporary buffer to buffers; keep the buffers until the events complete.
+cl_int compact(Runtime &runtime, cl_command_queue queue, const CompactKernels &kernels, cl_mem input, cl_mem output,
+               cl_mem count, cl_uint size, double value, std::vector<Event> &events,
+               std::vector<PooledBuffer> &buffers, cl_uint waitCount = 0, const cl_event* waitList = nullptr);
+
+// compact without blocking, see scan_async.
+DeviceFuture compact_async(Runtime &runtime, cl_command_queue queue, const CompactKernels &kernels, cl_mem input,
+                           cl_mem output, cl_mem count, cl_uint size, double value,
+                           const std::vector<DeviceFuture> &after = {});
+
+// LSD radix sort of unsigned 32 or 64-bit keys, 4 bits per pass, optionally with 32 or 64-bit values.
+struct SortKernels {
+    size_t      keyBits   { 32 };
+    // 0 sorts keys only
+    size_t      valueBits { 0 };
+    cl_kernel   histogram { nullptr };
+    cl_kernel   scatter   { nullptr };
+    // exclusive int sum of the digit counts of the tiles
+    ScanKernels offsets;
+    size_t      localWorkSize     { 128 };
+    size_t      elementsOneThread { 8 };
+};
+
+// Builds the sort kernels of kernels.keyBits and kernels.valueBits. False if they can't be built.
+bool load_sort_kernels(Runtime &runtime, SortKernels &kernels);
+
+// Sorts size keys and their values (nullptr without values) in place, stable.
+// Every pass is histogram -> scan -> scatter between keys and a pooled buffer of the same size;
+// the number of passes is even, so the result ends up in keys. Events and buffers as in compact.
+cl_int radix_sort(Runtime &runtime, cl_command_queue queue, const SortKernels &kernels, cl_mem keys, cl_mem values,
+                  cl_uint size, std::vector<Event> &events, std::vector<PooledBuffer> &buffers,
+                  cl_uint waitCount = 0, const cl_event* waitList = nullptr);
+
+// radix_sort without blocking, see scan_async.
+DeviceFuture radix_sort_async(Runtime &runtime, cl_command_queue queue, const SortKernels &kernels, cl_mem keys,
+                              cl_mem values, cl_uint size, const std::vector<DeviceFuture> &after = {});
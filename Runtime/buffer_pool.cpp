@@ -0,0 +1,70 @@
+#include "buffer_pool.h"
+#include <cstdio>
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : pool_(other.pool_), buffer_(other.buffer_), size_(other.size_), flags_(other.flags_) {
+    other.buffer_ = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    std::swap(pool_, other.pool_);
+    std::swap(buffer_, other.buffer_);
+    std::swap(size_, other.size_);
+    std::swap(flags_, other.flags_);
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    if (buffer_ != nullptr && pool_ != nullptr) {
+        pool_->release(buffer_, size_, flags_);
+    } else if (buffer_ != nullptr) {
+        clReleaseMemObject(buffer_);
+    }
+}
+
+BufferPool::~BufferPool() {
+    clear();
+}
+
+PooledBuffer BufferPool::acquire(size_t size, cl_mem_flags flags) {
+    if (size == 0) {
+        size = 1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = free_.lower_bound(std::make_pair(flags, size));
+        if (it != free_.end() && it->first.first == flags && it->first.second <= 2 * size) {
+            PooledBuffer res(this, it->second, it->first.second, flags);
+            free_.erase(it);
+            ++reuses_;
+            return res;
+        }
+    }
+    cl_int result;
+    cl_mem buffer = clCreateBuffer(context_, flags, size, nullptr, &result);
+    if (result != CL_SUCCESS) {
+        // drop the cached buffers and retry, the device may simply be full
+        clear();
+        buffer = clCreateBuffer(context_, flags, size, nullptr, &result);
+    }
+    if (result != CL_SUCCESS) {
+        printf("Can't create buffer of %zu bytes. Error code: %d\n", size, result);
+        return PooledBuffer();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++allocations_;
+    return PooledBuffer(this, buffer, size, flags);
+}
+
+void BufferPool::release(cl_mem buffer, size_t size, cl_mem_flags flags) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.emplace(std::make_pair(flags, size), buffer);
+}
+
+void BufferPool::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : free_) {
+        clReleaseMemObject(entry.second);
+    }
+    free_.clear();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "handle.h"
+#include <map>
+#include <mutex>
+#include <utility>
+
+class BufferPool;
+
+// Buffer borrowed from a BufferPool. It goes back to the pool when destroyed.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool* pool, cl_mem buffer, size_t size, cl_mem_flags flags)
+        : pool_(pool), buffer_(buffer), size_(size), flags_(flags) {}
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer();
+
+    cl_mem get() const { return buffer_; }
+    // Capacity, which may be larger than the requested size.
+    size_t size() const { return size_; }
+    explicit operator bool() const { return buffer_ != nullptr; }
+
+private:
+    BufferPool*  pool_   { nullptr };
+    cl_mem       buffer_ { nullptr };
+    size_t       size_   { 0 };
+    cl_mem_flags flags_  { 0 };
+};
+
+// Keeps released device buffers and hands them out again for requests of similar size.
+// A buffer is reused for a request of size s if its capacity is in [s, 2s].
+// Reuse is only safe on the same in-order queue, or after the previous user's commands finished.
+class BufferPool {
+public:
+    explicit BufferPool(cl_context context) : context_(context) {}
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    PooledBuffer acquire(size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+    void release(cl_mem buffer, size_t size, cl_mem_flags flags);
+    // Frees every buffer that is currently in the pool.
+    void clear();
+
+    size_t allocations() const { return allocations_; }
+    size_t reuses() const { return reuses_; }
+
+private:
+    cl_context context_;
+    std::multimap<std::pair<cl_mem_flags, size_t>, cl_mem> free_;
+    size_t allocations_ { 0 };
+    size_t reuses_      { 0 };
+    std::mutex mutex_;
+};
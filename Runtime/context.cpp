@@ -0,0 +1,40 @@
+#include "context.h"
+#include <cstdio>
+
+Context::Context(const std::vector<cl_device_id>& devices) : devices_(devices) {
+    if (devices_.empty()) {
+        return;
+    }
+    cl_int result;
+    context_ = clCreateContext(nullptr, static_cast<cl_uint>(devices_.size()), devices_.data(), nullptr, nullptr,
+                               &result);
+    if (context_ == nullptr || result != CL_SUCCESS) {
+        printf("Can't create context! Error code: %d\n", result);
+        context_ = nullptr;
+    }
+}
+
+Context::~Context() {
+    queues_.clear();
+    if (context_ != nullptr) clReleaseContext(context_);
+    // sub-devices from DeviceSelector, a no-op for root devices
+    for (cl_device_id device : devices_) {
+        clReleaseDevice(device);
+    }
+}
+
+cl_command_queue Context::queue(size_t device, cl_command_queue_properties props, size_t index) {
+    if (context_ == nullptr || device >= devices_.size()) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    Queue& queue = queues_[std::make_tuple(device, props, index)];
+    if (!queue) {
+        cl_int result;
+        queue.reset(clCreateCommandQueue(context_, devices_[device], props, &result));
+        if (result != CL_SUCCESS) {
+            printf("Can't create command queue! Error code: %d\n", result);
+        }
+    }
+    return queue.get();
+}
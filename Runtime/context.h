@@ -0,0 +1,33 @@
+#pragma once
+#include "handle.h"
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+// OpenCL context over a set of devices together with a pool of command queues.
+// Queues are created on first use and live as long as the context.
+// The context takes ownership of sub-devices among the devices.
+class Context {
+public:
+    explicit Context(const std::vector<cl_device_id>& devices);
+    ~Context();
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    bool valid() const { return context_ != nullptr; }
+    cl_context get() const { return context_; }
+    const std::vector<cl_device_id>& devices() const { return devices_; }
+
+    // Queue of devices()[device] with the given properties; profiling is on by default.
+    // Different indices give independent queues of the same device, e.g. for overlapping transfers.
+    cl_command_queue queue(size_t device = 0, cl_command_queue_properties props = CL_QUEUE_PROFILING_ENABLE,
+                           size_t index = 0);
+
+private:
+    std::vector<cl_device_id> devices_;
+    cl_context context_ { nullptr };
+    std::map<std::tuple<size_t, cl_command_queue_properties, size_t>, Queue> queues_;
+    std::mutex mutex_;
+};
@@ -0,0 +1,135 @@
+#include "device_selector.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+std::string device_string(cl_device_id device, cl_device_info param) {
+    size_t size = 0;
+    if (clGetDeviceInfo(device, param, 0, nullptr, &size) != CL_SUCCESS || size == 0) {
+        return std::string();
+    }
+    std::string res(size, '\0');
+    clGetDeviceInfo(device, param, size, &res[0], nullptr);
+    res.resize(size - 1);
+    return res;
+}
+
+}
+
+DeviceInfo device_info(cl_device_id device) {
+    DeviceInfo info;
+    cl_bool unified = CL_FALSE;
+    info.device = device;
+    clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(info.platform), &info.platform, nullptr);
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(info.type), &info.type, nullptr);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(info.computeUnits), &info.computeUnits, nullptr);
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, nullptr);
+    info.hostUnifiedMemory = unified == CL_TRUE || (info.type & CL_DEVICE_TYPE_CPU) != 0;
+    info.name = device_string(device, CL_DEVICE_NAME);
+    info.version = device_string(device, CL_DRIVER_VERSION);
+    std::string extensions = device_string(device, CL_DEVICE_EXTENSIONS);
+    info.fp64 = extensions.find("cl_khr_fp64") != std::string::npos;
+    info.fp16 = extensions.find("cl_khr_fp16") != std::string::npos;
+    cl_command_queue_properties queueProps = 0;
+    clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(queueProps), &queueProps, nullptr);
+    info.outOfOrder = (queueProps & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+    clGetDeviceInfo(device, CL_DEVICE_PARENT_DEVICE, sizeof(info.parent), &info.parent, nullptr);
+    cl_device_partition_property partition[3] = { 0, 0, 0 };
+    if (info.parent != nullptr &&
+        clGetDeviceInfo(device, CL_DEVICE_PARTITION_TYPE, sizeof(partition), partition, nullptr) == CL_SUCCESS &&
+        partition[0] == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN && partition[1] == CL_DEVICE_AFFINITY_DOMAIN_NUMA) {
+        // the node number is the position among the siblings, see Runtime
+        info.numaNode = 0;
+    }
+    return info;
+}
+
+DeviceSelector::DeviceSelector(cl_device_type preferred, bool numa) : preferred_(preferred), numa_(numa) {
+    const char* numaEnv = getenv("OPENCL_NUMA");
+    if (numaEnv != nullptr) {
+        numa_ = strcmp(numaEnv, "0") != 0;
+    }
+    const char* env = getenv("OPENCL_DEVICE_TYPE");
+    if (env == nullptr) {
+        return;
+    }
+    if (strcmp(env, "cpu") == 0) {
+        preferred_ = CL_DEVICE_TYPE_CPU;
+    } else if (strcmp(env, "gpu") == 0) {
+        preferred_ = CL_DEVICE_TYPE_GPU;
+    } else if (strcmp(env, "all") == 0) {
+        preferred_ = CL_DEVICE_TYPE_ALL;
+    }
+}
+
+std::vector<cl_device_id> DeviceSelector::select() const {
+    std::vector<cl_device_id> devices = devices_of_type(preferred_);
+    if (devices.empty() && preferred_ != CL_DEVICE_TYPE_CPU) {
+        devices = devices_of_type(CL_DEVICE_TYPE_CPU);
+    }
+    if (devices.empty()) {
+        printf("Can't find OpenCL devices!\n");
+    }
+    return numa_ ? split_numa(devices) : devices;
+}
+
+std::vector<cl_device_id> DeviceSelector::split_numa(const std::vector<cl_device_id>& devices) const {
+    std::vector<cl_device_id> res;
+    for (cl_device_id device : devices) {
+        cl_device_type type = 0;
+        cl_device_affinity_domain domains = 0;
+        clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, nullptr);
+        clGetDeviceInfo(device, CL_DEVICE_PARTITION_AFFINITY_DOMAIN, sizeof(domains), &domains, nullptr);
+        if ((type & CL_DEVICE_TYPE_CPU) == 0 || (domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA) == 0) {
+            res.push_back(device);
+            continue;
+        }
+        const cl_device_partition_property properties[] = {
+            CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+        };
+        cl_uint count = 0;
+        cl_int result = clCreateSubDevices(device, properties, 0, nullptr, &count);
+        if (result != CL_SUCCESS || count < 2) {
+            // a single node, nothing to split
+            if (result != CL_SUCCESS && result != CL_DEVICE_PARTITION_FAILED) {
+                printf("Can't partition device by NUMA nodes. Error code: %d\n", result);
+            }
+            res.push_back(device);
+            continue;
+        }
+        std::vector<cl_device_id> subDevices(count);
+        clCreateSubDevices(device, properties, count, subDevices.data(), nullptr);
+        res.insert(res.end(), subDevices.begin(), subDevices.end());
+    }
+    return res;
+}
+
+std::vector<cl_device_id> DeviceSelector::devices_of_type(cl_device_type type) const {
+    cl_uint platformsCount = 0;
+    cl_int result = clGetPlatformIDs(0, nullptr, &platformsCount);
+    if (result != CL_SUCCESS || platformsCount == 0) {
+        printf("Can't get platforms count! Error code: %d\n", result);
+        return {};
+    }
+    std::vector<cl_platform_id> platforms(platformsCount);
+    clGetPlatformIDs(platformsCount, platforms.data(), nullptr);
+
+    for (cl_platform_id platform : platforms) {
+        cl_uint devicesCount = 0;
+        result = clGetDeviceIDs(platform, type, 0, nullptr, &devicesCount);
+        if (result != CL_SUCCESS || devicesCount == 0) {
+            continue;
+        }
+        std::vector<cl_device_id> devices(devicesCount);
+        result = clGetDeviceIDs(platform, type, devicesCount, devices.data(), nullptr);
+        if (result != CL_SUCCESS) {
+            printf("Can't get devices list! Error code: %d\n", result);
+            continue;
+        }
+        return devices;
+    }
+    return {};
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+struct DeviceInfo {
+    cl_platform_id platform          { nullptr };
+    cl_device_id   device            { nullptr };
+    cl_device_type type              { 0 };
+    std::string    name;
+    std::string    version;
+    cl_uint        computeUnits      { 0 };
+    bool           hostUnifiedMemory { false };
+    // cl_khr_fp64, double in kernels
+    bool           fp64              { false };
+    // cl_khr_fp16, native half arithmetic and conversions
+    bool           fp16              { false };
+    // queues may run commands out of order, only ordered by their wait lists
+    bool           outOfOrder        { false };
+    // for sub-devices
+    cl_device_id   parent            { nullptr };
+    // NUMA node of a sub-device made by partitioning by the NUMA affinity domain, -1 otherwise
+    int            numaNode          { -1 };
+};
+
+DeviceInfo device_info(cl_device_id device);
+
+// Chooses the devices of the first platform that has any of the requested type.
+// GPUs are preferred, CPU devices are the fallback.
+// OPENCL_DEVICE_TYPE=cpu|gpu|all in the environment overrides the preference.
+// With numa (or OPENCL_NUMA=1) CPU devices spanning several NUMA nodes are replaced by
+// one sub-device per node, in node order.
+class DeviceSelector {
+public:
+    explicit DeviceSelector(cl_device_type preferred = CL_DEVICE_TYPE_GPU, bool numa = false);
+
+    std::vector<cl_device_id> select() const;
+
+private:
+    std::vector<cl_device_id> devices_of_type(cl_device_type type) const;
+    std::vector<cl_device_id> split_numa(const std::vector<cl_device_id>& devices) const;
+
+    cl_device_type preferred_;
+    bool numa_;
+};
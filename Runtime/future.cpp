@@ -0,0 +1,64 @@
+#include "future.h"
+#include <utility>
+
+DeviceFuture::DeviceFuture(cl_int status) : status_(status) {}
+
+DeviceFuture::DeviceFuture(Event event, std::vector<PooledBuffer> buffers, const std::vector<DeviceFuture>& after)
+    : state_(std::make_shared<State>()) {
+    state_->event = std::move(event);
+    state_->buffers = std::move(buffers);
+    for (const DeviceFuture& future : after) {
+        if (future.state_) {
+            state_->after.push_back(future.state_);
+        }
+    }
+}
+
+// The buffers can be handed out again only after the commands that use them are done.
+DeviceFuture::State::~State() {
+    if (event && !buffers.empty()) {
+        clWaitForEvents(1, event.address());
+    }
+}
+
+bool DeviceFuture::ready() const {
+    if (!state_ || !state_->event) {
+        return true;
+    }
+    cl_int status = CL_QUEUED;
+    clGetEventInfo(state_->event.get(), CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    // negative statuses are errors, the command won't run any further
+    return status <= CL_COMPLETE;
+}
+
+cl_int DeviceFuture::wait() const {
+    if (status_ != CL_SUCCESS || !state_ || !state_->event) {
+        return status_;
+    }
+    cl_int res = clWaitForEvents(1, state_->event.address());
+    if (res != CL_SUCCESS) {
+        return res;
+    }
+    cl_int status = CL_COMPLETE;
+    clGetEventInfo(state_->event.get(), CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    return status < 0 ? status : CL_SUCCESS;
+}
+
+std::vector<cl_event> wait_list(const std::vector<DeviceFuture>& futures) {
+    std::vector<cl_event> res;
+    for (const DeviceFuture& future : futures) {
+        if (future.event() != nullptr) {
+            res.push_back(future.event());
+        }
+    }
+    return res;
+}
+
+cl_int first_error(const std::vector<DeviceFuture>& futures) {
+    for (const DeviceFuture& future : futures) {
+        if (!future.ok()) {
+            return future.status();
+        }
+    }
+    return CL_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include "buffer_pool.h"
+#include "handle.h"
+#include <memory>
+#include <vector>
+
+// Result of an operation that was enqueued without waiting for it: the event of its last command
+// and the temporary device buffers its commands use.
+//
+// Futures are passed as dependencies of later operations, which wait for their events on the device,
+// so a chain like scan -> gemm -> scan runs without returning to the host, and independent chains
+// overlap on an out-of-order queue (Runtime::async_queue). Copies share the state; the temporary
+// buffers go back to the pool once the last copy and the last dependent future are gone
+// and the commands are complete.
+class DeviceFuture {
+public:
+    DeviceFuture() = default;
+    // A failed operation: status is its error and the future has no event.
+    explicit DeviceFuture(cl_int status);
+    // The futures the operation waits for are kept with it, so intermediate futures of a chain
+    // may be dropped without blocking on their buffers.
+    DeviceFuture(Event event, std::vector<PooledBuffer> buffers, const std::vector<DeviceFuture>& after = {});
+
+    // The event of the last command, nullptr for an empty or failed future.
+    cl_event event() const { return state_ ? state_->event.get() : nullptr; }
+    cl_int status() const { return status_; }
+    bool ok() const { return status_ == CL_SUCCESS; }
+
+    // Whether the commands are complete; doesn't block.
+    bool ready() const;
+    // Blocks until the commands are complete. The error of the operation or of its commands.
+    cl_int wait() const;
+
+private:
+    struct State {
+        Event event;
+        std::vector<PooledBuffer> buffers;
+        std::vector<std::shared_ptr<State>> after;
+        ~State();
+    };
+
+    std::shared_ptr<State> state_;
+    cl_int status_ { CL_SUCCESS };
+};
+
+// Wait list of the futures that have events. Failed futures are skipped, check them first.
+std::vector<cl_event> wait_list(const std::vector<DeviceFuture>& futures);
+
+// Error of the first failed future, CL_SUCCESS if none failed.
+cl_int first_error(const std::vector<DeviceFuture>& futures);
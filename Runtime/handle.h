@@ -0,0 +1,89 @@
+#pragma once
+#include <CL/opencl.h>
+#include <utility>
+
+// Retain/release functions for every OpenCL object type wrapped by Handle.
+template<typename T>
+struct HandleTraits;
+
+template<>
+struct HandleTraits<cl_context> {
+    static cl_int retain(cl_context h)  { return clRetainContext(h); }
+    static cl_int release(cl_context h) { return clReleaseContext(h); }
+};
+
+template<>
+struct HandleTraits<cl_command_queue> {
+    static cl_int retain(cl_command_queue h)  { return clRetainCommandQueue(h); }
+    static cl_int release(cl_command_queue h) { return clReleaseCommandQueue(h); }
+};
+
+template<>
+struct HandleTraits<cl_program> {
+    static cl_int retain(cl_program h)  { return clRetainProgram(h); }
+    static cl_int release(cl_program h) { return clReleaseProgram(h); }
+};
+
+template<>
+struct HandleTraits<cl_kernel> {
+    static cl_int retain(cl_kernel h)  { return clRetainKernel(h); }
+    static cl_int release(cl_kernel h) { return clReleaseKernel(h); }
+};
+
+template<>
+struct HandleTraits<cl_mem> {
+    static cl_int retain(cl_mem h)  { return clRetainMemObject(h); }
+    static cl_int release(cl_mem h) { return clReleaseMemObject(h); }
+};
+
+template<>
+struct HandleTraits<cl_event> {
+    static cl_int retain(cl_event h)  { return clRetainEvent(h); }
+    static cl_int release(cl_event h) { return clReleaseEvent(h); }
+};
+
+// Owning reference to an OpenCL object. Copies retain, destruction releases.
+template<typename T>
+class Handle {
+public:
+    Handle() = default;
+    explicit Handle(T handle) : handle_(handle) {}
+    Handle(const Handle& other) : handle_(other.handle_) {
+        if (handle_ != nullptr) HandleTraits<T>::retain(handle_);
+    }
+    Handle(Handle&& other) noexcept : handle_(other.handle_) {
+        other.handle_ = nullptr;
+    }
+    Handle& operator=(Handle other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    ~Handle() {
+        reset();
+    }
+
+    T get() const { return handle_; }
+    // For wait lists and arrays of arguments: &handle without giving up ownership.
+    const T* address() const { return &handle_; }
+    explicit operator bool() const { return handle_ != nullptr; }
+
+    // Releases the current object and returns the slot for clEnqueue*/clCreate* out parameters.
+    T* out() {
+        reset();
+        return &handle_;
+    }
+
+    void reset(T handle = nullptr) {
+        if (handle_ != nullptr) HandleTraits<T>::release(handle_);
+        handle_ = handle;
+    }
+
+private:
+    T handle_ { nullptr };
+};
+
+using Queue   = Handle<cl_command_queue>;
+using Program = Handle<cl_program>;
+using Kernel  = Handle<cl_kernel>;
+using Mem     = Handle<cl_mem>;
+using Event   = Handle<cl_event>;
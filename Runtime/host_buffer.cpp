@@ -0,0 +1,102 @@
+#include "host_buffer.h"
+#include "runtime.h"
+#include "trace.h"
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+#include "../utils.h"
+
+HostBuffer::HostBuffer(Runtime& runtime, void* host, size_t size, cl_mem_flags flags)
+    : runtime_(&runtime), host_(host), size_(size) {
+    cl_int result = CL_SUCCESS;
+    // USE_HOST_PTR is only copy-free for page-aligned arrays
+    bool aligned = reinterpret_cast<uintptr_t>(host) % HOST_PAGE_BYTES == 0;
+    if (runtime.zero_copy() && aligned && size > 0) {
+        buffer_.reset(clCreateBuffer(runtime.context().get(), flags | CL_MEM_USE_HOST_PTR, size, host, &result));
+        zeroCopy_ = result == CL_SUCCESS;
+    }
+    if (!zeroCopy_) {
+        buffer_.reset(clCreateBuffer(runtime.context().get(), flags, size > 0 ? size : 1, nullptr, &result));
+    }
+    if (result != CL_SUCCESS) {
+        printf("Can't create buffer of %zu bytes. Error code: %d\n", size, result);
+    }
+}
+
+HostBuffer::HostBuffer(HostBuffer&& other) noexcept
+    : runtime_(other.runtime_), host_(other.host_), size_(other.size_), zeroCopy_(other.zeroCopy_),
+      buffer_(std::move(other.buffer_)), mapped_(other.mapped_), mapping_(other.mapping_) {
+    other.mapped_ = nullptr;
+    other.mapping_ = nullptr;
+}
+
+HostBuffer& HostBuffer::operator=(HostBuffer&& other) noexcept {
+    std::swap(runtime_, other.runtime_);
+    std::swap(host_, other.host_);
+    std::swap(size_, other.size_);
+    std::swap(zeroCopy_, other.zeroCopy_);
+    std::swap(buffer_, other.buffer_);
+    std::swap(mapped_, other.mapped_);
+    std::swap(mapping_, other.mapping_);
+    return *this;
+}
+
+HostBuffer::~HostBuffer() {
+    if (mapped_ != nullptr) {
+        TracedEvent traced(nullptr, TraceKind::Unmap, "release");
+        traced.done(clEnqueueUnmapMemObject(mapped_, buffer_.get(), mapping_, 0, nullptr, traced.out()));
+        clFinish(mapped_);
+    }
+}
+
+cl_int HostBuffer::upload(cl_command_queue queue, cl_uint waitCount, const cl_event* waitList, cl_event* event) {
+    if (!zeroCopy_) {
+        runtime_->count_copy(size_);
+        TracedEvent traced(event, TraceKind::Write, "upload", static_cast<double>(size_));
+        return traced.done(clEnqueueWriteBuffer(queue, buffer_.get(), CL_FALSE, 0, size_, host_, waitCount, waitList,
+                                                traced.out()));
+    }
+    if (mapped_ != nullptr) {
+        TracedEvent traced(event, TraceKind::Unmap, "upload");
+        cl_int result = clEnqueueUnmapMemObject(mapped_, buffer_.get(), mapping_, waitCount, waitList, traced.out());
+        mapped_ = nullptr;
+        mapping_ = nullptr;
+        return traced.done(result);
+    }
+    // the buffer already aliases the array
+    if (event != nullptr || waitCount > 0) {
+        TracedEvent traced(event, TraceKind::Marker, "upload");
+        return traced.done(clEnqueueMarkerWithWaitList(queue, waitCount, waitList, traced.out()));
+    }
+    return CL_SUCCESS;
+}
+
+cl_int HostBuffer::download(cl_command_queue queue, cl_bool blocking, cl_uint waitCount, const cl_event* waitList,
+                            cl_event* event) {
+    if (!zeroCopy_) {
+        runtime_->count_copy(size_);
+        TracedEvent traced(event, TraceKind::Read, "download", static_cast<double>(size_));
+        return traced.done(clEnqueueReadBuffer(queue, buffer_.get(), blocking, 0, size_, host_, waitCount, waitList,
+                                               traced.out()));
+    }
+    if (mapped_ != nullptr) {
+        if (waitCount == 0 && event == nullptr) {
+            return CL_SUCCESS;
+        }
+        TracedEvent traced(event, TraceKind::Marker, "download");
+        return traced.done(clEnqueueMarkerWithWaitList(queue, waitCount, waitList, traced.out()));
+    }
+    cl_int result;
+    // USE_HOST_PTR mappings return host_ itself
+    TracedEvent traced(event, TraceKind::Map, "download");
+    mapping_ = clEnqueueMapBuffer(queue, buffer_.get(), blocking, CL_MAP_READ | CL_MAP_WRITE, 0, size_, waitCount,
+                                  waitList, traced.out(), &result);
+    traced.done(result);
+    if (result == CL_SUCCESS) {
+        mapped_ = queue;
+        if (mapping_ != host_) {
+            printf("Mapping of a host buffer moved the data.\n");
+        }
+    }
+    return result;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "handle.h"
+#include <cstddef>
+
+class Runtime;
+
+// Device buffer bound to a host array.
+//
+// When the device shares memory with the host and the array is page-aligned (see alloc_array),
+// the buffer is created with CL_MEM_USE_HOST_PTR over the array and kept coherent by map/unmap,
+// so no data is copied. Otherwise upload() and download() are explicit writes and reads,
+// and their size is added to Runtime::copied_bytes().
+//
+// The array belongs to the device between upload() and download():
+// fill it before creating the buffer or before upload(), read it after download().
+class HostBuffer {
+public:
+    HostBuffer() = default;
+    HostBuffer(Runtime& runtime, void* host, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+    HostBuffer(HostBuffer&& other) noexcept;
+    HostBuffer& operator=(HostBuffer&& other) noexcept;
+    HostBuffer(const HostBuffer&) = delete;
+    HostBuffer& operator=(const HostBuffer&) = delete;
+    ~HostBuffer();
+
+    cl_mem get() const { return buffer_.get(); }
+    size_t size() const { return size_; }
+    bool zeroCopy() const { return zeroCopy_; }
+
+    // Hands the host data to the device.
+    cl_int upload(cl_command_queue queue, cl_uint waitCount = 0, const cl_event* waitList = nullptr,
+                  cl_event* event = nullptr);
+    // Makes the device data visible in the host array. Blocks when blocking is set.
+    cl_int download(cl_command_queue queue, cl_bool blocking = CL_TRUE, cl_uint waitCount = 0,
+                    const cl_event* waitList = nullptr, cl_event* event = nullptr);
+
+private:
+    Runtime*         runtime_  { nullptr };
+    void*            host_     { nullptr };
+    size_t           size_     { 0 };
+    bool             zeroCopy_ { false };
+    Mem              buffer_;
+    // queue that holds the mapping, nullptr while the device owns the data
+    cl_command_queue mapped_   { nullptr };
+    void*            mapping_  { nullptr };
+};
@@ -0,0 +1,98 @@
+#include "numa.h"
+#include <cstdio>
+#include <cstdint>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+
+// from linux/mempolicy.h
+constexpr int MPOL_BIND_MODE       = 2;
+constexpr int MPOL_INTERLEAVE_MODE = 3;
+constexpr unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+constexpr unsigned long MPOL_F_NODE_FLAG = 1 << 0;
+constexpr unsigned long MPOL_F_ADDR_FLAG = 1 << 1;
+constexpr size_t NODE_MASK_BITS = 64;
+
+const size_t PAGE = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+bool bind(void* data, size_t size, int mode, unsigned long mask) {
+    // mbind works on whole pages, the partial page at the start is left alone
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + PAGE - 1) / PAGE * PAGE;
+    uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+    if (end <= begin) {
+        return true;
+    }
+    return syscall(SYS_mbind, begin, end - begin, mode, &mask, NODE_MASK_BITS + 1, MPOL_MF_MOVE_FLAG) == 0;
+}
+
+}
+
+size_t numa_node_count() {
+    static size_t count = [] {
+        // "0" or "0-1"
+        FILE* f = fopen("/sys/devices/system/node/online", "r");
+        if (f == nullptr) {
+            return size_t(1);
+        }
+        unsigned first = 0;
+        unsigned last = 0;
+        int parsed = fscanf(f, "%u-%u", &first, &last);
+        fclose(f);
+        return parsed == 2 && last >= first ? size_t(last + 1) : size_t(1);
+    }();
+    return count;
+}
+
+bool numa_bind(void* data, size_t size, int node) {
+    if (node < 0 || static_cast<size_t>(node) >= NODE_MASK_BITS || numa_node_count() < 2) {
+        return false;
+    }
+    return bind(data, size, MPOL_BIND_MODE, 1ul << node);
+}
+
+bool numa_interleave(void* data, size_t size) {
+    size_t nodes = numa_node_count();
+    if (nodes < 2 || nodes > NODE_MASK_BITS) {
+        return false;
+    }
+    unsigned long mask = nodes == NODE_MASK_BITS ? ~0ul : (1ul << nodes) - 1;
+    return bind(data, size, MPOL_INTERLEAVE_MODE, mask);
+}
+
+int numa_node_of(const void* address) {
+    if (numa_node_count() < 2) {
+        return 0;
+    }
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE_FLAG | MPOL_F_ADDR_FLAG) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+void numa_place(const Runtime& runtime, void* data, size_t itemBytes, const std::vector<WorkRange>& ranges) {
+    char* bytes = static_cast<char*>(data);
+    for (const WorkRange& range : ranges) {
+        int node = runtime.info(range.device).numaNode;
+        if (node >= 0) {
+            numa_bind(bytes + range.begin * itemBytes, (range.end - range.begin) * itemBytes, node);
+        }
+    }
+}
+
+void numa_match_owners(const Runtime& runtime, const void* data, size_t itemBytes, std::vector<WorkRange>& ranges) {
+    const char* bytes = static_cast<const char*>(data);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        int node = numa_node_of(bytes + ranges[i].begin * itemBytes);
+        if (node < 0 || runtime.info(ranges[i].device).numaNode == node) continue;
+        for (size_t j = 0; j < ranges.size(); ++j) {
+            // the device of range j is on the node, and range j isn't placed there
+            if (runtime.info(ranges[j].device).numaNode == node && numa_node_of(bytes + ranges[j].begin * itemBytes) != node) {
+                std::swap(ranges[i].device, ranges[j].device);
+                break;
+            }
+        }
+    }
+}
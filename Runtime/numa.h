@@ -0,0 +1,27 @@
+#pragma once
+#include "work_split.h"
+#include <cstddef>
+#include <vector>
+
+// NUMA placement of host arrays, through the Linux mbind/get_mempolicy system calls.
+// Everything degrades to a no-op on hosts with one node or without NUMA support.
+
+// Number of online NUMA nodes, 1 if it can't be read.
+size_t numa_node_count();
+
+// Binds the pages of [data, data + size) to node. Pages that were already touched are moved.
+bool numa_bind(void* data, size_t size, int node);
+
+// Spreads the pages of [data, data + size) round-robin over all nodes, for data every node reads.
+bool numa_interleave(void* data, size_t size);
+
+// Node of the page holding address, -1 if unknown.
+int numa_node_of(const void* address);
+
+// Puts items [begin, end) of every range on the node of its device (see DeviceInfo::numaNode).
+// Items are itemBytes long; pages shared by two ranges stay with the first one.
+void numa_place(const Runtime& runtime, void* data, size_t itemBytes, const std::vector<WorkRange>& ranges);
+
+// Swaps the devices of the ranges so that every range runs on the node that holds its first item,
+// where such a device exists.
+void numa_match_owners(const Runtime& runtime, const void* data, size_t itemBytes, std::vector<WorkRange>& ranges);
@@ -0,0 +1,226 @@
+#include "program_cache.h"
+#include "device_selector.h"
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+
+namespace {
+
+// FNV-1a
+uint64_t hash(const std::string& data, uint64_t seed = 14695981039346656037ULL) {
+    uint64_t res = seed;
+    for (char c : data) {
+        res ^= static_cast<unsigned char>(c);
+        res *= 1099511628211ULL;
+    }
+    return res;
+}
+
+bool read_file(const std::string& filename, std::string& data) {
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f == nullptr) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long fileSize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(fileSize > 0 ? static_cast<size_t>(fileSize) : 0);
+    size_t read = data.empty() ? 0 : fread(&data[0], 1, data.size(), f);
+    fclose(f);
+    return read == data.size();
+}
+
+void print_build_log(cl_program program, cl_device_id device) {
+    size_t size = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &size);
+    std::string log(size, '\0');
+    if (size > 0) {
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, &log[0], nullptr);
+    }
+    printf("%s\n", log.c_str());
+}
+
+double millis_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+ProgramCache::ProgramCache(Context& context) : context_(context) {
+    const char* env = getenv("OPENCL_CACHE_DIR");
+    directory_ = env != nullptr ? env : "cl_cache";
+    mkdir(directory_.c_str(), 0755);
+
+    // binaries are only valid for the same devices and drivers
+    for (cl_device_id device : context_.devices()) {
+        DeviceInfo info = device_info(device);
+        devicesId_ += info.name + ";" + info.version + ";";
+    }
+}
+
+uint64_t ProgramCache::key(const std::string& source, const std::string& options) const {
+    return hash(devicesId_, hash(options, hash(source)));
+}
+
+cl_program ProgramCache::program(const std::string& filename, const std::string& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto source = sources_.find(filename);
+    if (source == sources_.end()) {
+        std::string code;
+        if (!read_file(filename, code)) {
+            printf("Can't read program source %s\n", filename.c_str());
+            return nullptr;
+        }
+        source = sources_.emplace(filename, code).first;
+    }
+
+    uint64_t programKey = key(source->second, options);
+    Program& program = programs_[programKey];
+    if (program) {
+        return program.get();
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(programKey));
+    std::string path = directory_ + "/" + name;
+
+    auto start = std::chrono::steady_clock::now();
+    program = load_binaries(path, options);
+    if (program) {
+        printf("Program was loaded from cache in %f ms.\n", millis_since(start));
+        Trace::instance().host(TraceKind::Compile, "load " + filename, options, start,
+                               std::chrono::steady_clock::now());
+        return program.get();
+    }
+    program = build_from_source(source->second, options);
+    Trace::instance().host(TraceKind::Compile, "build " + filename, options, start, std::chrono::steady_clock::now());
+    if (program) {
+        printf("Program was built in %f ms.\n", millis_since(start));
+        store_binaries(program.get(), path);
+    }
+    return program.get();
+}
+
+cl_kernel ProgramCache::kernel(const std::string& filename, const std::string& options, const std::string& name) {
+    cl_program prog = program(filename, options);
+    if (prog == nullptr) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    Kernel& kernel = kernels_[std::make_pair(prog, name)];
+    if (!kernel) {
+        cl_int result;
+        kernel.reset(clCreateKernel(prog, name.c_str(), &result));
+        if (result != CL_SUCCESS) {
+            printf("Can't create kernel %s. Error: %d\n", name.c_str(), result);
+        }
+    }
+    return kernel.get();
+}
+
+Program ProgramCache::build_from_source(const std::string& source, const std::string& options) {
+    cl_int result;
+    const char* code = source.c_str();
+    size_t size = source.size();
+    Program program(clCreateProgramWithSource(context_.get(), 1, &code, &size, &result));
+    if (result != CL_SUCCESS) {
+        printf("Can't create program from source. Error: %d\n", result);
+        return Program();
+    }
+    const std::vector<cl_device_id>& devices = context_.devices();
+    result = clBuildProgram(program.get(), static_cast<cl_uint>(devices.size()), devices.data(), options.c_str(),
+                            nullptr, nullptr);
+    if (result != CL_SUCCESS) {
+        printf("Can't build program. Error: %d\n", result);
+        print_build_log(program.get(), devices[0]);
+        return Program();
+    }
+    return program;
+}
+
+// File layout: for every device of the context a 64-bit size followed by the binary.
+Program ProgramCache::load_binaries(const std::string& path, const std::string& options) {
+    std::string data;
+    if (!read_file(path, data)) {
+        return Program();
+    }
+    const std::vector<cl_device_id>& devices = context_.devices();
+    std::vector<size_t> sizes;
+    std::vector<const unsigned char*> binaries;
+    size_t offset = 0;
+    for (size_t i = 0; i < devices.size(); ++i) {
+        uint64_t size = 0;
+        if (offset + sizeof(size) > data.size()) {
+            return Program();
+        }
+        memcpy(&size, data.data() + offset, sizeof(size));
+        offset += sizeof(size);
+        if (offset + size > data.size()) {
+            return Program();
+        }
+        sizes.push_back(static_cast<size_t>(size));
+        binaries.push_back(reinterpret_cast<const unsigned char*>(data.data() + offset));
+        offset += size;
+    }
+
+    cl_int result;
+    std::vector<cl_int> status(devices.size());
+    Program program(clCreateProgramWithBinary(context_.get(), static_cast<cl_uint>(devices.size()), devices.data(),
+                                              sizes.data(), binaries.data(), status.data(), &result));
+    if (result != CL_SUCCESS) {
+        printf("Cached binary %s is stale, rebuilding.\n", path.c_str());
+        return Program();
+    }
+    result = clBuildProgram(program.get(), static_cast<cl_uint>(devices.size()), devices.data(), options.c_str(),
+                            nullptr, nullptr);
+    if (result != CL_SUCCESS) {
+        printf("Cached binary %s is stale, rebuilding.\n", path.c_str());
+        return Program();
+    }
+    return program;
+}
+
+void ProgramCache::store_binaries(cl_program program, const std::string& path) {
+    const std::vector<cl_device_id>& devices = context_.devices();
+    std::vector<size_t> sizes(devices.size());
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizes.size() * sizeof(size_t), sizes.data(),
+                         nullptr) != CL_SUCCESS) {
+        return;
+    }
+    for (size_t size : sizes) {
+        if (size == 0) {
+            return;
+        }
+    }
+    std::vector<std::vector<unsigned char>> binaries(devices.size());
+    std::vector<unsigned char*> pointers(devices.size());
+    for (size_t i = 0; i < devices.size(); ++i) {
+        binaries[i].resize(sizes[i]);
+        pointers[i] = binaries[i].data();
+    }
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, pointers.size() * sizeof(unsigned char*), pointers.data(),
+                         nullptr) != CL_SUCCESS) {
+        return;
+    }
+
+    // write to a temporary file first so a concurrent reader never sees a partial entry
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) {
+        return;
+    }
+    bool ok = true;
+    for (size_t i = 0; i < devices.size(); ++i) {
+        uint64_t size = sizes[i];
+        ok = ok && fwrite(&size, sizeof(size), 1, f) == 1;
+        ok = ok && fwrite(binaries[i].data(), 1, sizes[i], f) == sizes[i];
+    }
+    fclose(f);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+    }
+}
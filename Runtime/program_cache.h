@@ -0,0 +1,38 @@
+#pragma once
+#include "context.h"
+#include <map>
+#include <mutex>
+#include <string>
+
+// Builds programs once per (source, options, devices) and keeps them in memory and on disk.
+// Disk entries hold the device binaries from CL_PROGRAM_BINARIES, so a warm start
+// skips the compiler entirely. The directory is OPENCL_CACHE_DIR or ./cl_cache.
+class ProgramCache {
+public:
+    explicit ProgramCache(Context& context);
+
+    ProgramCache(const ProgramCache&) = delete;
+    ProgramCache& operator=(const ProgramCache&) = delete;
+
+    // Program built from the file; nullptr if it can't be read or built.
+    cl_program program(const std::string& filename, const std::string& options);
+
+    // Kernel object of the program. It is shared, so set its arguments right before enqueueing.
+    cl_kernel kernel(const std::string& filename, const std::string& options, const std::string& name);
+
+    const std::string& directory() const { return directory_; }
+
+private:
+    uint64_t key(const std::string& source, const std::string& options) const;
+    Program build_from_source(const std::string& source, const std::string& options);
+    Program load_binaries(const std::string& path, const std::string& options);
+    void store_binaries(cl_program program, const std::string& path);
+
+    Context& context_;
+    std::string directory_;
+    std::string devicesId_;
+    std::map<std::string, std::string> sources_;
+    std::map<uint64_t, Program> programs_;
+    std::map<std::pair<cl_program, std::string>, Kernel> kernels_;
+    std::mutex mutex_;
+};
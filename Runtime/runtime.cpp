@@ -0,0 +1,117 @@
+#include "runtime.h"
+#include "numa.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <unistd.h>
+
+namespace {
+
+// Node of a fresh page first touched by the device: the page is filled through a buffer over it
+// on the device's queue and mapped back. -1 if that fails.
+int first_touch_node(Runtime& runtime, size_t device) {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    void* data = nullptr;
+    if (posix_memalign(&data, page, page) != 0) {
+        return -1;
+    }
+    int node = -1;
+    {
+        cl_int res = CL_SUCCESS;
+        Mem buffer(clCreateBuffer(runtime.context().get(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, page, data,
+                                  &res));
+        cl_command_queue queue = runtime.queue(device);
+        cl_uchar pattern = 1;
+        if (res == CL_SUCCESS) {
+            res = clEnqueueFillBuffer(queue, buffer.get(), &pattern, sizeof(pattern), 0, page, 0, nullptr, nullptr);
+        }
+        if (res == CL_SUCCESS) {
+            void* mapped = clEnqueueMapBuffer(queue, buffer.get(), CL_TRUE, CL_MAP_READ, 0, page, 0, nullptr,
+                                              nullptr, &res);
+            if (res == CL_SUCCESS) res = clEnqueueUnmapMemObject(queue, buffer.get(), mapped, 0, nullptr, nullptr);
+        }
+        clFinish(queue);
+        if (res == CL_SUCCESS) node = numa_node_of(data);
+    }
+    free(data);
+    return node;
+}
+
+}
+
+Runtime::Runtime(const std::vector<cl_device_id>& devices)
+    : context_(devices), programs_(context_), buffers_(context_.get()) {
+    const char* env = getenv("OPENCL_ZERO_COPY");
+    zeroCopyAllowed_ = env == nullptr || strcmp(env, "0") != 0;
+    // NUMA sub-devices of one parent are numbered in the order they come in, which OpenCL doesn't
+    // promise to be the node order of the OS, so the numbering is checked by first touch
+    std::map<cl_device_id, int> nodes;
+    bool numa = false;
+    for (cl_device_id device : devices) {
+        infos_.push_back(device_info(device));
+        DeviceInfo& info = infos_.back();
+        if (info.numaNode >= 0) {
+            info.numaNode = nodes[info.parent]++;
+            numa = true;
+        }
+    }
+    if (numa && valid() && numa_node_count() >= 2) {
+        bool match = true;
+        for (size_t i = 0; i < infos_.size() && match; ++i) {
+            match = infos_[i].numaNode < 0 || first_touch_node(*this, i) == infos_[i].numaNode;
+        }
+        if (!match) {
+            printf("Warning: NUMA sub-devices don't match the nodes of the OS, NUMA placement is off.\n");
+            for (DeviceInfo& info : infos_) {
+                info.numaNode = -1;
+            }
+        }
+    }
+    for (const DeviceInfo& info : infos_) {
+        if (info.numaNode >= 0) {
+            printf("NUMA node %d: ", info.numaNode);
+        }
+        printf("Device: %s (%s), compute units: %u, host memory: %s\n", info.name.c_str(),
+               (info.type & CL_DEVICE_TYPE_GPU) != 0 ? "GPU" : "CPU", info.computeUnits,
+               info.hostUnifiedMemory ? "shared" : "separate");
+    }
+}
+
+bool Runtime::zero_copy(size_t device) const {
+    return zeroCopyAllowed_ && device < infos_.size() && infos_[device].hostUnifiedMemory;
+}
+
+cl_command_queue Runtime::async_queue(size_t device) {
+    if (device >= infos_.size() || !infos_[device].outOfOrder) {
+        return queue(device);
+    }
+    return context_.queue(device, CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+}
+
+Runtime& Runtime::instance() {
+    static Runtime runtime(DeviceSelector().select());
+    return runtime;
+}
+
+double event_time(cl_event event) {
+    cl_ulong time_start = 0;
+    cl_ulong time_end = 0;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, nullptr);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, nullptr);
+    return static_cast<double>(time_end - time_start);
+}
+
+double events_span(const std::vector<Event>& events) {
+    cl_ulong first = 0;
+    cl_ulong last = 0;
+    for (const Event& event : events) {
+        cl_ulong time_start = 0;
+        cl_ulong time_end = 0;
+        clGetEventProfilingInfo(event.get(), CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, nullptr);
+        clGetEventProfilingInfo(event.get(), CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, nullptr);
+        if (first == 0 || time_start < first) first = time_start;
+        if (time_end > last) last = time_end;
+    }
+    return last > first ? static_cast<double>(last - first) : 0.0;
+}
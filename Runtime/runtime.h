@@ -0,0 +1,64 @@
+#pragma once
+#include "buffer_pool.h"
+#include "context.h"
+#include "device_selector.h"
+#include "future.h"
+#include "handle.h"
+#include "host_buffer.h"
+#include "program_cache.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Context, queues, program cache and buffer pool over one set of devices.
+class Runtime {
+public:
+    explicit Runtime(const std::vector<cl_device_id>& devices);
+
+    Runtime(const Runtime&) = delete;
+    Runtime& operator=(const Runtime&) = delete;
+
+    // Process-wide runtime on the devices picked by DeviceSelector.
+    static Runtime& instance();
+
+    bool valid() const { return context_.valid(); }
+    Context& context() { return context_; }
+    ProgramCache& programs() { return programs_; }
+    BufferPool& buffers() { return buffers_; }
+
+    const std::vector<cl_device_id>& devices() const { return context_.devices(); }
+    const DeviceInfo& info(size_t device = 0) const { return infos_[device]; }
+    cl_device_id device(size_t index = 0) const { return context_.devices()[index]; }
+    cl_command_queue queue(size_t device = 0) { return context_.queue(device); }
+    // Out-of-order profiling queue of the device if it has one, its in-order queue otherwise.
+    // Commands on it are only ordered by their wait lists, see DeviceFuture.
+    cl_command_queue async_queue(size_t device = 0);
+
+    cl_kernel kernel(const std::string& filename, const std::string& options, const std::string& name) {
+        return programs_.kernel(filename, options, name);
+    }
+
+    // Host <-> device data movement that HostBuffer had to do with explicit copies.
+    void count_copy(size_t bytes) { copiedBytes_ += bytes; }
+    size_t copied_bytes() const { return copiedBytes_; }
+    void reset_copied_bytes() { copiedBytes_ = 0; }
+
+    // Whether buffers over host arrays can be shared with the device instead of copied.
+    // True for devices with host-unified memory unless OPENCL_ZERO_COPY=0.
+    bool zero_copy(size_t device = 0) const;
+
+private:
+    std::vector<DeviceInfo> infos_;
+    Context context_;
+    ProgramCache programs_;
+    BufferPool buffers_;
+    std::atomic<size_t> copiedBytes_ { 0 };
+    bool zeroCopyAllowed_ { true };
+};
+
+// Kernel time of a command enqueued on a profiling queue, in nanoseconds.
+double event_time(cl_event event);
+
+// Time from the earliest start to the latest end of the commands, in nanoseconds.
+double events_span(const std::vector<Event>& events);
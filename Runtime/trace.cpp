@@ -0,0 +1,241 @@
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <utility>
+
+namespace {
+
+const char* KIND_NAMES[] = { "kernel", "write", "read", "map", "unmap", "copy", "marker", "compile" };
+constexpr size_t KINDS = sizeof(KIND_NAMES) / sizeof(KIND_NAMES[0]);
+
+std::string escape(const std::string& text) {
+    std::string res;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c == '\n' || c == '\t' ? ' ' : c;
+    }
+    return res;
+}
+
+// Command times on the device clock, ns.
+struct CommandTimes {
+    cl_ulong queued { 0 };
+    cl_ulong submit { 0 };
+    cl_ulong start { 0 };
+    cl_ulong end { 0 };
+};
+
+bool command_times(cl_event event, CommandTimes& times) {
+    cl_int status = CL_QUEUED;
+    clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+    return status == CL_COMPLETE &&
+           clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &times.queued,
+                                   nullptr) == CL_SUCCESS &&
+           clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &times.submit,
+                                   nullptr) == CL_SUCCESS &&
+           clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &times.start,
+                                   nullptr) == CL_SUCCESS &&
+           clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &times.end,
+                                   nullptr) == CL_SUCCESS;
+}
+
+std::string device_name(cl_device_id device) {
+    char name[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, nullptr);
+    return name;
+}
+
+}
+
+Trace::Trace() {
+    const char* env = getenv("OPENCL_TRACE");
+    if (env != nullptr && *env != '\0') {
+        start(env);
+    }
+}
+
+Trace& Trace::instance() {
+    static Trace trace;
+    return trace;
+}
+
+void Trace::start(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    path_ = path;
+    start_ = std::chrono::steady_clock::now();
+    commands_.clear();
+    spans_.clear();
+    enabled_ = true;
+}
+
+double Trace::since_start(std::chrono::steady_clock::time_point time) const {
+    return std::chrono::duration<double, std::nano>(time - start_).count();
+}
+
+void Trace::command(cl_event event, TraceKind kind, const std::string& name, double bytes, double flops,
+                    std::chrono::steady_clock::time_point enqueued) {
+    if (!enabled_ || event == nullptr) {
+        return;
+    }
+    clRetainEvent(event);
+    std::lock_guard<std::mutex> lock(mutex_);
+    commands_.push_back({ Event(event), kind, name, bytes, flops, since_start(enqueued) });
+}
+
+void Trace::host(TraceKind kind, const std::string& name, const std::string& detail,
+                 std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end) {
+    if (!enabled_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    spans_.push_back({ kind, name, detail, since_start(begin), since_start(end) });
+}
+
+bool Trace::finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_) {
+        return false;
+    }
+    enabled_ = false;
+
+    // Device clocks are moved to the host clock by the offset of each device. A command is queued
+    // after the host started the enqueue, so enqueued - queued is a lower bound of the offset
+    // and the largest one over the commands of the device is the closest.
+    std::vector<CommandTimes> times(commands_.size());
+    std::vector<bool> complete(commands_.size());
+    std::vector<cl_device_id> devices(commands_.size());
+    std::vector<cl_command_queue> queues(commands_.size());
+    std::map<cl_device_id, double> offsets;
+    size_t skipped = 0;
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        complete[i] = command_times(commands_[i].event.get(), times[i]);
+        if (!complete[i]) {
+            ++skipped;
+            continue;
+        }
+        clGetEventInfo(commands_[i].event.get(), CL_EVENT_COMMAND_QUEUE, sizeof(cl_command_queue), &queues[i],
+                       nullptr);
+        clGetCommandQueueInfo(queues[i], CL_QUEUE_DEVICE, sizeof(cl_device_id), &devices[i], nullptr);
+        double offset = commands_[i].enqueued - static_cast<double>(times[i].queued);
+        auto found = offsets.find(devices[i]);
+        if (found == offsets.end() || offset > found->second) {
+            offsets[devices[i]] = offset;
+        }
+    }
+
+    FILE* f = fopen(path_.c_str(), "w");
+    if (f == nullptr) {
+        printf("Can't write trace to %s\n", path_.c_str());
+        commands_.clear();
+        spans_.clear();
+        return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"Host\"}}");
+
+    // process per device, thread per queue of the device
+    std::map<cl_device_id, int> pids;
+    std::map<cl_command_queue, int> tids;
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        if (!complete[i]) {
+            continue;
+        }
+        if (pids.find(devices[i]) == pids.end()) {
+            int pid = static_cast<int>(pids.size()) + 1;
+            pids[devices[i]] = pid;
+            fprintf(f, ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    pid, escape(device_name(devices[i])).c_str());
+        }
+        if (tids.find(queues[i]) == tids.end()) {
+            int tid = static_cast<int>(tids.size()) + 1;
+            tids[queues[i]] = tid;
+            fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                       "\"args\": {\"name\": \"queue %d\"}}", pids[devices[i]], tid, tid);
+        }
+    }
+
+    double busy[KINDS] = {};
+    double moved[KINDS] = {};
+    size_t counts[KINDS] = {};
+    double first = -1.0;
+    double last = 0.0;
+    for (const Span& span : spans_) {
+        size_t kind = static_cast<size_t>(span.kind);
+        fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"pid\": 0, \"tid\": 0, \"args\": {\"detail\": \"%s\"}}",
+                escape(span.name).c_str(), KIND_NAMES[kind], span.begin / 1e3, (span.end - span.begin) / 1e3,
+                escape(span.detail).c_str());
+        busy[kind] += span.end - span.begin;
+        ++counts[kind];
+        first = first < 0.0 ? span.begin : std::min(first, span.begin);
+        last = std::max(last, span.end);
+    }
+    for (size_t i = 0; i < commands_.size(); ++i) {
+        if (!complete[i]) {
+            continue;
+        }
+        const Command& command = commands_[i];
+        const CommandTimes& t = times[i];
+        size_t kind = static_cast<size_t>(command.kind);
+        double offset = offsets[devices[i]];
+        double begin = static_cast<double>(t.start) + offset;
+        double duration = static_cast<double>(t.end - t.start);
+        // bytes per ns are GB/s, flops per ns GFLOPS
+        double rate = duration > 0.0 ? 1.0 / duration : 0.0;
+        fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"pid\": %d, \"tid\": %d, \"args\": {\"queued_us\": %.3f, \"submit_us\": %.3f, "
+                   "\"wait_us\": %.3f, \"bytes\": %.0f, \"gbps\": %.3f, \"gflops\": %.3f}}",
+                escape(command.name).c_str(), KIND_NAMES[kind], begin / 1e3, duration / 1e3,
+                pids[devices[i]], tids[queues[i]], (static_cast<double>(t.queued) + offset) / 1e3,
+                (static_cast<double>(t.submit) + offset) / 1e3, static_cast<double>(t.start - t.queued) / 1e3,
+                command.bytes, command.bytes * rate, command.flops * rate);
+        busy[kind] += duration;
+        moved[kind] += command.bytes;
+        ++counts[kind];
+        first = first < 0.0 ? begin : std::min(first, begin);
+        last = std::max(last, begin + duration);
+    }
+    fprintf(f, "\n]}\n");
+    bool ok = fclose(f) == 0;
+
+    printf("Trace: %s, %zu commands, %zu host spans, span %f ms.\n", path_.c_str(), commands_.size() - skipped,
+           spans_.size(), first < 0.0 ? 0.0 : (last - first) / 1e6);
+    for (size_t kind = 0; kind < KINDS; ++kind) {
+        if (counts[kind] == 0) {
+            continue;
+        }
+        printf("  %-8s %6zu x, %10.3f ms", KIND_NAMES[kind], counts[kind], busy[kind] / 1e6);
+        if (moved[kind] > 0.0) {
+            printf(", %.2f GB/s", moved[kind] / busy[kind]);
+        }
+        printf("\n");
+    }
+    if (skipped > 0) {
+        printf("  %zu commands were not complete or not profiled and are left out.\n", skipped);
+    }
+    commands_.clear();
+    spans_.clear();
+    return ok;
+}
+
+TracedEvent::TracedEvent(cl_event* event, TraceKind kind, std::string name, double bytes, double flops)
+    : out_(event), kind_(kind), name_(std::move(name)), bytes_(bytes), flops_(flops) {
+    if (Trace::instance().enabled()) {
+        if (out_ == nullptr) {
+            out_ = local_.out();
+        }
+        enqueued_ = std::chrono::steady_clock::now();
+    }
+}
+
+cl_int TracedEvent::done(cl_int result) {
+    Trace& trace = Trace::instance();
+    if (result == CL_SUCCESS && out_ != nullptr && trace.enabled()) {
+        trace.command(*out_, kind_, name_, bytes_, flops_, enqueued_);
+    }
+    return result;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include "handle.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Category of a trace entry.
+enum class TraceKind { Kernel, Write, Read, Map, Unmap, Copy, Marker, Compile };
+
+// Timeline of OpenCL commands and host spans, written as Chrome trace JSON (chrome://tracing or Perfetto).
+//
+// Off unless OPENCL_TRACE names the output file or start() is called. While on, commands enqueued
+// through TracedEvent keep their events. finish() reads QUEUED/SUBMIT/START/END of every command,
+// moves the device times to the host clock and writes one entry per command with its bytes, GB/s and GFLOPS,
+// per device and queue, next to the host spans such as program builds.
+// Commands must be on profiling queues and complete when finish() is called.
+class Trace {
+public:
+    Trace();
+
+    Trace(const Trace&) = delete;
+    Trace& operator=(const Trace&) = delete;
+
+    static Trace& instance();
+
+    bool enabled() const { return enabled_; }
+    // Starts a new trace that finish() writes to path.
+    void start(const std::string& path);
+    // Writes the trace, prints the time spent per kind and stops tracing.
+    bool finish();
+
+    // Records the command of event, enqueued at the given host time.
+    void command(cl_event event, TraceKind kind, const std::string& name, double bytes, double flops,
+                 std::chrono::steady_clock::time_point enqueued);
+    // Records host work between begin and end, detail goes to the arguments of the entry.
+    void host(TraceKind kind, const std::string& name, const std::string& detail,
+              std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+
+private:
+    struct Command {
+        Event event;
+        TraceKind kind;
+        std::string name;
+        double bytes;
+        double flops;
+        // host time of the enqueue, ns from the start of the trace
+        double enqueued;
+    };
+    struct Span {
+        TraceKind kind;
+        std::string name;
+        std::string detail;
+        double begin;
+        double end;
+    };
+
+    double since_start(std::chrono::steady_clock::time_point time) const;
+
+    std::atomic<bool> enabled_ { false };
+    std::string path_;
+    std::chrono::steady_clock::time_point start_;
+    std::vector<Command> commands_;
+    std::vector<Span> spans_;
+    std::mutex mutex_;
+};
+
+// Event out parameter of one traced enqueue:
+//     TracedEvent traced(event, TraceKind::Write, "upload", bytes);
+//     return traced.done(clEnqueueWriteBuffer(..., traced.out()));
+// While tracing, a command enqueued without an event gets a local one, so every command shows up.
+// Otherwise out() is the caller's event and done() only passes the result through.
+class TracedEvent {
+public:
+    TracedEvent(cl_event* event, TraceKind kind, std::string name, double bytes = 0.0, double flops = 0.0);
+
+    TracedEvent(const TracedEvent&) = delete;
+    TracedEvent& operator=(const TracedEvent&) = delete;
+
+    cl_event* out() { return out_; }
+    // Records the command if the enqueue succeeded; returns result.
+    cl_int done(cl_int result);
+
+private:
+    cl_event* out_;
+    Event local_;
+    TraceKind kind_;
+    std::string name_;
+    double bytes_;
+    double flops_;
+    std::chrono::steady_clock::time_point enqueued_;
+};
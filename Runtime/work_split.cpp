@@ -0,0 +1,65 @@
+#include "work_split.h"
+#include <algorithm>
+
+WorkSplitter::WorkSplitter(const Runtime& runtime) {
+    for (size_t i = 0; i < runtime.devices().size(); ++i) {
+        units_.push_back(std::max<cl_uint>(runtime.info(i).computeUnits, 1));
+        measured_.push_back(0.0);
+    }
+}
+
+double WorkSplitter::throughput(size_t device) const {
+    if (measured_[device] > 0) {
+        return measured_[device];
+    }
+    // unmeasured devices are assumed as fast per compute unit as the measured ones
+    double rate = 0.0;
+    double units = 0.0;
+    for (size_t i = 0; i < measured_.size(); ++i) {
+        if (measured_[i] > 0) {
+            rate += measured_[i];
+            units += units_[i];
+        }
+    }
+    return units > 0 ? units_[device] * rate / units : units_[device];
+}
+
+std::vector<WorkRange> WorkSplitter::split(size_t total, size_t granularity) const {
+    std::vector<WorkRange> res;
+    std::vector<double> rates;
+    double sum = 0.0;
+    for (size_t i = 0; i < units_.size(); ++i) {
+        rates.push_back(throughput(i));
+        sum += rates.back();
+    }
+    granularity = std::max<size_t>(granularity, 1);
+
+    double share = 0.0;
+    size_t begin = 0;
+    for (size_t i = 0; i < rates.size() && begin < total; ++i) {
+        share += rates[i];
+        size_t end = total;
+        if (i + 1 < rates.size()) {
+            end = static_cast<size_t>(total * (share / sum) / granularity + 0.5) * granularity;
+            end = std::min(std::max(end, begin), total);
+        }
+        if (end > begin) {
+            WorkRange range;
+            range.device = i;
+            range.begin = begin;
+            range.end = end;
+            res.push_back(range);
+        }
+        begin = end;
+    }
+    return res;
+}
+
+void WorkSplitter::record(size_t device, double work, double seconds) {
+    if (device >= measured_.size() || work <= 0 || seconds <= 0) {
+        return;
+    }
+    double rate = work / seconds;
+    // smoothed against noise
+    measured_[device] = measured_[device] > 0 ? 0.5 * (measured_[device] + rate) : rate;
+}
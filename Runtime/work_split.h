@@ -0,0 +1,34 @@
+#pragma once
+#include "runtime.h"
+#include <vector>
+
+// Part [begin, end) of the work given to one device.
+struct WorkRange {
+    size_t device { 0 };
+    size_t begin  { 0 };
+    size_t end    { 0 };
+};
+
+// Splits work between the devices of a runtime in proportion to their throughput.
+// Keep one splitter per kind of work and feed it with record() after every run.
+// Until a device is measured, its throughput is estimated from its compute units.
+class WorkSplitter {
+public:
+    explicit WorkSplitter(const Runtime& runtime);
+
+    // Consecutive ranges covering [0, total), boundaries are multiples of granularity.
+    // Devices that get no work are left out.
+    std::vector<WorkRange> split(size_t total, size_t granularity = 1) const;
+
+    // Folds work items done by the device in seconds into its throughput.
+    void record(size_t device, double work, double seconds);
+
+    // Work items per second, or the estimate for unmeasured devices.
+    double throughput(size_t device) const;
+    size_t devices() const { return units_.size(); }
+
+private:
+    std::vector<double> units_;
+    // 0 for devices that weren't measured yet
+    std::vector<double> measured_;
+};